@@ -1,7 +1,14 @@
+#include <algorithm>
 #include <iostream>
 #include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <limits>
+#include <utility>
 
 #include <QMouseEvent>
+#include <QOpenGLExtraFunctions>
+#include <QOpenGLFramebufferObject>
 
 #include <glog/logging.h>
 
@@ -12,9 +19,21 @@
 #include "marker.h"
 #include "../Utils/gl_manager.h"
 #include "../Utils/selection.h"
+#include "../Utils/volume.h"
+#include "../Utils/phase_timer.h"
+#include "../Utils/texture_store.h"
 
 bool GUI::Canvas::_gl_block = false;
 
+namespace {
+// far outside of a zoomed-out gigapixel image coordinates exceed int
+int clampToInt(double v) {
+  const double lo = std::numeric_limits<int>::min();
+  const double hi = std::numeric_limits<int>::max();
+  return (int) std::min(std::max(v, lo), hi);
+}
+}; // anonymous namespace
+
 // http://blog.qt.io/blog/2014/09/10/qt-weekly-19-qopenglwidget/
 GUI::Canvas::Canvas(QWidget *parent, ImageWindow* parentWin)
   : QOpenGLWidget(parent), _parent(parent), _parentWin(parentWin) {
@@ -54,7 +73,42 @@ GUI::Canvas::Canvas(QWidget *parent, ImageWindow* parentWin)
 
   _slides = new Slides();
   _marker = new Marker();
-
+  _nonfinite_overlay = false;
+
+  _working_volume = nullptr;
+  _volume_generation = 0;
+  _volume_outdated = false;
+  _thread_volume = new threads::VolumeThread();
+  connect(_thread_volume, &threads::VolumeThread::finished,
+          this, &GUI::Canvas::slotVolumeFinished);
+
+  _scrub_timer = new QTimer(this);
+  _scrub_timer->setSingleShot(true);
+  _scrub_timer->setInterval(200);
+  connect(_scrub_timer, &QTimer::timeout,
+          this, &GUI::Canvas::slotScrubbingFinished);
+
+  _refine_timer = new QTimer(this);
+  _refine_timer->setSingleShot(true);
+  _refine_timer->setInterval(16);
+  connect(_refine_timer, &QTimer::timeout,
+          this, &GUI::Canvas::slotRepaint);
+
+  _snapshot_timer = new QTimer(this);
+  _snapshot_timer->setSingleShot(true);
+  connect(_snapshot_timer, &QTimer::timeout,
+          this, &GUI::Canvas::slotPollSnapshots);
+
+}
+
+GUI::Canvas::~Canvas() {
+  // the volume thread still reads the slices
+  _thread_volume->wait();
+  delete _thread_volume;
+  if (_working_volume != nullptr) {
+    _working_volume->clear();
+    delete _working_volume;
+  }
 }
 
 const GUI::Layer* GUI::Canvas::layer(int i) const {
@@ -88,6 +142,9 @@ void GUI::Canvas::addLayer(Layer *layer) {
 
   connect(layer, &Layer::sigRefresh, this, &Canvas::slotCommunicateLayerChange);
   connect(layer, &Layer::sigHistogramFinished, this, &Canvas::slotCommunicateLayerChange);
+  // the volume holds the display buffers of the slices
+  connect(layer, &Layer::sigApplyOpFinished, this, &Canvas::slotVolumeOutdated);
+  connect(layer, &Layer::sigRefresh, this, &Canvas::slotRebuildVolume);
 
   // canvas gets another image
   _slides->add(layer);
@@ -333,10 +390,84 @@ void GUI::Canvas::mouseReleaseEvent(QMouseEvent* event) {
 
 void GUI::Canvas::wheelEvent( QWheelEvent * event) {
   if (_slides->available() > 0) {
+    if (QGuiApplication::keyboardModifiers() == Qt::AltModifier) {
+      // scrub through z, fast scrolling skips slices
+      const int steps = std::max(1, std::abs(event->delta()) / 120);
+      _slides->scrub(event->delta() > 0 ? steps : -steps);
+      _slides->setScrubbing(true);
+      _scrub_timer->start();
+      slotCommunicateLayerChange();
+      return;
+    }
     zoom_rel(event->pos(), event->delta());
   }
 }
 
+void GUI::Canvas::slotScrubbingFinished() {
+  _slides->setScrubbing(false);
+  update();
+}
+
+void GUI::Canvas::slotBuildVolume() {
+  DLOG(INFO) << "GUI::Canvas::slotBuildVolume";
+  if (_thread_volume->isRunning() || !_slides->sharedGeometry())
+    return;
+
+  std::vector<ImageData_ptr> slices;
+  for (unsigned int n = 0; n < _slides->num(); ++n)
+    slices.push_back(layer(n)->sharedBuffer());
+
+  _working_volume = new Utils::Volume();
+  _volume_generation = _slides->generation();
+  _thread_volume->notify(_working_volume, slices);
+  _thread_volume->start();
+}
+
+void GUI::Canvas::slotVolumeFinished() {
+  DLOG(INFO) << "GUI::Canvas::slotVolumeFinished";
+  // textures of an old volume are released
+  makeCurrent();
+  if (_volume_generation == _slides->generation()) {
+    _slides->setVolume(_working_volume);
+  } else {
+    // slides were added or removed while building
+    _working_volume->clear();
+    delete _working_volume;
+    _volume_outdated = false;
+  }
+  doneCurrent();
+  _working_volume = nullptr;
+  // slices changed while building
+  if (_volume_outdated) {
+    _slides->setVolumeStale();
+    slotRebuildVolume();
+  }
+  slotCommunicateLayerChange();
+}
+
+void GUI::Canvas::slotVolumeOutdated() {
+  if (_slides->volume() == nullptr && !_thread_volume->isRunning())
+    return;
+  _slides->setVolumeStale();
+  _volume_outdated = true;
+  slotRebuildVolume();
+}
+
+void GUI::Canvas::slotRebuildVolume() {
+  if (!_volume_outdated)
+    return;
+  // the volume was removed in the meantime (slides added or removed)
+  if (_slides->volume() == nullptr && !_thread_volume->isRunning()) {
+    _volume_outdated = false;
+    return;
+  }
+  // other slices might still apply their op
+  if (_thread_volume->isRunning() || !_slides->sharedGeometry())
+    return;
+  _volume_outdated = false;
+  slotBuildVolume();
+}
+
 void GUI::Canvas::zoom_rel(QPoint q, int delta) {
 
   const double zoom_delta = sqrt(2.0);
@@ -440,6 +571,31 @@ void GUI::Canvas::checkerboard(unsigned char* data,
   }
 }
 
+QRect GUI::Canvas::visibleRegion() const {
+  const QPoint corners[4] = {
+    canvasToImg(QPoint(0, 0)), canvasToImg(QPoint(width() - 1, 0)),
+    canvasToImg(QPoint(0, height() - 1)), canvasToImg(QPoint(width() - 1, height() - 1))
+  };
+  QRect region(corners[0], corners[0]);
+  for (auto && p : corners)
+    region |= QRect(p, p);
+  return region;
+}
+
+void GUI::Canvas::centerOn(QPoint pixel) {
+  if (!_slides->available())
+    return;
+  // canvasToImg solved for the axis at the center of the canvas
+  const double pixel_size = _axis.pixel_size;
+  const double canvas_width = width() - 1.0;
+  const double canvas_height = height() - 1.0;
+  const double padding_w = 0.5 * (_slides->width() * pixel_size - canvas_width);
+  const double padding_h = 0.5 * (_slides->height() * pixel_size - canvas_height);
+  _axis.x = (0.5 * canvas_width + padding_w) / pixel_size - (pixel.x() + 0.5);
+  _axis.y = (pixel.y() + 0.5) - (0.5 * canvas_height - 1.0 + padding_h) / pixel_size;
+  slotCommunicateCanvasChange();
+}
+
 /**
  * @brief from global canvas position to coordinate within image
  * @details [long description]
@@ -473,7 +629,7 @@ QPoint GUI::Canvas::canvasToImg( QPoint p ) const {
   px = (px + padding_w)  / pixel_size - _axis.x;
   py = (py + padding_h)  / pixel_size + _axis.y;
 
-  return QPoint( (int)px, (int)py);
+  return QPoint(clampToInt(px), clampToInt(py));
 }
 
 QPoint GUI::Canvas::imgToCanvas( QPoint p ) const {
@@ -495,7 +651,7 @@ QPoint GUI::Canvas::imgToCanvas( QPoint p ) const {
   px = (px + _axis.x) * pixel_size - padding_w;
   py = (py - _axis.y) * pixel_size - padding_h + 1;
 
-  return QPoint( (int)px, (int)py);
+  return QPoint(clampToInt(px), clampToInt(py));
 }
 
 Utils::selection_t GUI::Canvas::crop() const {
@@ -523,6 +679,15 @@ void GUI::Canvas::setMarker(Marker m) {
   *_marker = m;
 }
 
+void GUI::Canvas::setNonFiniteOverlay(bool active) {
+  _nonfinite_overlay = active;
+  update();
+}
+
+bool GUI::Canvas::nonFiniteOverlay() const {
+  return _nonfinite_overlay;
+}
+
 
 Utils::selection_t GUI::Canvas::selection() const {
   return _selection;
@@ -560,12 +725,24 @@ void GUI::Canvas::initializeGL() {
   _gl->draw(_bg, -4000, 4000, 4000, -4000, 0);
 
   delete[] _bg->data;
+  Utils::PhaseTimer::startup().mark("initialize OpenGL");
 }
 
 
 void GUI::Canvas::paintGL() {
   while ( !__sync_bool_compare_and_swap (&_gl_block, false, true));
+  _gl->beginFrame();
+  // evicted and released textures of all canvases
+  Utils::TextureStore::collect(_gl);
+  drawScene();
+  _gl_block = false;
+  // tiles are computed or uploaded in the background
+  if (_gl->incomplete())
+    _refine_timer->start();
+  Utils::PhaseTimer::startup().finish("first frame");
+}
 
+void GUI::Canvas::drawScene(double scale) {
   _gl->identity();
   _gl->clear();
 
@@ -604,7 +781,17 @@ void GUI::Canvas::paintGL() {
 
     _slides->draw(_gl, top, left,
                   bottom, right,
-                  _axis.pixel_size);
+                  _axis.pixel_size * scale);
+
+    if (_nonfinite_overlay && _slides->current() != nullptr) {
+      std::vector<QRect> regions;
+      _slides->current()->nonFiniteRegions(QRect(QPoint(left, top), QPoint(right, bottom)),
+                                           _axis.pixel_size * scale, &regions);
+      const float highlight[4] = {1.f, 0.f, 0.f, 0.7f};
+      for (const QRect &r : regions)
+        _gl->drawFlat(highlight, 4, r.top(), r.left(),
+                      r.top() + r.height(), r.left() + r.width());
+    }
 
     _gl->drawMarker(this, _marker);
     if (_selection.active()) {
@@ -645,9 +832,146 @@ void GUI::Canvas::paintGL() {
       // _gl->drawHighlight(this, _crop.rect);
     }
   }
+}
 
+void GUI::Canvas::snapshot(double scale, std::function<void(QImage)> done) {
+  snapshot_t shot;
+  const int out_width = std::max(1, (int) std::lround(_width * scale));
+  const int out_height = std::max(1, (int) std::lround(_height * scale));
+  shot.image = QImage(out_width, out_height, QImage::Format_RGBA8888);
+  shot.done = done;
+  shot.axis = _axis;
+  shot.canvas_width = _width;
+  shot.canvas_height = _height;
+  shot.scale = scale;
 
+  // arbitrary resolutions are rendered in tiles the framebuffer can hold
+  while ( !__sync_bool_compare_and_swap (&_gl_block, false, true));
+  makeCurrent();
+  GLint max_size = 0;
+  context()->extraFunctions()->glGetIntegerv(GL_MAX_RENDERBUFFER_SIZE, &max_size);
+  doneCurrent();
   _gl_block = false;
+  shot.tile = std::max(256, std::min(4096, (int) max_size));
+  for (int y = 0; y < out_height; y += shot.tile)
+    for (int x = 0; x < out_width; x += shot.tile)
+      shot.todo.push_back(QRect(x, y, std::min(shot.tile, out_width - x),
+                                std::min(shot.tile, out_height - y)));
+
+  _snapshots.push_back(shot);
+  _snapshot_timer->start(0);
+}
+
+void GUI::Canvas::renderSnapshot(snapshot_t *shot) {
+  const double scale_x = shot->image.width() / (double) shot->canvas_width;
+  const double scale_y = shot->image.height() / (double) shot->canvas_height;
+
+  while ( !__sync_bool_compare_and_swap (&_gl_block, false, true));
+  makeCurrent();
+  QOpenGLExtraFunctions *f = context()->extraFunctions();
+  std::swap(_axis, shot->axis);
+
+  QOpenGLFramebufferObject fbo(shot->tile, shot->tile, QOpenGLFramebufferObject::CombinedDepthStencil);
+  fbo.bind();
+  for (auto r = shot->todo.begin(); r != shot->todo.end();) {
+    readback_t rb;
+    rb.x = r->x();
+    rb.y = r->y();
+    rb.width = r->width();
+    rb.height = r->height();
+
+    // part of the canvas projection (see GlManager::set_ortho)
+    _gl->set_size(rb.width, rb.height);
+    _gl->projection_identity();
+    glOrtho(-0.5 * shot->canvas_width + rb.x / scale_x,
+            -0.5 * shot->canvas_width + (rb.x + rb.width) / scale_x,
+            0.5 * shot->canvas_height - (rb.y + rb.height) / scale_y,
+            0.5 * shot->canvas_height - rb.y / scale_y,
+            -2.0, 2.0);
+    _gl->modelview_identity();
+    _gl->beginFrame();
+    drawScene(shot->scale);
+    // missing tiles were requested, the region is rendered again later
+    if (_gl->incomplete()) {
+      ++r;
+      continue;
+    }
+
+    // copied by the GPU in background
+    f->glGenBuffers(1, &rb.pbo);
+    f->glBindBuffer(GL_PIXEL_PACK_BUFFER, rb.pbo);
+    f->glBufferData(GL_PIXEL_PACK_BUFFER, (size_t)rb.width * rb.height * 4, nullptr, GL_STREAM_READ);
+    f->glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    f->glReadPixels(0, 0, rb.width, rb.height, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    rb.fence = f->glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    f->glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    shot->pending.push_back(rb);
+    r = shot->todo.erase(r);
+  }
+  fbo.release();
+  f->glFlush();
+
+  std::swap(_axis, shot->axis);
+  resizeGL(_width, _height);
+  doneCurrent();
+  _gl_block = false;
+}
+
+void GUI::Canvas::slotPollSnapshots() {
+  bool rendering = false;
+  for (auto && shot : _snapshots) {
+    if (!shot.todo.empty())
+      renderSnapshot(&shot);
+    rendering |= !shot.todo.empty();
+  }
+
+  makeCurrent();
+  QOpenGLExtraFunctions *f = context()->extraFunctions();
+
+  std::vector<snapshot_t> finished;
+  for (auto it = _snapshots.begin(); it != _snapshots.end();) {
+    std::vector<readback_t> &pending = it->pending;
+    for (auto rb = pending.begin(); rb != pending.end();) {
+      const GLenum status = f->glClientWaitSync(rb->fence, 0, 0);
+      if (status == GL_TIMEOUT_EXPIRED) {
+        ++rb;
+        continue;
+      }
+      f->glBindBuffer(GL_PIXEL_PACK_BUFFER, rb->pbo);
+      const uchar* src = static_cast<const uchar*>(
+                           f->glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0,
+                               (size_t)rb->width * rb->height * 4, GL_MAP_READ_BIT));
+      if (src != nullptr) {
+        // OpenGL rows are bottom-up
+        for (int h = 0; h < rb->height; ++h)
+          memcpy(it->image.scanLine(rb->y + h) + 4 * rb->x,
+                 src + (size_t)(rb->height - 1 - h) * rb->width * 4,
+                 rb->width * 4);
+        f->glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+      } else {
+        LOG(WARNING) << "cannot map pixel buffer of snapshot";
+      }
+      f->glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+      f->glDeleteBuffers(1, &rb->pbo);
+      f->glDeleteSync(rb->fence);
+      rb = pending.erase(rb);
+    }
+
+    if (pending.empty() && it->todo.empty()) {
+      finished.push_back(*it);
+      it = _snapshots.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  doneCurrent();
+
+  // tiles are computed in the background, readbacks need a few ms
+  if (!_snapshots.empty())
+    _snapshot_timer->start(rendering ? _refine_timer->interval() : 5);
+  // callbacks might request further snapshots
+  for (auto && shot : finished)
+    shot.done(shot.image.convertToFormat(QImage::Format_RGB888));
 }
 
 
@@ -3,8 +3,11 @@
 
 #include <vector>
 #include <string>
+#include <functional>
+#include <QImage>
 #include <QOpenGLWidget>
 #include <QOpenGLFunctions>
+#include <QTimer>
 
 #include "../Utils/gl_object.h"
 #include "../Utils/selection.h"
@@ -12,12 +15,16 @@
 
 namespace Utils {
 class GlManager;
+class Volume;
 }; // namespace Utils
 
 namespace GUI {
 class ImageWindow;
 class Slides;
 class Layer;
+namespace threads {
+class VolumeThread;
+} // namespace threads
 // class Marker;
 
 class Canvas  : public QOpenGLWidget {
@@ -73,12 +80,50 @@ class Canvas  : public QOpenGLWidget {
   // position for marker in image
   Marker* _marker;
 
+  // highlight NaN/Inf pixels of the current layer
+  bool _nonfinite_overlay;
+
   // focus point in canvas for broadcasting to other views
   QPoint _focus;
 
+  // z-pyramid when slides are treated as a volume
+  threads::VolumeThread* _thread_volume;
+  Utils::Volume* _working_volume;
+  // slides generation the working volume is built from
+  unsigned int _volume_generation;
+  // slices were mapped again since the volume was built
+  bool _volume_outdated;
+  // fires when z-scrubbing stopped to refine the view
+  QTimer* _scrub_timer;
+  // redraws while tiles of the view are still missing
+  QTimer* _refine_timer;
+
+  // offscreen renderings waiting for their pixel buffers
+  struct readback_t {
+    GLuint pbo;
+    GLsync fence;
+    int x, y, width, height;
+  };
+  struct snapshot_t {
+    QImage image;
+    std::function<void(QImage)> done;
+    // view of the request, the canvas might move meanwhile
+    axis_t axis;
+    int canvas_width, canvas_height;
+    double scale;
+    // regions of the image not rendered yet since tiles were missing
+    std::vector<QRect> todo;
+    int tile;
+    std::vector<readback_t> pending;
+  };
+  std::vector<snapshot_t> _snapshots;
+  // polls the fences of pending readbacks
+  QTimer* _snapshot_timer;
+
  public:
 
   Canvas(QWidget *parent, ImageWindow* parentWin);
+  ~Canvas();
   QSize sizeHint() const;
 
   // methods required by OpenGL
@@ -86,6 +131,19 @@ class Canvas  : public QOpenGLWidget {
   void resizeGL(int w, int h);
   void paintGL();
 
+  /**
+   * @brief render the current view offscreen, e.g. to save what you see
+   * @details Includes zoom, histogram mapping, marker and crop overlay. The
+   *          view is rendered tile by tile into a framebuffer object and
+   *          copied into pixel buffer objects. Regions whose pyramid tiles
+   *          are not ready yet are rendered again later, while the tiles are
+   *          computed in the background. Fences of the readbacks are polled,
+   *          such that the GUI thread never waits for tiles or the GPU.
+   *
+   * @param scale output resolution relative to the canvas
+   * @param done receives the RGB image when all tiles are read back
+   */
+  void snapshot(double scale, std::function<void(QImage)> done);
 
 
   /**
@@ -138,6 +196,17 @@ class Canvas  : public QOpenGLWidget {
    */
   QPoint imgToCanvas( QPoint p ) const;
 
+  /**
+   * @brief image pixels covered by the canvas
+   * @return rectangle in image coordinates (might exceed the image)
+   */
+  QRect visibleRegion() const;
+
+  /**
+   * @brief shift the image such that the pixel is in the center of the canvas
+   */
+  void centerOn(QPoint pixel);
+
   /**
    * @brief zoom entire image but keeping center
    * @details this is different to the scroll-wheel action
@@ -160,6 +229,13 @@ class Canvas  : public QOpenGLWidget {
   void setMarker(Marker marker);
   Marker marker() const;
 
+  /**
+   * @brief overlay marking the NaN/Inf pixels of the current layer
+   * @details visible at any zoom level, see Layer::nonFiniteRegions
+   */
+  void setNonFiniteOverlay(bool active);
+  bool nonFiniteOverlay() const;
+
   void setSelection(Utils::selection_t selection);
   Utils::selection_t selection() const;
 
@@ -186,6 +262,23 @@ class Canvas  : public QOpenGLWidget {
   void slotRemoveCurrentLayer();
   void slotRemoveAllLayers();
 
+  /**
+   * @brief treat all layers as slices of a volume
+   * @details builds a z-pyramid in the background, requires same geometry
+   */
+  void slotBuildVolume();
+  void slotVolumeFinished();
+  /**
+   * @brief a slice got a new display mapping (histogram, range, channels)
+   * @details the volume is not drawn until it is rebuilt
+   */
+  void slotVolumeOutdated();
+  /**
+   * @brief rebuild an outdated volume once all slices are mapped again
+   */
+  void slotRebuildVolume();
+  void slotScrubbingFinished();
+
   // zoom but keep center
   void slotZoomIn();
   void slotZoomOut();
@@ -224,7 +317,20 @@ class Canvas  : public QOpenGLWidget {
                     unsigned int width = 512,
                     unsigned int height = 512,
                     unsigned int channels = 4);
+
+  /**
+   * @brief draw slides and overlays with the current projection
+   * @param scale output pixels per canvas pixel (selects the pyramid level)
+   */
+  void drawScene(double scale = 1.);
+
+  /**
+   * @brief render the regions of a snapshot whose tiles are ready
+   * @details ready regions are read back and removed from the todo list
+   */
+  void renderSnapshot(snapshot_t *shot);
  private slots:
+  void slotPollSnapshots();
 
  public:
   static bool _gl_block;
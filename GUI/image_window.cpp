@@ -10,6 +10,7 @@
 #include "histogram.h"
 #include "image_window.h"
 #include "../Utils/image_data.h"
+#include "../Utils/image_writer.h"
 #include "marker.h"
 #include "layer.h"
 #include "slides.h"
@@ -85,6 +86,8 @@ GUI::ImageWindow::ImageWindow(QWidget* parent, GUI::Window* parentWindow)
   statusBar()->addWidget(_statusCropInfoLabel, 1);
   _statusLabelZoom = new QLabel("zoom: 1");
   statusBar()->addWidget(_statusLabelZoom, 1);
+  _statusLabelNonFinite = new QLabel();
+  statusBar()->addWidget(_statusLabelNonFinite, 1);
   _statusLabelLoader = new QLabel();
   _ascii_loader_animation = new AsciiLoaderAnimation(_statusLabelLoader);
   statusBar()->addWidget(_statusLabelLoader, 1);
@@ -128,6 +131,26 @@ GUI::ImageWindow::ImageWindow(QWidget* parent, GUI::Window* parentWindow)
   _saveCropAct->setStatusTip(tr("Save current crop"));
   connect(_saveCropAct, &QAction::triggered, this, &GUI::ImageWindow::slotSaveCrop);
 
+  _exportCropAct = new QAction(tr("&Export crop as ..."), this );
+  _exportCropAct->setShortcut(tr("Ctrl+Shift+X"));
+  _exportCropAct->setStatusTip(tr("Save current crop as png, qoi, 16-bit tif, exr or pfm"));
+  connect(_exportCropAct, &QAction::triggered, this, &GUI::ImageWindow::slotExportCrop);
+
+  _exportAllCropsAct = new QAction(tr("Export crop of &all windows ..."), this );
+  _exportAllCropsAct->setShortcut(tr("Ctrl+Alt+X"));
+  _exportAllCropsAct->setStatusTip(tr("Save current crop of every layer in every window"));
+  connect(_exportAllCropsAct, &QAction::triggered, this, &GUI::ImageWindow::slotExportAllCrops);
+
+  _saveViewAct = new QAction(tr("Save &view as ..."), this );
+  _saveViewAct->setShortcut(tr("Ctrl+Alt+S"));
+  _saveViewAct->setStatusTip(tr("Save what the canvas shows at any resolution"));
+  connect(_saveViewAct, &QAction::triggered, this, &GUI::ImageWindow::slotSaveView);
+
+  _exportContactSheetAct = new QAction(tr("Export &contact sheet ..."), this );
+  _exportContactSheetAct->setShortcut(tr("Ctrl+Alt+C"));
+  _exportContactSheetAct->setStatusTip(tr("Save the views of all windows as arranged on screen"));
+  connect(_exportContactSheetAct, &QAction::triggered, this, &GUI::ImageWindow::slotExportContactSheet);
+
   _removeImageAct = new QAction(tr("&Remove"), this );
   _removeImageAct->setShortcut(tr("Del"));
   _removeImageAct->setStatusTip(tr("Remove the current image"));
@@ -180,6 +203,47 @@ GUI::ImageWindow::ImageWindow(QWidget* parent, GUI::Window* parentWindow)
   connect(_resetHistogramEntireCanvasAct,  &QAction::triggered,
   this, [this] () { _toolbar_histogram->slotResetRange(HistogramRefreshTarget::ENTIRE_CANVAS); });
 
+  _selectChannelsAct = new QAction(tr("Select &channels"), this );
+  _selectChannelsAct->setShortcut(tr("Ctrl+E"));
+  _selectChannelsAct->setStatusTip(tr("Choose up to three channels of a multi-channel image"));
+  connect(_selectChannelsAct, &QAction::triggered, this, &GUI::ImageWindow::slotSelectChannels);
+
+  _flowRadiusAct = new QAction(tr("Optical f&low radius"), this );
+  _flowRadiusAct->setShortcut(tr("Ctrl+L"));
+  _flowRadiusAct->setStatusTip(tr("Choose the flow radius mapped to full saturation"));
+  connect(_flowRadiusAct, &QAction::triggered, this, &GUI::ImageWindow::slotFlowRadius);
+
+  _buildVolumeAct = new QAction(tr("Build &volume from layers"), this );
+  _buildVolumeAct->setShortcut(tr("Ctrl+B"));
+  _buildVolumeAct->setStatusTip(tr("Treat all layers as z-slices, scrub with Alt + mouse wheel"));
+  connect(_buildVolumeAct, &QAction::triggered, _canvas, &GUI::Canvas::slotBuildVolume);
+
+  _pinLayerAct = new QAction(tr("&Pin layer (A/B)"), this );
+  _pinLayerAct->setShortcut(tr("Ctrl+P"));
+  _pinLayerAct->setStatusTip(tr("Keep the layer in video memory for fast A/B comparisons"));
+  connect(_pinLayerAct, &QAction::triggered, this, &GUI::ImageWindow::slotTogglePinLayer);
+
+  _reductionAct = new QAction(tr("Pyramid &reduction (mean/max/min/Lanczos/Gaussian)"), this );
+  _reductionAct->setShortcut(tr("Ctrl+D"));
+  _reductionAct->setStatusTip(tr("Keep sparse features visible when zoomed out by max or min pooling, or prefilter against aliasing"));
+  connect(_reductionAct, &QAction::triggered, this, &GUI::ImageWindow::slotCycleReduction);
+
+  _fitRangeToViewAct = new QAction(tr("Fit range to &view"), this );
+  _fitRangeToViewAct->setShortcut(tr("Ctrl+R"));
+  _fitRangeToViewAct->setStatusTip(tr("Set the histogram range to the values of the visible region"));
+  connect(_fitRangeToViewAct, &QAction::triggered, this, &GUI::ImageWindow::slotFitRangeToView);
+
+  _nonFiniteAct = new QAction(tr("Highlight &NaN/Inf"), this );
+  _nonFiniteAct->setShortcut(tr("Ctrl+I"));
+  _nonFiniteAct->setCheckable(true);
+  _nonFiniteAct->setStatusTip(tr("Mark pixels with NaN or Inf values at any zoom level"));
+  connect(_nonFiniteAct, &QAction::triggered, this, &GUI::ImageWindow::slotToggleNonFinite);
+
+  _nextNonFiniteAct = new QAction(tr("&Jump to next NaN/Inf"), this );
+  _nextNonFiniteAct->setShortcut(tr("Ctrl+J"));
+  _nextNonFiniteAct->setStatusTip(tr("Center the view on the next pixel with NaN or Inf values"));
+  connect(_nextNonFiniteAct, &QAction::triggered, this, &GUI::ImageWindow::slotNextNonFinite);
+
   _dialogWindowAct = new QAction(tr("&About"), this );
   _dialogWindowAct->setShortcut(tr("F1"));
   _dialogWindowAct->setStatusTip(tr("About"));
@@ -200,6 +264,10 @@ GUI::ImageWindow::ImageWindow(QWidget* parent, GUI::Window* parentWindow)
   _fileMenu->addAction(_openImageAct);
   _fileMenu->addAction(_saveImageAct);
   _fileMenu->addAction(_saveCropAct);
+  _fileMenu->addAction(_exportCropAct);
+  _fileMenu->addAction(_exportAllCropsAct);
+  _fileMenu->addAction(_saveViewAct);
+  _fileMenu->addAction(_exportContactSheetAct);
   _fileMenu->addAction(_removeImageAct);
   _fileMenu->addAction(_emptyCanvasAct);
 
@@ -217,6 +285,14 @@ GUI::ImageWindow::ImageWindow(QWidget* parent, GUI::Window* parentWindow)
   _imageMenu = menuBar()->addMenu(tr("&Image"));
   _imageMenu->addAction(_resetHistogramAct);
   _imageMenu->addAction(_resetHistogramEntireCanvasAct);
+  _imageMenu->addAction(_selectChannelsAct);
+  _imageMenu->addAction(_flowRadiusAct);
+  _imageMenu->addAction(_buildVolumeAct);
+  _imageMenu->addAction(_pinLayerAct);
+  _imageMenu->addAction(_reductionAct);
+  _imageMenu->addAction(_fitRangeToViewAct);
+  _imageMenu->addAction(_nonFiniteAct);
+  _imageMenu->addAction(_nextNonFiniteAct);
 
   _zoomInAct = new QAction(tr("Zoom in"), this);
   _zoomInAct->setStatusTip(tr("Zoom one step into image"));
@@ -365,7 +441,8 @@ void GUI::ImageWindow::slotSaveImage() {
     // there is a layer
     const GUI::Layer *current = _canvas->slides()->current();
     if (current != nullptr) {
-      current->buffer()->write(current->path() + "_edit.png");
+      exportLayer(current, current->path() + "_edit.png",
+                  0, 0, current->height(), current->width());
     }
   }
 
@@ -384,27 +461,254 @@ void GUI::ImageWindow::slotSaveCrop() {
     // there is a layer and we have an active crop
     const GUI::Layer *current = _canvas->slides()->current();
     if (current != nullptr) {
-      std::string fn = current->path() + "-crop-"
-                       + "t" + std::to_string(c.top()) + "-"
-                       + "l" + std::to_string(c.left()) + "-"
-                       + "b" + std::to_string(c.bottom()) + "-"
-                       + "r" + std::to_string(c.right())
-                       + ".png";
-      current->buffer()->write(fn, c.top(), c.left(), c.bottom(), c.right());
+      exportLayer(current, cropName(current->path(), c, "png"),
+                  c.top(), c.left(), c.bottom(), c.right());
     }
   }
 
 }
 
+void GUI::ImageWindow::slotExportCrop() {
+  DLOG(INFO) << "GUI::Window::slotExportCrop()";
+
+  if (!_canvas->crop().active() || _canvas->layer() == nullptr)
+    return;
+  const GUI::Layer *current = _canvas->slides()->current();
+  if (current == nullptr || !current->available())
+    return;
+
+  const QRect c = _canvas->crop().rectangle();
+  QString fn = QFileDialog::getSaveFileName(this, tr("Export crop"),
+               QString::fromStdString(cropName(current->path(), c, "exr")),
+               tr("OpenEXR float (*.exr);;PFM float (*.pfm);;TIFF 16-bit (*.tif *.tiff);;PNG 8-bit (*.png);;QOI 8-bit (*.qoi)"));
+  if (fn.isEmpty())
+    return;
+
+  exportLayer(current, fn.toStdString(),
+              c.top(), c.left(), c.bottom(), c.right());
+  statusBar()->showMessage(tr("exporting %1").arg(fn), 3000);
+}
+
+void GUI::ImageWindow::slotExportAllCrops() {
+  DLOG(INFO) << "GUI::Window::slotExportAllCrops()";
 
+  if (!_canvas->crop().active())
+    return;
+  emit sigExportAllCrops(this);
+}
 
+void GUI::ImageWindow::slotSaveView() {
+  DLOG(INFO) << "GUI::Window::slotSaveView()";
+
+  QString fn = QFileDialog::getSaveFileName(this, tr("Save view"),
+               _parentWindow->_openPath + "/view.png",
+               tr("PNG (*.png);;QOI (*.qoi);;TIFF (*.tif *.tiff)"));
+  if (fn.isEmpty())
+    return;
+  bool ok = false;
+  const double scale = QInputDialog::getDouble(this, tr("Save view"),
+                       tr("resolution relative to the window"),
+                       1.0, 0.1, 16.0, 2, &ok);
+  if (!ok)
+    return;
+
+  const std::string filename = fn.toStdString();
+  _canvas->snapshot(scale, [filename](QImage view) {
+    Utils::WriterPool::instance()->enqueue(
+      Utils::ImageWriter::fromInterleaved(view.constBits(), view.height(), view.width(), 3, view.bytesPerLine()),
+      view.height(), view.width(), 3, filename);
+  });
+}
+
+void GUI::ImageWindow::slotExportContactSheet() {
+  DLOG(INFO) << "GUI::Window::slotExportContactSheet()";
+  emit sigExportContactSheet(this);
+}
+
+int GUI::ImageWindow::exportCrops(QRect c, std::string dir, std::string prefix, std::string ext) {
+  const Slides *slides = _canvas->slides();
+  int queued = 0;
+  for (unsigned int i = 0; i < slides->num(); ++i) {
+    const GUI::Layer *layer = (*slides)[i];
+    if (layer == nullptr || !layer->available())
+      continue;
+    const std::string name = QFileInfo(QString::fromStdString(layer->path())).fileName().toStdString();
+    exportLayer(layer, cropName(dir + "/" + prefix + name, c, ext),
+                c.top(), c.left(), c.bottom(), c.right());
+    queued++;
+  }
+  return queued;
+}
+
+void GUI::ImageWindow::exportLayer(const Layer *layer, std::string fn,
+                                   int t, int l, int b, int r) {
+  // float formats keep the original values, the others what is displayed
+  const Utils::ImageData *src = layer->buffer();
+  if (Utils::ImageWriter::lossless(Utils::ImageWriter::format(fn)))
+    src = layer->img();
+  src->write(fn, t, l, b, r);
+}
+
+std::string GUI::ImageWindow::cropName(std::string base, QRect c, std::string ext) {
+  return base + "-crop-"
+         + "t" + std::to_string(c.top()) + "-"
+         + "l" + std::to_string(c.left()) + "-"
+         + "b" + std::to_string(c.bottom()) + "-"
+         + "r" + std::to_string(c.right())
+         + "." + ext;
+}
+
+
+
+
+void GUI::ImageWindow::slotTogglePinLayer() {
+  Layer *layer = _canvas->layer();
+  if (layer == nullptr)
+    return;
+  layer->setPinned(!layer->pinned());
+  statusBar()->showMessage(layer->pinned() ? tr("layer pinned") : tr("layer unpinned"), 3000);
+}
+
+void GUI::ImageWindow::slotCycleReduction() {
+  Layer *layer = _canvas->layer();
+  if (layer == nullptr)
+    return;
+  switch (layer->reduction()) {
+  case PyramidReduction::MEAN:
+    layer->setReduction(PyramidReduction::MAX);
+    statusBar()->showMessage(tr("pyramid: maximum of 2x2 pixels"), 3000);
+    break;
+  case PyramidReduction::MAX:
+    layer->setReduction(PyramidReduction::MIN);
+    statusBar()->showMessage(tr("pyramid: minimum of 2x2 pixels"), 3000);
+    break;
+  case PyramidReduction::MIN:
+    layer->setReduction(PyramidReduction::LANCZOS);
+    statusBar()->showMessage(tr("pyramid: Lanczos-3 prefilter"), 3000);
+    break;
+  case PyramidReduction::LANCZOS:
+    layer->setReduction(PyramidReduction::GAUSSIAN);
+    statusBar()->showMessage(tr("pyramid: Gaussian prefilter"), 3000);
+    break;
+  case PyramidReduction::GAUSSIAN:
+    layer->setReduction(PyramidReduction::MEAN);
+    statusBar()->showMessage(tr("pyramid: mean of 2x2 pixels"), 3000);
+    break;
+  }
+}
+
+void GUI::ImageWindow::slotFitRangeToView() {
+  Layer *layer = _canvas->layer();
+  const Utils::HistogramData *hist = _toolbar_histogram->data();
+  if (layer == nullptr || !layer->available() || hist == nullptr || !hist->available())
+    return;
+  const QRect view = _canvas->visibleRegion();
+  float min, max;
+  if (!layer->valueRange(view.top(), view.left(), view.bottom() + 1, view.right() + 1,
+                         &min, &max)) {
+    statusBar()->showMessage(tr("value range is not available yet"), 3000);
+    return;
+  }
+  // the histogram range is given in bins
+  const double bin_width = hist->image()->max() / static_cast<double>(256);
+  if (max <= min)
+    max = min + bin_width;
+  _toolbar_histogram->slotSetRange(min / bin_width, max / bin_width,
+                                   HistogramRefreshTarget::CURRENT);
+  statusBar()->showMessage(tr("range %1 - %2").arg(min).arg(max), 3000);
+}
+
+void GUI::ImageWindow::slotToggleNonFinite() {
+  _canvas->setNonFiniteOverlay(!_canvas->nonFiniteOverlay());
+  _nonFiniteAct->setChecked(_canvas->nonFiniteOverlay());
+}
+
+void GUI::ImageWindow::slotNextNonFinite() {
+  const Layer *layer = _canvas->layer();
+  if (layer == nullptr)
+    return;
+  // continue after the marker if it points to a NaN/Inf pixel
+  Marker m = _canvas->marker();
+  const QPoint after = m.active ? QPoint(static_cast<int>(m.x), static_cast<int>(m.y)) : QPoint(-1, -1);
+  QPoint pixel;
+  if (!layer->nextNonFinite(after, &pixel)) {
+    statusBar()->showMessage(tr("no NaN/Inf pixels"), 3000);
+    return;
+  }
+  m.x = pixel.x();
+  m.y = pixel.y();
+  m.active = true;
+  _canvas->setMarker(m);
+  _canvas->centerOn(pixel);
+}
+
+void GUI::ImageWindow::slotSelectChannels() {
+  DLOG(INFO) << "GUI::Window::slotSelectChannels()";
+
+  Layer *layer = _canvas->layer();
+  if (layer == nullptr || !layer->available())
+    return;
+
+  const Utils::ImageData *img = layer->img();
+  if (img->sourceChannels() <= img->channels())
+    return;
+
+  QStringList available;
+  for (int c = 0; c < img->sourceChannels(); ++c)
+    available << QString::fromStdString(img->channelName(c));
+  QStringList current;
+  for (auto && c : img->selectedChannels())
+    current << QString::fromStdString(img->channelName(c));
+
+  bool ok = false;
+  const QString text = QInputDialog::getText(this, tr("Select channels"),
+                       tr("Channels (1 to 3, comma separated):\n") + available.join(", "),
+                       QLineEdit::Normal, current.join(", "), &ok);
+  if (!ok)
+    return;
+
+  std::vector<int> ids;
+  for (auto && name : text.split(",", QString::SkipEmptyParts)) {
+    const int id = available.indexOf(name.trimmed());
+    if (id == -1) {
+      statusBar()->showMessage(tr("unknown channel ") + name.trimmed(), 3000);
+      return;
+    }
+    ids.push_back(id);
+  }
+  if (ids.empty() || ids.size() > 3) {
+    statusBar()->showMessage(tr("select 1 to 3 channels"), 3000);
+    return;
+  }
+
+  _ascii_loader_animation->start();
+  layer->selectChannels(ids);
+}
+
+void GUI::ImageWindow::slotFlowRadius() {
+  DLOG(INFO) << "GUI::Window::slotFlowRadius()";
+
+  Layer *layer = _canvas->layer();
+  if (layer == nullptr || !layer->available() || !layer->img()->isFlow())
+    return;
+
+  bool ok = false;
+  const double radius = QInputDialog::getDouble(this, tr("Optical flow radius"),
+                        tr("Radius mapped to full saturation:"),
+                        layer->img()->flowRadius(), 0.01, 1e6, 2, &ok);
+  if (!ok)
+    return;
+
+  _ascii_loader_animation->start();
+  layer->setFlowRadius(radius);
+}
 
 void GUI::ImageWindow::slotOpenImage() {
   DLOG(INFO) << "GUI::Window::slotOpenImage()";
 
   QStringList filenames = QFileDialog::getOpenFileNames(this,
                           tr("Open Image"), _parentWindow->_openPath,
-                          tr("Image Files (*.png *.jpg *.pfm *.jpeg *.bmp *.ppm *.tif *.CR2 *.JPG *.JPEG *.JPE *.flo)"));
+                          tr("Image Files (*.png *.jpg *.pfm *.jpeg *.bmp *.ppm *.tif *.CR2 *.JPG *.JPEG *.JPE *.exr *.flo)"));
 
   if ( !filenames.isEmpty() ) {
     for (int i = 0; i < filenames.count(); i++)
@@ -417,6 +721,10 @@ QSize GUI::ImageWindow::sizeHint() const {
   return QSize(512, 512);
 }
 
+GUI::Canvas* GUI::ImageWindow::canvas() const {
+  return _canvas;
+}
+
 void GUI::ImageWindow::keyReleaseEvent (QKeyEvent *event) {
   emit sigKeyReleaseEvent(event);
   // DLOG(INFO) << "keyReleaseEvent";
@@ -551,6 +859,7 @@ void GUI::ImageWindow::slotRepaintStatusbar() {
     _statusLabelMarkerColor->setText("");
     _statusLabelZoom->setText("");
     _statusCropInfoLabel->setText("");
+    _statusLabelNonFinite->setText("");
     return;
   }
 
@@ -579,8 +888,14 @@ void GUI::ImageWindow::slotRepaintStatusbar() {
     // update zoom
     std::ostringstream zoomText;
     zoomText << "zoom: " << std::setprecision(3) << _canvas->axis().pixel_size;
+    if (_canvas->slides()->volume() != nullptr)
+      zoomText << " z: " << _canvas->slides()->id() + 1 << "/" << _canvas->slides()->num();
     _statusLabelZoom->setText(zoomText.str().c_str());
 
+    // update NaN/Inf count
+    const size_t nonfinite = current->nonFinite();
+    _statusLabelNonFinite->setText(nonfinite ? tr("NaN/Inf: %1").arg(nonfinite) : "");
+
     // update crop
     Utils::selection_t crop = _canvas->crop();
     if (crop.active()) {
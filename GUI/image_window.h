@@ -36,6 +36,17 @@ class ImageWindow  : public QMainWindow {
    */
   void loadImage(std::string fn);
 
+  Canvas* canvas() const;
+
+  /**
+   * @brief queue crops of all loaded layers of this window
+   * @details files are named <dir>/<prefix><image name>-crop-t..-l..-b..-r...<ext>
+   *
+   * @param c crop rectangle
+   * @return number of queued files
+   */
+  int exportCrops(QRect c, std::string dir, std::string prefix, std::string ext);
+
   void keyPressEvent(QKeyEvent * event );
   void closeEvent(QCloseEvent * event);
 
@@ -66,6 +77,8 @@ class ImageWindow  : public QMainWindow {
   void sigCommunicateWindowGeometry(ImageWindow*);
   void sigFocusChange(ImageWindow*);
   void sigImageWindowCloses(ImageWindow*);
+  void sigExportAllCrops(ImageWindow*);
+  void sigExportContactSheet(ImageWindow*);
 
  public slots:
 
@@ -95,6 +108,54 @@ class ImageWindow  : public QMainWindow {
   void slotOpenImage();
   void slotSaveImage();
   void slotSaveCrop();
+  /**
+   * @brief Save crop of current layer, the dialog picks the format
+   * @details EXR and PFM keep the original float values, PNG (8-bit) and
+   *          TIFF (16-bit) store the displayed values
+   */
+  void slotExportCrop();
+  /**
+   * @brief Ask the parent window to export the crop of all layers in all windows
+   */
+  void slotExportAllCrops();
+  /**
+   * @brief Save the canvas as displayed (zoom, mapping, marker, crop overlay)
+   * @details rendered offscreen, optionally at a higher resolution
+   */
+  void slotSaveView();
+  /**
+   * @brief Ask the parent window to compose the views of all windows
+   */
+  void slotExportContactSheet();
+  /**
+   * @brief Choose displayed channels of a multi-channel image
+   */
+  void slotSelectChannels();
+  /**
+   * @brief Choose the radius an optical flow field is normalized by
+   */
+  void slotFlowRadius();
+  /**
+   * @brief Keep textures of the current layer in video memory (A/B set)
+   */
+  void slotTogglePinLayer();
+  /**
+   * @brief Switch the pyramid of the current layer between mean, max, min,
+   *        Lanczos and Gaussian
+   */
+  void slotCycleReduction();
+  /**
+   * @brief Map the value range of the visible region to the display range
+   */
+  void slotFitRangeToView();
+  /**
+   * @brief Highlight NaN/Inf pixels of the current layer
+   */
+  void slotToggleNonFinite();
+  /**
+   * @brief Center the view on the next NaN/Inf pixel and mark it
+   */
+  void slotNextNonFinite();
 
   /**
    * @brief request other windows to share same window geometry
@@ -123,6 +184,16 @@ class ImageWindow  : public QMainWindow {
   void slotReceiveWindowGeometry(ImageWindow*);
 
  private:
+  /**
+   * @brief write rows [t, b) and columns [l, r) of a layer in background
+   */
+  void exportLayer(const Layer *layer, std::string fn,
+                   int t, int l, int b, int r);
+  /**
+   * @brief default file name of a crop
+   */
+  static std::string cropName(std::string base, QRect c, std::string ext);
+
   Window* _parentWindow;
 
   QGridLayout* _centerLayout;
@@ -140,11 +211,16 @@ class ImageWindow  : public QMainWindow {
   ClickableLabel* _statusLabelMarkerPos;
   ClickableLabel* _statusLabelMarkerColor;
   QLabel* _statusLabelZoom;
+  QLabel* _statusLabelNonFinite;
 
   QMenu* _fileMenu;
   QAction* _openImageAct;
   QAction* _saveImageAct;
   QAction* _saveCropAct;
+  QAction* _exportCropAct;
+  QAction* _exportAllCropsAct;
+  QAction* _saveViewAct;
+  QAction* _exportContactSheetAct;
   QAction* _removeImageAct;
   QAction* _emptyCanvasAct;
 
@@ -169,6 +245,14 @@ class ImageWindow  : public QMainWindow {
   QAction *_zoomInTestAct;
   QAction *_zoomOutTestAct;
 
+  QAction *_selectChannelsAct;
+  QAction *_flowRadiusAct;
+  QAction *_buildVolumeAct;
+  QAction *_pinLayerAct;
+  QAction *_reductionAct;
+  QAction *_fitRangeToViewAct;
+  QAction *_nonFiniteAct;
+  QAction *_nextNonFiniteAct;
   QAction *_resetHistogramAct;
   QAction *_resetHistogramEntireCanvasAct;
 
@@ -6,13 +6,20 @@
 
 #include "../Utils/image_data.h"
 #include "../Utils/histogram_data.h"
+#include "../Utils/range_pyramid.h"
 #include "../Utils/mipmap.h"
+#include "../Utils/disk_cache.h"
 #include "../Utils/gl_manager.h"
 #include "../Utils/Ops/img_op.h"
 #include "../Utils/Ops/gamma_op.h"
 #include "../Utils/Ops/histogram_op.h"
 #include "layer.h"
 
+namespace {
+// display buffers are tiled like the pyramid, level 0 shares their memory
+const int TILE_SIZE = 512;
+}; // anonymous namespace
+
 // threads
 // ==========================================================================================
 GUI::threads::MipmapThread::MipmapThread() {}
@@ -25,8 +32,8 @@ void GUI::threads::MipmapThread::notify( Mipmap_ptr mipmap,  ImageData_ptr img)
 void GUI::threads::MipmapThread::run() {
   if (!_mipmap->empty())
     _mipmap->clear();
-  _mipmap->setData(_img->data(),
-                   _img->height(), _img->width(), _img->channels());
+  // tiles are sliced from the buffer when they become visible
+  _mipmap->setData(_img);
 }
 
 // ------------------------------------------------------------------------------------------
@@ -40,6 +47,18 @@ void GUI::threads::HistogramThread::run() {
   _hist->setImage(_img.get(), _img->max());
 }
 
+// ------------------------------------------------------------------------------------------
+GUI::threads::RangeThread::RangeThread() {}
+void GUI::threads::RangeThread::notify(ImageData_ptr img, RangePyramid_ptr ranges) {
+  _img = img;
+  _ranges = ranges;
+}
+
+void GUI::threads::RangeThread::run() {
+  _ranges->setImage(_img.get());
+  _img.reset();
+}
+
 // ------------------------------------------------------------------------------------------
 GUI::threads::OperationThread::OperationThread() {}
 void GUI::threads::OperationThread::notify(ImageData_ptr dst,
@@ -64,6 +83,31 @@ void GUI::threads::OperationThread::run() {
 
 }
 
+// ------------------------------------------------------------------------------------------
+GUI::threads::CacheWriterThread::CacheWriterThread() {}
+void GUI::threads::CacheWriterThread::notify(std::string fn,
+    ImageData_ptr img, HistogramData_ptr hist, Mipmap_ptr mipmap,
+    float scaling_min, float scaling_max) {
+  _fn = fn;
+  _img = img;
+  // the layer reuses its histogram for the next image
+  _hist = std::make_shared<Utils::HistogramData>(*hist);
+  _mipmap = mipmap;
+  _scaling_min = scaling_min;
+  _scaling_max = scaling_max;
+}
+
+void GUI::threads::CacheWriterThread::run() {
+  DLOG(INFO) << "GUI::threads::CacheWriterThread::run()";
+  // the cache holds all levels, also those which were not shown yet
+  _mipmap->buildLevels(_mipmap->depth() - 1, false);
+  Utils::DiskCache::store(_fn, _img.get(), _hist.get(), _mipmap.get(),
+                          _scaling_min, _scaling_max);
+  _img.reset();
+  _hist.reset();
+  _mipmap.reset();
+}
+
 // ------------------------------------------------------------------------------------------
 GUI::threads::ReloadThread::ReloadThread() {}
 void GUI::threads::ReloadThread::notify(std::string fn, int attempts) {
@@ -92,6 +136,10 @@ GUI::Layer::Layer() {
   DLOG(INFO) << "GUI::Layer::Layer()";
   _path = "";
   _available = false;
+  _pinned = false;
+  _current = false;
+  _store_in_cache = false;
+  _reduction = PyramidReduction::MEAN;
 
   // connection to all threads
   _thread_mipmapBuilder = new threads::MipmapThread();
@@ -106,6 +154,12 @@ GUI::Layer::Layer() {
   connect(_thread_histogram, &threads::HistogramThread::finished,
           this, &GUI::Layer::slotHistogramFinished);
 
+  _thread_ranges = new threads::RangeThread();
+  connect(_thread_ranges, &threads::RangeThread::finished,
+          this, &GUI::Layer::slotRangesFinished);
+
+  _thread_cacheWriter = new threads::CacheWriterThread();
+
   _thread_opWorker = new threads::OperationThread();
   connect(_thread_opWorker, &threads::OperationThread::finished,
           this, &GUI::Layer::slotApplyOpFinished);
@@ -156,9 +210,14 @@ void GUI::Layer::clear() {
 
   _available = false;
 
+  // the writer still reads the tiles
+  _thread_cacheWriter->wait();
+  _thread_ranges->wait();
+  _ranges.reset();
   _current_mipmap->clear();
   _imgdata->clear();
-  _bufdata->clear(false);
+  // the display buffer is released with its last owner
+  _bufdata.reset();
 }
 
 void GUI::Layer::loadImage(std::string fn) {
@@ -169,13 +228,49 @@ void GUI::Layer::loadImage(std::string fn) {
     _watcher->removePath(QString::fromStdString(_path));
 
   _path = fn;
-  // we keep the original data here (unscaled)
-  _imgdata = std::make_shared<Utils::ImageData>(fn);
+  _cached_mipmap.reset();
+  Utils::DiskCache::Entry_ptr entry = Utils::DiskCache::lookup(fn);
+  if (entry) {
+    // decoded image, histogram and pyramid are mapped from a previous session
+    _imgdata = std::make_shared<Utils::ImageData>(fn, entry);
+    _cached_mipmap = std::make_shared<Utils::Mipmap>();
+    _cached_mipmap->setData(entry);
+    _cached_scaling_min = entry->header()->scaling_min;
+    _cached_scaling_max = entry->header()->scaling_max;
+  } else {
+    // we keep the original data here (unscaled)
+    _imgdata = std::make_shared<Utils::ImageData>(fn);
+    if (_imgdata->data() == nullptr) {
+      // corrupt or partially written file, the layer stays unavailable
+      // until the file changes again
+      LOG(WARNING) << "cannot load " << fn;
+      _watcher->addPath(QString::fromStdString(_path));
+      return;
+    }
+  }
+  // multi-channel files decode their planes lazily and are not cached,
+  // neither is flow as its colors depend on the radius
+  _store_in_cache = !entry && Utils::DiskCache::enabled()
+                    && _imgdata->data() != nullptr
+                    && _imgdata->sourceChannels() == _imgdata->channels()
+                    && !_imgdata->isFlow();
   // and for diplaying purposes we use the buffer data (scaled to be within [0, 1])
-  _bufdata = std::make_shared<Utils::ImageData>(_imgdata.get());
+  _bufdata = std::make_shared<Utils::ImageData>(_imgdata.get(), TILE_SIZE);
 
   // first build histogram
-  slotRebuildHistogram();
+  if (entry) {
+    _thread_histogram->wait();
+    const Utils::DiskCache::header_t *hdr = entry->header();
+    std::vector<std::vector<double> > counts;
+    for (uint c = 0; c < hdr->channels; ++c)
+      counts.emplace_back(entry->histogram(c), entry->histogram(c) + hdr->bins);
+    _histdata->setCounts(_imgdata.get(), _imgdata->max(), counts,
+                         {hdr->range_min, hdr->range_max});
+    slotHistogramFinished();
+  } else {
+    slotRebuildHistogram();
+  }
+  slotRebuildRanges();
 
   Utils::Ops::HistogramOp *o = static_cast<Utils::Ops::HistogramOp*>(_op);
   o->_scaling.scale = _imgdata->max();
@@ -186,9 +281,100 @@ void GUI::Layer::loadImage(std::string fn) {
 
 }
 
+void GUI::Layer::selectChannels(std::vector<int> ids) {
+  DLOG(INFO) << "GUI::Layer::selectChannels()";
+  if (!_available)
+    return;
+  // the histogram thread might still read the old buffer
+  _thread_histogram->wait();
+  _thread_ranges->wait();
+  _available = false;
+  _store_in_cache = false;
+  _imgdata->selectChannels(ids);
+
+  slotRebuildHistogram();
+  slotRebuildRanges();
+  slotApplyOp(_op);
+}
+
+void GUI::Layer::setFlowRadius(float radius) {
+  DLOG(INFO) << "GUI::Layer::setFlowRadius()";
+  if (!_available || !_imgdata->isFlow())
+    return;
+  // the histogram thread might still read the old colors
+  _thread_histogram->wait();
+  _thread_ranges->wait();
+  _available = false;
+  _imgdata->setFlowRadius(radius);
+
+  slotRebuildHistogram();
+  slotRebuildRanges();
+  slotApplyOp(_op);
+}
+
+void GUI::Layer::setPinned(bool pinned) {
+  _pinned = pinned;
+  _current_mipmap->setPinned(_pinned || _current);
+}
+
+bool GUI::Layer::pinned() const {
+  return _pinned;
+}
+
+void GUI::Layer::setCurrent(bool current) {
+  _current = current;
+  _current_mipmap->setPinned(_pinned || _current);
+}
+
+void GUI::Layer::setReduction(PyramidReduction reduction) {
+  if (reduction == _reduction)
+    return;
+  _reduction = reduction;
+  // otherwise the next pyramid picks it up
+  if (_available)
+    slotRebuildMipmap();
+}
+
+PyramidReduction GUI::Layer::reduction() const {
+  return _reduction;
+}
+
+bool GUI::Layer::valueRange(int top, int left, int bottom, int right,
+                            float *min, float *max) const {
+  return _ranges && _ranges->range(top, left, bottom, right, min, max);
+}
+
+size_t GUI::Layer::nonFinite() const {
+  return _ranges ? _ranges->nonFinite() : 0;
+}
+
+bool GUI::Layer::nextNonFinite(QPoint after, QPoint *pixel) const {
+  uint h, w;
+  if (!_ranges || !_ranges->nextNonFinite(after.y(), after.x(), &h, &w))
+    return false;
+  *pixel = QPoint(w, h);
+  return true;
+}
+
+void GUI::Layer::nonFiniteRegions(QRect region, double zoom,
+                                  std::vector<QRect> *regions) const {
+  regions->clear();
+  if (!_ranges)
+    return;
+  std::vector<Utils::RangePyramid::region_t> found;
+  _ranges->nonFiniteRegions(region.top(), region.left(),
+                            region.top() + region.height(),
+                            region.left() + region.width(),
+                            zoom, &found);
+  regions->reserve(found.size());
+  for (const auto &r : found)
+    regions->push_back(QRect(r.left, r.top, r.right - r.left, r.bottom - r.top));
+}
+
 void GUI::Layer::slotRebuildMipmap()  {
   _available = false;
   _working_mipmap = std::make_shared<Utils::Mipmap>();
+  _working_mipmap->setReduction(_reduction);
   _thread_mipmapBuilder->notify(_working_mipmap, _bufdata);
   _thread_mipmapBuilder->start();
 }
@@ -198,10 +384,41 @@ void GUI::Layer::slotRebuildHistogram()  {
   _thread_histogram->start();
 }
 
+void GUI::Layer::slotRebuildRanges()  {
+  // a thread which is still running would ignore the new image
+  _thread_ranges->wait();
+  _ranges.reset();
+  _working_ranges = std::make_shared<Utils::RangePyramid>();
+  _thread_ranges->notify(_imgdata, _working_ranges);
+  _thread_ranges->start();
+}
+
+void GUI::Layer::slotRangesFinished()  {
+  // queued signal of a previous run
+  if (_thread_ranges->isRunning())
+    return;
+  _ranges = _working_ranges;
+  // NaN/Inf count and overlay
+  emit sigRefresh();
+}
+
 void GUI::Layer::slotMipmapFinished()  {
   DLOG(INFO) << "GUI::Layer::slotMipmapFinished()";
   // override mipmap with new one
   _current_mipmap = _working_mipmap;
+  _current_mipmap->setPinned(_pinned || _current);
+
+  Utils::Ops::HistogramOp *o = static_cast<Utils::Ops::HistogramOp*>(_op);
+  // the cache holds averaged pyramids only
+  if (_store_in_cache && _reduction == PyramidReduction::MEAN
+      && o->_scaling.min == 0 && o->_scaling.max == _imgdata->max()
+      && _thread_histogram->isFinished() && !_thread_cacheWriter->isRunning()) {
+    // reopening this file skips decoding, histogram and pyramid
+    _store_in_cache = false;
+    _thread_cacheWriter->notify(_path, _imgdata, _histdata, _current_mipmap,
+                                o->_scaling.min, o->_scaling.max);
+    _thread_cacheWriter->start(QThread::LowestPriority);
+  }
   // watch again for file changes
   _watcher->addPath(QString::fromStdString(_path));
   // allow OpenGL to display
@@ -237,7 +454,18 @@ void GUI::Layer::slotRefresh(float min, float max)  {
 
 void GUI::Layer::slotApplyOpFinished()  {
   DLOG(INFO) << "GUI::Layer::slotApplyOpFinished()";
-  slotRebuildMipmap();
+  Utils::Ops::HistogramOp *o = static_cast<Utils::Ops::HistogramOp*>(_op);
+  if (_cached_mipmap && _reduction == PyramidReduction::MEAN
+      && o->_scaling.min == _cached_scaling_min
+      && o->_scaling.max == _cached_scaling_max) {
+    // the cached pyramid matches the current scaling
+    _working_mipmap = _cached_mipmap;
+    _cached_mipmap.reset();
+    slotMipmapFinished();
+  } else {
+    _cached_mipmap.reset();
+    slotRebuildMipmap();
+  }
   emit sigApplyOpFinished();
 }
 
@@ -245,6 +473,10 @@ void GUI::Layer::slotApplyOpFinished()  {
 const Utils::ImageData* GUI::Layer::buffer() const{
   return _bufdata.get();
 }
+GUI::ImageData_ptr GUI::Layer::sharedBuffer() const{
+  return _bufdata;
+}
+
 Utils::HistogramData* GUI::Layer::histogram() const{
   return _histdata.get();
 }
@@ -260,7 +492,7 @@ std::string GUI::Layer::path() const {
 void GUI::Layer::slotApplyOp(Utils::Ops::ImgOp* op) {
   DLOG(INFO) << "GUI::Layer::slotApplyOp()";
   _available = false;
-  _bufdata = std::make_shared<Utils::ImageData>(_imgdata.get());
+  _bufdata = std::make_shared<Utils::ImageData>(_imgdata.get(), TILE_SIZE);
   _thread_opWorker->notify(_bufdata, _bufdata, op);
   DLOG(INFO) << "_thread_opWorker->start()";
   _thread_opWorker->start();
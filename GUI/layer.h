@@ -7,11 +7,14 @@
 #include <QFileSystemWatcher>
 // #include <QObject>
 #include <string>
+#include <vector>
+#include "../Utils/misc.h"
 
 namespace Utils {
 class Mipmap;
 class ImageData;
 class HistogramData;
+class RangePyramid;
 class GlManager;
 
 
@@ -25,6 +28,7 @@ namespace GUI {
 typedef std::shared_ptr<Utils::ImageData> ImageData_ptr;
 typedef std::shared_ptr<Utils::HistogramData> HistogramData_ptr;
 typedef std::shared_ptr<Utils::Mipmap> Mipmap_ptr;
+typedef std::shared_ptr<Utils::RangePyramid> RangePyramid_ptr;
 class ImageWindow;
 
 namespace threads {
@@ -54,6 +58,19 @@ class HistogramThread : public QThread {
   HistogramData_ptr _hist;
 };
 
+/**
+ * @brief Compute value ranges of image blocks (auto-range to the view).
+ */
+class RangeThread : public QThread {
+ public:
+  RangeThread();
+  void notify(const ImageData_ptr img, RangePyramid_ptr ranges);
+  void run();
+ private:
+  ImageData_ptr _img;
+  RangePyramid_ptr _ranges;
+};
+
 /**
  * @brief Apply an operations to image.
  * @details Can be scaling and clipping according to histogram limits.
@@ -69,6 +86,24 @@ class OperationThread : public QThread {
   ImageData_ptr _src;
 };
 
+/**
+ * @brief Store decoded image, histogram and pyramid in the disk cache.
+ */
+class CacheWriterThread : public QThread {
+ public:
+  CacheWriterThread();
+  void notify(std::string fn, ImageData_ptr img, HistogramData_ptr hist,
+              Mipmap_ptr mipmap, float scaling_min, float scaling_max);
+  void run();
+ private:
+  std::string _fn;
+  ImageData_ptr _img;
+  HistogramData_ptr _hist;
+  Mipmap_ptr _mipmap;
+  float _scaling_min;
+  float _scaling_max;
+};
+
 /**
  * @brief triggers loadImage when fileformat is not corrupted
  * @details QFileWatcher is triggered when file changes. But there is no guarantee
@@ -169,6 +204,77 @@ class Layer  : public QObject {
   Utils::HistogramData* histogram();
 
   const Utils::ImageData* buffer() const;
+  /**
+   * @brief shared handle to the display buffer
+   * @details keeps the buffer alive while it is used by other threads
+   */
+  ImageData_ptr sharedBuffer() const;
+
+  /**
+   * @brief display other channels of a multi-channel image
+   * @details decodes the requested channels if necessary and rebuilds
+   *          histogram and mipmap
+   *
+   * @param ids source channel ids (1 to 3)
+   */
+  void selectChannels(std::vector<int> ids);
+
+  /**
+   * @brief normalize an optical flow field by another radius
+   * @details colors the kept raw flow again and rebuilds histogram and mipmap
+   *
+   * @param radius radius mapped to full saturation
+   */
+  void setFlowRadius(float radius);
+
+  /**
+   * @brief keep textures in video memory (A/B comparison set)
+   */
+  void setPinned(bool pinned);
+  bool pinned() const;
+
+  /**
+   * @brief layer is the current slide, its textures are kept as well
+   */
+  void setCurrent(bool current);
+
+  /**
+   * @brief how coarser pyramid levels are computed for display
+   * @details max/min keep sparse features (single pixels, thin lines)
+   *          visible when zoomed out, Lanczos/Gaussian avoid aliasing of
+   *          fine textures, rebuilds the pyramid
+   */
+  void setReduction(PyramidReduction reduction);
+  PyramidReduction reduction() const;
+
+  /**
+   * @brief value range of the original image within a region
+   * @details answered from block ranges without touching pixels, hence
+   *          the region is rounded to whole blocks
+   * @return false if the ranges are not computed yet or the region is empty
+   */
+  bool valueRange(int top, int left, int bottom, int right,
+                  float *min, float *max) const;
+
+  /**
+   * @brief number of pixels with NaN/Inf in any channel
+   * @return 0 while the ranges are not computed yet
+   */
+  size_t nonFinite() const;
+
+  /**
+   * @brief next pixel with NaN/Inf after the given one (x: column, y: row)
+   * @details wraps around, (-1, -1) starts at the beginning
+   * @return false if there is none
+   */
+  bool nextNonFinite(QPoint after, QPoint *pixel) const;
+
+  /**
+   * @brief image regions to highlight the NaN/Inf pixels within a region
+   * @param zoom screen pixels per image pixel
+   */
+  void nonFiniteRegions(QRect region, double zoom,
+                        std::vector<QRect> *regions) const;
 
 
  signals:
@@ -181,8 +287,10 @@ class Layer  : public QObject {
  public slots:
   void slotRebuildMipmap();
   void slotRebuildHistogram();
+  void slotRebuildRanges();
   void slotMipmapFinished();
   void slotHistogramFinished();
+  void slotRangesFinished();
   void slotApplyOpFinished();
   void slotApplyOp(Utils::Ops::ImgOp*);
   void slotFileIsValid(QString);
@@ -205,18 +313,35 @@ class Layer  : public QObject {
   ImageData_ptr _imgdata;
   // and its histogram
   HistogramData_ptr _histdata;
+  // value ranges of blocks of the image
+  RangePyramid_ptr _ranges;
+  RangePyramid_ptr _working_ranges;
   // any modification to the image (gamma correction, range slider)
   ImageData_ptr _bufdata;
   // mipmap datastructure of _bufdata
   Mipmap_ptr _working_mipmap;
   Mipmap_ptr _current_mipmap;
+  // pyramid from the disk cache, valid for the initial histogram scaling
+  Mipmap_ptr _cached_mipmap;
+  float _cached_scaling_min;
+  float _cached_scaling_max;
+  // first pyramid should be written to the disk cache
+  bool _store_in_cache;
 
   bool _available;
 
+  // textures are protected from eviction
+  bool _pinned;
+  bool _current;
+
+  PyramidReduction _reduction;
+
   threads::MipmapThread *_thread_mipmapBuilder;
   threads::OperationThread *_thread_opWorker;
   threads::HistogramThread *_thread_histogram;
+  threads::RangeThread *_thread_ranges;
   threads::ReloadThread *_thread_Reloader;
+  threads::CacheWriterThread *_thread_cacheWriter;
 
 };
 }; // namespace GUI
@@ -1,13 +1,53 @@
 #include <iostream>
+#include <algorithm>
 
 #include <glog/logging.h>
 
 #include "slides.h"
 #include "layer.h"
+#include "../Utils/image_data.h"
+#include "../Utils/mipmap.h"
+#include "../Utils/volume.h"
+
+// threads
+// ==========================================================================================
+GUI::threads::VolumeThread::VolumeThread() {}
+
+void GUI::threads::VolumeThread::notify(Utils::Volume* volume,
+                                        std::vector<std::shared_ptr<Utils::ImageData> > slices) {
+  _volume = volume;
+  _slices = slices;
+}
+
+void GUI::threads::VolumeThread::run() {
+  std::vector<const float*> ptrs;
+  // the volume reduces planar slices, display buffers are tiled
+  std::vector<float*> planar;
+  for (auto && slice : _slices) {
+    if (slice->tileSize() == 0) {
+      ptrs.push_back(slice->data());
+      continue;
+    }
+    int height, width;
+    planar.push_back(slice->crop(0, 0, slice->height(), slice->width(), &height, &width));
+    ptrs.push_back(planar.back());
+  }
+  _volume->setData(ptrs, _slices[0]->height(), _slices[0]->width(), _slices[0]->channels());
+  for (auto && p : planar)
+    delete[] p;
+  // buffers are not needed anymore
+  _slices.clear();
+}
 
+// class
+// ==========================================================================================
 
 GUI::Slides::Slides() {
   _id = -1;
+  _generation = 0;
+  _volume = nullptr;
+  _volume_stale = false;
+  _scrubbing = false;
 }
 
 const GUI::Layer* GUI::Slides::current() const {
@@ -33,9 +73,17 @@ unsigned int GUI::Slides::num() const {
 }
 
 void GUI::Slides::add(Layer* l) {
+  // a volume needs to be rebuilt when slices change
+  setVolume(nullptr);
+  _generation++;
   _slides.push_back(l);
   if (_slides.size() == 1)
     _id = 0;
+  updateCurrent();
+}
+
+unsigned int GUI::Slides::generation() const {
+  return _generation;
 }
 
 void GUI::Slides::backward() {
@@ -44,10 +92,12 @@ void GUI::Slides::backward() {
     if (_id < 0)
       _id = 0;
   }
-
+  updateCurrent();
 }
 
 void GUI::Slides::remove() {
+  setVolume(nullptr);
+  _generation++;
   if (_slides.size() > 0) {
     current()->clear();
     DLOG(INFO) << "_id " << _id;
@@ -64,7 +114,7 @@ void GUI::Slides::remove() {
     _id = -1;
   }
   // case: there are at least two layers --> automatically jumps to next
-
+  updateCurrent();
 }
 
 void GUI::Slides::forward() {
@@ -73,16 +123,83 @@ void GUI::Slides::forward() {
     if (_id >= (int) _slides.size())
       _id = _slides.size() - 1;
   }
+  updateCurrent();
+}
 
+void GUI::Slides::updateCurrent() {
+  for (int i = 0; i < (int) _slides.size(); ++i)
+    _slides[i]->setCurrent(i == _id);
 }
 
 void GUI::Slides::draw(Utils::GlManager *gl,
                        uint top, uint left,
                        uint bottom, uint right,
                        double zoom) {
+  if (_volume != nullptr && !_volume_stale && !_volume->empty()) {
+    // zoomed out views read slices downsampled in z as well
+    int level = Utils::Mipmap::levelForZoom(zoom);
+    // coarse z-levels while moving, refine when scrubbing stops
+    if (_scrubbing)
+      level = std::max(level, 2);
+    level = std::min(level, _volume->depth() - 1);
+    if (level > 0) {
+      _volume->draw(gl, level, _id, top, left, bottom, right, zoom);
+      return;
+    }
+  }
   current()->draw(gl, top, left, bottom, right, zoom);
 }
 
+int GUI::Slides::id() const {
+  return _id;
+}
+
+bool GUI::Slides::sharedGeometry() const {
+  if (_slides.size() < 2)
+    return false;
+  for (auto && slide : _slides) {
+    if (!slide->available())
+      return false;
+    if (slide->width() != _slides[0]->width() ||
+        slide->height() != _slides[0]->height() ||
+        slide->buffer()->channels() != _slides[0]->buffer()->channels())
+      return false;
+  }
+  return true;
+}
+
+void GUI::Slides::setVolume(Utils::Volume* v) {
+  if (_volume != nullptr) {
+    _volume->clear();
+    delete _volume;
+  }
+  _volume = v;
+  _volume_stale = false;
+}
+
+void GUI::Slides::setVolumeStale() {
+  _volume_stale = true;
+}
+
+const Utils::Volume* GUI::Slides::volume() const {
+  return _volume;
+}
+
+void GUI::Slides::scrub(int delta) {
+  if (_slides.size() == 0)
+    return;
+  _id = std::max(0, std::min(_id + delta, (int)_slides.size() - 1));
+  updateCurrent();
+}
+
+void GUI::Slides::setScrubbing(bool s) {
+  _scrubbing = s;
+}
+
+bool GUI::Slides::scrubbing() const {
+  return _scrubbing;
+}
+
 size_t GUI::Slides::width() const {
   if (_id == -1)
     return 0;
@@ -2,18 +2,39 @@
 #define LAYERS_H
 
 #include <QtGui>
+#include <QThread>
+#include <memory>
 #include <string>
+#include <vector>
 #include "../Utils/misc.h"
 
 
 namespace Utils {
 class GlManager;
+class ImageData;
+class Volume;
 }; // namespace Utils
 
 
 namespace GUI {
 class Layer;
 
+namespace threads {
+/**
+ * @brief create z-pyramid from the buffers of all slides
+ */
+class VolumeThread : public QThread {
+ public:
+  VolumeThread();
+  void notify(Utils::Volume* volume,
+              std::vector<std::shared_ptr<Utils::ImageData> > slices);
+  void run();
+ private:
+  Utils::Volume* _volume;
+  std::vector<std::shared_ptr<Utils::ImageData> > _slices;
+};
+} // namespace threads
+
 
 class Slides {
   // Q_OBJECT
@@ -44,15 +65,61 @@ class Slides {
 
   void add(Layer* l);
 
+  /**
+   * @brief counter of slide additions and removals
+   * @details a volume built for another generation does not match the slides
+   */
+  unsigned int generation() const;
+
   std::string path() const;
+
+  /**
+   * @brief current slide id (z-position when used as a volume)
+   */
+  int id() const;
+
+  /**
+   * @brief whether all slides are loaded and share the same geometry
+   * @details only then the slides can be treated as a volume
+   */
+  bool sharedGeometry() const;
+
+  /**
+   * @brief use a z-pyramid built from all slides
+   * @details ownership is transferred, nullptr removes the current volume
+   */
+  void setVolume(Utils::Volume* v);
+  const Utils::Volume* volume() const;
+  /**
+   * @brief the volume does not match the slices anymore
+   * @details the slices are drawn on their own until setVolume
+   */
+  void setVolumeStale();
+
+  /**
+   * @brief move through z by given number of slices
+   * @details while scrubbing coarse z-levels are drawn
+   */
+  void scrub(int delta);
+  void setScrubbing(bool s);
+  bool scrubbing() const;
  protected:
 
  private slots:
 
  private:
+  /**
+   * @brief keep the textures of the current slide in video memory
+   */
+  void updateCurrent();
 
   std::vector<Layer*> _slides;
   int _id;
+  unsigned int _generation;
+
+  Utils::Volume* _volume;
+  bool _volume_stale;
+  bool _scrubbing;
 
 };
 }; // namespace GUI
@@ -1,5 +1,6 @@
 #include <iostream>
 #include <algorithm>
+#include <memory>
 
 #include <glog/logging.h>
 
@@ -13,8 +14,10 @@
 #include "canvas.h"
 #include "slides.h"
 #include "Utils/histogram_data.h"
+#include "Utils/image_writer.h"
 
-GUI::Window::Window(QApplication* app) : _app(app) {
+GUI::Window::Window(QApplication* app)
+  : _aboutWindow(nullptr), _exportProgress(nullptr), _exporting(false), _app(app) {
   // workspace = new QMdiArea(this);
   // workspace->setHorizontalScrollBarPolicy(Qt::ScrollBarAsNeeded);
   // workspace->setVerticalScrollBarPolicy(Qt::ScrollBarAsNeeded);
@@ -44,6 +47,12 @@ GUI::Window::Window(QApplication* app) : _app(app) {
   _windowMenu->addAction(_dialogWindowAct);
   _windowMenu->addAction(_closeAppAct);
 
+  // writer threads report back through queued connections
+  connect(Utils::WriterPool::instance(), &Utils::WriterPool::sigProgress,
+          this, &GUI::Window::slotWriterProgress, Qt::QueuedConnection);
+  connect(Utils::WriterPool::instance(), &Utils::WriterPool::sigFinished,
+          this, &GUI::Window::slotWriterFinished, Qt::QueuedConnection);
+
   // fire up
   slotNewWindowAction();
 }
@@ -87,6 +96,11 @@ void GUI::Window::slotNewWindowAction() {
   connect(tmpWindow, &GUI::ImageWindow::sigImageWindowCloses,
           this, &GUI::Window::slotImageWindowCloses);
 
+  connect(tmpWindow, &GUI::ImageWindow::sigExportAllCrops,
+          this, &GUI::Window::slotExportAllCrops);
+  connect(tmpWindow, &GUI::ImageWindow::sigExportContactSheet,
+          this, &GUI::Window::slotExportContactSheet);
+
   // outgoing messages
   connect(this, &GUI::Window::sigReceiveWindowGeometry,
           tmpWindow, &GUI::ImageWindow::slotReceiveWindowGeometry);
@@ -96,18 +110,20 @@ void GUI::Window::slotNewWindowAction() {
 }
 void GUI::Window::slotDialogWindowAction() {
   DLOG(INFO) << "GUI::Window::slotDialogWindowAction()";
-  AboutWindow* dialog = new AboutWindow(this);
-  dialog->setAttribute(Qt::WA_DeleteOnClose);
-
-  dialog->setGeometry(
-    QStyle::alignedRect(
-      Qt::LeftToRight,
-      Qt::AlignCenter,
-      dialog->size(),
-      _app->desktop()->availableGeometry()
-    )
-  );
-  dialog->show();
+  // the dialog is not needed during startup and kept after closing it
+  if (_aboutWindow == nullptr) {
+    _aboutWindow = new AboutWindow(this);
+    _aboutWindow->setGeometry(
+      QStyle::alignedRect(
+        Qt::LeftToRight,
+        Qt::AlignCenter,
+        _aboutWindow->size(),
+        _app->desktop()->availableGeometry()
+      )
+    );
+  }
+  _aboutWindow->show();
+  _aboutWindow->raise();
 }
 
 void GUI::Window::slotCommunicateCanvasChange(Canvas* sender) {
@@ -125,7 +141,7 @@ void GUI::Window::slotCommunicateNextLayer(){
   emit sigReceiveNextLayer();
 }
 
-void GUI::Window::slotReceiveArangeWindows() {
+std::vector<GUI::ImageWindow*> GUI::Window::sortedWindows() const {
   std::vector<GUI::ImageWindow*> sorted_windows = _windows;
   std::sort(sorted_windows.begin(), sorted_windows.end(),
   [](const GUI::ImageWindow * lhs, const GUI::ImageWindow * rhs) {
@@ -136,6 +152,11 @@ void GUI::Window::slotReceiveArangeWindows() {
     float rhs_dist = rhs_pos.x() * rhs_pos.x() + rhs_pos.y() * rhs_pos.y();
     return lhs_dist < rhs_dist;
   });
+  return sorted_windows;
+}
+
+void GUI::Window::slotReceiveArangeWindows() {
+  std::vector<GUI::ImageWindow*> sorted_windows = sortedWindows();
 
   QRect rec = QApplication::desktop()->availableGeometry(sorted_windows[0]);
   // const int height = rec.height();
@@ -158,4 +179,143 @@ void GUI::Window::slotReceiveArangeWindows() {
     // cur_y += wnd->height();
     cur_line_height = std::max(cur_line_height, wnd->height());
   }
-}
\ No newline at end of file
+}
+
+void GUI::Window::slotExportAllCrops(ImageWindow* sender) {
+  DLOG(INFO) << "GUI::Window::slotExportAllCrops()";
+
+  const QRect c = sender->canvas()->crop().rectangle();
+
+  QString dir = QFileDialog::getExistingDirectory(sender, tr("Export crops to"), _openPath);
+  if (dir.isEmpty())
+    return;
+
+  QStringList formats;
+  formats << "exr" << "pfm" << "tif" << "png" << "qoi";
+  bool ok = false;
+  QString ext = QInputDialog::getItem(sender, tr("Export crops"),
+                                      tr("exr/pfm: float values, tif: 16-bit, png/qoi: 8-bit"),
+                                      formats, 0, false, &ok);
+  if (!ok)
+    return;
+
+  // the crop is synchronized, but each window might show other images
+  int queued = 0;
+  for (size_t i = 0; i < _windows.size(); ++i) {
+    const std::string prefix = "w" + std::to_string(i) + "-";
+    queued += _windows[i]->exportCrops(c, dir.toStdString(), prefix, ext.toStdString());
+  }
+  if (queued == 0)
+    return;
+
+  if (_exportProgress == nullptr) {
+    _exportProgress = new QProgressDialog(this);
+    _exportProgress->setWindowTitle(tr("Export crops"));
+    _exportProgress->setCancelButton(nullptr);
+    _exportProgress->setMinimumDuration(0);
+  }
+  _exporting = true;
+  _exportProgress->setLabelText(tr("writing %1 files to %2").arg(queued).arg(dir));
+  _exportProgress->setRange(0, queued);
+  _exportProgress->setValue(0);
+  _exportProgress->show();
+}
+
+void GUI::Window::slotWriterProgress(int done, int total) {
+  // single crops are written without dialog
+  if (!_exporting)
+    return;
+  _exportProgress->setMaximum(total);
+  _exportProgress->setValue(done);
+}
+
+void GUI::Window::slotWriterFinished(int failed) {
+  LOG_IF(WARNING, failed > 0) << failed << " exported files could not be written";
+  if (!_exporting)
+    return;
+  _exporting = false;
+  _exportProgress->hide();
+  if (failed > 0)
+    QMessageBox::warning(this, tr("Export crops"),
+                         tr("%1 files could not be written").arg(failed));
+}
+
+void GUI::Window::slotExportContactSheet(ImageWindow* sender) {
+  DLOG(INFO) << "GUI::Window::slotExportContactSheet()";
+
+  QString fn = QFileDialog::getSaveFileName(sender, tr("Export contact sheet"),
+               _openPath + "/contact-sheet.png",
+               tr("PNG (*.png);;QOI (*.qoi);;TIFF (*.tif *.tiff)"));
+  if (fn.isEmpty())
+    return;
+  bool ok = false;
+  const double scale = QInputDialog::getDouble(sender, tr("Export contact sheet"),
+                       tr("resolution relative to the windows"),
+                       1.0, 0.1, 16.0, 2, &ok);
+  if (!ok)
+    return;
+
+  // views are placed like the canvases on screen
+  struct sheet_t {
+    std::vector<QImage> views;
+    std::vector<QPoint> offsets;
+    // windows which did not deliver their view yet
+    std::vector<bool> waiting;
+    size_t missing;
+  };
+  std::shared_ptr<sheet_t> sheet = std::make_shared<sheet_t>();
+  const std::vector<GUI::ImageWindow*> windows = sortedWindows();
+  QPoint origin = windows[0]->canvas()->mapToGlobal(QPoint(0, 0));
+  for (auto && wnd : windows) {
+    const QPoint pos = wnd->canvas()->mapToGlobal(QPoint(0, 0));
+    origin.setX(std::min(origin.x(), pos.x()));
+    origin.setY(std::min(origin.y(), pos.y()));
+    sheet->offsets.push_back(pos);
+  }
+  for (auto && offset : sheet->offsets)
+    offset = (offset - origin) * scale;
+  sheet->views.resize(windows.size());
+  sheet->waiting.assign(windows.size(), true);
+  sheet->missing = windows.size();
+
+  const std::string filename = fn.toStdString();
+  // a window closed meanwhile delivers a null view and leaves a gap
+  auto arrived = [sheet, filename](size_t i, QImage view) {
+    if (!sheet->waiting[i])
+      return;
+    sheet->waiting[i] = false;
+    sheet->views[i] = view;
+    if (--sheet->missing > 0)
+      return;
+
+    QRect bounds;
+    for (size_t j = 0; j < sheet->views.size(); ++j)
+      if (!sheet->views[j].isNull())
+        bounds |= QRect(sheet->offsets[j], sheet->views[j].size());
+    if (bounds.isEmpty()) {
+      LOG(WARNING) << "no view left for the contact sheet " << filename;
+      return;
+    }
+    QImage composed(bounds.size(), QImage::Format_RGB888);
+    // same as the canvas background
+    composed.fill(QColor(26, 26, 26));
+    QPainter painter(&composed);
+    for (size_t j = 0; j < sheet->views.size(); ++j)
+      if (!sheet->views[j].isNull())
+        painter.drawImage(sheet->offsets[j] - bounds.topLeft(), sheet->views[j]);
+    painter.end();
+
+    Utils::WriterPool::instance()->enqueue(
+      Utils::ImageWriter::fromInterleaved(composed.constBits(), composed.height(), composed.width(), 3, composed.bytesPerLine()),
+      composed.height(), composed.width(), 3, filename);
+  };
+  for (size_t i = 0; i < windows.size(); ++i) {
+    GUI::Canvas* canvas = windows[i]->canvas();
+    canvas->snapshot(scale, [arrived, i](QImage view) {
+      arrived(i, view);
+    });
+    connect(canvas, &QObject::destroyed, this, [arrived, i]() {
+      arrived(i, QImage());
+    });
+  }
+}
@@ -7,6 +7,7 @@
 #include <QMdiArea>
 #include <QApplication>
 #include <QMainWindow>
+#include <QProgressDialog>
 
 #include "canvas.h"
 
@@ -48,8 +49,32 @@ class Window  : public QMainWindow {
   void slotCommunicatePrevLayer();
   void slotCommunicateNextLayer();
 
+  /**
+   * @brief write crop of sender to all layers of all windows
+   * @details asks for target directory and format, encoding runs in the
+   *          WriterPool while a progress dialog is shown
+   */
+  void slotExportAllCrops(ImageWindow*);
+  /**
+   * @brief compose the rendered views of all windows into one image
+   * @details views keep their arrangement on screen, see Canvas::snapshot
+   */
+  void slotExportContactSheet(ImageWindow*);
+  void slotWriterProgress(int done, int total);
+  void slotWriterFinished(int failed);
+
  private:
+  /**
+   * @brief windows ordered by distance of their position to the screen origin
+   */
+  std::vector<GUI::ImageWindow*> sortedWindows() const;
+
   Slides* _slides;
+  // created on first use
+  AboutWindow* _aboutWindow;
+  // created on first batch export
+  QProgressDialog* _exportProgress;
+  bool _exporting;
 
   QMdiArea* workspace;
 
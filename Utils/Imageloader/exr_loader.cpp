@@ -0,0 +1,105 @@
+#ifdef OPENEXR_ENABLED
+
+#include "exr_loader.h"
+#include "../tile_store.h"
+#include <ImfInputFile.h>
+#include <ImfChannelList.h>
+#include <ImfFrameBuffer.h>
+#include <ImathBox.h>
+#include <glog/logging.h>
+#include <algorithm>
+#include <exception>
+#include <string>
+
+namespace Utils {
+namespace Loader {
+ExrLoader::ExrLoader() {
+
+}
+ExrLoader::~ExrLoader() {
+
+}
+
+bool ExrLoader::canLoad(std::string fn) {
+  if (fn.length() < 4)
+    return false;
+  std::string ext = fn.substr(fn.length() - 4);
+  std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+  return (ext == ".exr");
+}
+
+bool ExrLoader::canLoadChannels(std::string fn) {
+  return canLoad(fn);
+}
+
+std::vector<std::string> ExrLoader::channelNames(std::string fn, int *_height, int *_width, float *_max_value) {
+  std::vector<std::string> names;
+  // OpenEXR reports corrupt files by exceptions
+  try {
+    Imf::InputFile file(fn.c_str());
+    const Imath::Box2i dw = file.header().dataWindow();
+    *_width = dw.max.x - dw.min.x + 1;
+    *_height = dw.max.y - dw.min.y + 1;
+    // EXR stores scene-referred values, we start with [0, 1] as visible range
+    *_max_value = 1.0;
+
+    const Imf::ChannelList &channels = file.header().channels();
+    for (Imf::ChannelList::ConstIterator it = channels.begin(); it != channels.end(); ++it) {
+      names.push_back(it.name());
+    }
+  } catch (const std::exception &e) {
+    LOG(WARNING) << "cannot read exr header of " << fn << ": " << e.what();
+    return std::vector<std::string>();
+  }
+  DLOG(INFO) << "exr has " << names.size() << " channels";
+  return names;
+}
+
+bool ExrLoader::loadChannel(std::string fn, std::string name, float *dst) {
+  DLOG(INFO) << "decode channel " << name << " from " << fn;
+  try {
+    Imf::InputFile file(fn.c_str());
+    const Imath::Box2i dw = file.header().dataWindow();
+    const long width = dw.max.x - dw.min.x + 1;
+
+    // OpenEXR addresses pixels in data window coordinates (which need not start at 0)
+    char *base = (char*) (dst - dw.min.x - dw.min.y * width);
+
+    // only this single channel is requested, half/uint are converted to float
+    Imf::FrameBuffer frame;
+    frame.insert(name.c_str(), Imf::Slice(Imf::FLOAT, base,
+                                          sizeof(float), sizeof(float) * width,
+                                          1, 1, 0.0));
+    file.setFrameBuffer(frame);
+    file.readPixels(dw.min.y, dw.max.y);
+  } catch (const std::exception &e) {
+    LOG(WARNING) << "cannot decode channel " << name << " of " << fn << ": " << e.what();
+    return false;
+  }
+  return true;
+}
+
+float* ExrLoader::load(std::string fn, int *_height, int *_width, int *_channels, float *_max_value)  {
+  const std::vector<std::string> names = channelNames(fn, _height, _width, _max_value);
+  const std::vector<int> ids = defaultChannels(names);
+  if (ids.empty())
+    return nullptr;
+
+  *_channels = ids.size();
+  const size_t area = (size_t)(*_height) * (*_width);
+  const size_t elements = (*_channels) * area;
+  float* _raw_buf = TileStore::allocate(elements, TileStore::outOfCore(elements * sizeof(float)));
+  for (int c = 0; c < (*_channels); ++c) {
+    if (!loadChannel(fn, names[ids[c]], _raw_buf + c * area)) {
+      TileStore::release(_raw_buf);
+      return nullptr;
+    }
+  }
+  return _raw_buf;
+}
+
+
+}; // namespace Loader
+}; // namespace Utils
+
+#endif // OPENEXR_ENABLED
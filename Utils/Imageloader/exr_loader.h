@@ -0,0 +1,42 @@
+#ifndef EXR_LOADER_H
+#define EXR_LOADER_H
+
+#ifdef OPENEXR_ENABLED
+
+#include "image_loader.h"
+
+namespace Utils
+{
+  namespace Loader
+  {
+    /**
+     * @brief loading EXR files with an arbitrary number of channels (AOVs)
+     * @details channels are decoded one at a time, such that only the displayed
+     *          ones need to be kept in memory
+     */
+    class ExrLoader : public ImageLoader
+    {
+    public:
+      ExrLoader();
+      ~ExrLoader();
+
+      /**
+       * @brief test if file has the EXR extension
+       */
+      bool canLoad(std::string fn);
+      /**
+       * @brief eagerly decode the default channels (R,G,B or the first channel)
+       */
+      float* load(std::string fn, int *h, int *w, int *_channels, float *_max_value) ;
+
+      bool canLoadChannels(std::string fn);
+      std::vector<std::string> channelNames(std::string fn, int *h, int *w, float *_max_value);
+      bool loadChannel(std::string fn, std::string name, float *dst);
+
+    };
+  }; // namespace Loader
+}; // namespace Utils
+
+#endif // OPENEXR_ENABLED
+
+#endif // EXR_LOADER_H
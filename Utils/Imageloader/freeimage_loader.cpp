@@ -1,5 +1,6 @@
 
 #include "freeimage_loader.h"
+#include "../tile_store.h"
 #include <FreeImage.h>
 #include <glog/logging.h>
 #include <cmath>
@@ -26,7 +27,10 @@ float* FreeImageLoader::load(std::string fn, int *_height, int *_width, int *_ch
   FIBitmapPtr _data;
 
   const FREE_IMAGE_FORMAT format = FreeImage_GetFileType(fn.c_str(), 0);
-  CHECK(format != FIF_UNKNOWN) << "unkown fileformat";
+  if (format == FIF_UNKNOWN) {
+    LOG(WARNING) << "unkown fileformat " << fn;
+    return nullptr;
+  }
 
   /*
   FIF_UNKNOWN  Unknown format (returned value only, never use it as input value)
@@ -69,8 +73,10 @@ float* FreeImageLoader::load(std::string fn, int *_height, int *_width, int *_ch
   */
 
   _data = FreeImage_Load(format, fn.c_str());
-  CHECK(_data != nullptr) << "cannot load image";
-  CHECK_NOTNULL(_data);
+  if (_data == nullptr) {
+    LOG(WARNING) << "cannot load image " << fn;
+    return nullptr;
+  }
 
   *_width = FreeImage_GetWidth(_data);
   *_height = FreeImage_GetHeight(_data);
@@ -136,9 +142,16 @@ float* FreeImageLoader::load(std::string fn, int *_height, int *_width, int *_ch
     // *_max_value = std::numeric_limits<float>::max();
   }
 
-  CHECK_GE((*_channels), 0);
+  if ((*_channels) <= 0 || image_type == FIT_UNKNOWN) {
+    LOG(WARNING) << "unsupported color type of " << fn;
+    FreeImage_Unload(_data);
+    return nullptr;
+  }
 
-  float* _raw_buf = new float[(*_channels) * (*_height) * (*_width)];
+  // 64-bit offsets, gigapixel images exceed 2^31 values
+  const size_t plane = (size_t)(*_height) * (*_width);
+  const size_t elements = (*_channels) * plane;
+  float* _raw_buf = TileStore::allocate(elements, TileStore::outOfCore(elements * sizeof(float)));
   DLOG(INFO) << "raw_buf has size "<< (*_channels) << " " << (*_height) << " " << (*_width) ;
   double sc;
 
@@ -165,7 +178,6 @@ float* FreeImageLoader::load(std::string fn, int *_height, int *_width, int *_ch
   */
   switch (image_type) {
   case FIT_UNKNOWN:
-    CHECK_NE(image_type, FIT_UNKNOWN);
     break;
   case FIT_BITMAP:
     DLOG(INFO) << "case FIT_BITMAP";
@@ -174,7 +186,7 @@ float* FreeImageLoader::load(std::string fn, int *_height, int *_width, int *_ch
         const uint8_t* line = FreeImage_GetScanLine(_data, (*_height) - 1 - h);
         for (int w = 0; w < (*_width); ++w) {
           float val = ((float) line[w * ((*_channels) + off) + (*_channels) - c - 1]);
-          _raw_buf[c * ((*_height) * (*_width)) + h * (*_width) + w] = val;
+          _raw_buf[c * plane + (size_t)h * (*_width) + w] = val;
         }
       }
     }
@@ -190,7 +202,7 @@ float* FreeImageLoader::load(std::string fn, int *_height, int *_width, int *_ch
         const unsigned short* line = (unsigned short *)FreeImage_GetScanLine(_data, (*_height) - 1 - h);
         for (int w = 0; w < (*_width); ++w) {
           float val = ((float) line[w * ((*_channels) + off) + (*_channels) - c - 1]);
-          _raw_buf[c * ((*_height) * (*_width)) + h * (*_width) + w] = val;
+          _raw_buf[c * plane + (size_t)h * (*_width) + w] = val;
         }
       }
     }
@@ -211,7 +223,7 @@ float* FreeImageLoader::load(std::string fn, int *_height, int *_width, int *_ch
         const float* line = (float *)FreeImage_GetScanLine(_data, (*_height) - 1 - h);
         for (int w = 0; w < (*_width); ++w) {
           float val = ((float) line[w * ((*_channels) + off) + (*_channels) - c - 1]);
-          _raw_buf[c * ((*_height) * (*_width)) + h * (*_width) + w] = val;
+          _raw_buf[c * plane + (size_t)h * (*_width) + w] = val;
         }
       }
     }
@@ -223,7 +235,7 @@ float* FreeImageLoader::load(std::string fn, int *_height, int *_width, int *_ch
         const double* line = (double *)FreeImage_GetScanLine(_data, (*_height) - 1 - h);
         for (int w = 0; w < (*_width); ++w) {
           float val = ((float) line[w * ((*_channels) + off) + (*_channels) - c - 1]);
-          _raw_buf[c * ((*_height) * (*_width)) + h * (*_width) + w] = val;
+          _raw_buf[c * plane + (size_t)h * (*_width) + w] = val;
         }
       }
     }
@@ -238,9 +250,9 @@ float* FreeImageLoader::load(std::string fn, int *_height, int *_width, int *_ch
       for (int h = 0; h < (*_height); ++h) {
         const FIRGB16 *line = (FIRGB16 *) FreeImage_GetScanLine(_data, (*_height) - 1 - h);
         for (int w = 0; w < (*_width); ++w) {
-          _raw_buf[0 * ((*_height) * (*_width)) + h * (*_width) + w] = (float) line[w].red / sc;
-          _raw_buf[1 * ((*_height) * (*_width)) + h * (*_width) + w] = (float) line[w].green / sc;
-          _raw_buf[2 * ((*_height) * (*_width)) + h * (*_width) + w] = (float) line[w].blue / sc;
+          _raw_buf[0 * plane + (size_t)h * (*_width) + w] = (float) line[w].red / sc;
+          _raw_buf[1 * plane + (size_t)h * (*_width) + w] = (float) line[w].green / sc;
+          _raw_buf[2 * plane + (size_t)h * (*_width) + w] = (float) line[w].blue / sc;
         }
       }
     }
@@ -256,9 +268,9 @@ float* FreeImageLoader::load(std::string fn, int *_height, int *_width, int *_ch
       for (int h = 0; h < (*_height); ++h) {
         const FIRGBA16 *line = (FIRGBA16 *) FreeImage_GetScanLine(_data, (*_height) - 1 - h);
         for (int w = 0; w < (*_width); ++w) {
-          _raw_buf[0 * ((*_height) * (*_width)) + h * (*_width) + w] = ((double) line[w].red) / sc;
-          _raw_buf[1 * ((*_height) * (*_width)) + h * (*_width) + w] = ((double) line[w].green) / sc;
-          _raw_buf[2 * ((*_height) * (*_width)) + h * (*_width) + w] = ((double) line[w].blue) / sc;
+          _raw_buf[0 * plane + (size_t)h * (*_width) + w] = ((double) line[w].red) / sc;
+          _raw_buf[1 * plane + (size_t)h * (*_width) + w] = ((double) line[w].green) / sc;
+          _raw_buf[2 * plane + (size_t)h * (*_width) + w] = ((double) line[w].blue) / sc;
         }
       }
     }
@@ -2,6 +2,7 @@
 #define IMAGE_LOADER_H
 
 #include <string>
+#include <vector>
 
 namespace Utils
 {
@@ -10,6 +11,7 @@ namespace Utils
     class ImageLoader
     {
     public:
+      virtual ~ImageLoader() {}
       /**
        * @brief should return wether this file can be loaded by this loading-class
        * @details inspecting of the image can be loaded by this particular loader
@@ -27,10 +29,82 @@ namespace Utils
        * @param w width of image
        * @param _channels channels of image
        * @param _max_value maximum possible intensity value (used for rescaled during OpenGL rendering)
-       * @return float-array containing the image data
+       * @return float-array containing the image data from TileStore::allocate
+       *         (released by TileStore::release), nullptr (after a warning)
+       *         if the file cannot be decoded
        */
       virtual float* load(std::string fn, int *h, int *w, int *_channels, float *_max_value) = 0;
-      
+
+      /**
+       * @brief should return wether single channels can be decoded on their own
+       * @details loaders supporting this are used through channelNames/loadChannel
+       *          instead of load, so only the displayed channels are ever decoded
+       *
+       * @param fn path to image file
+       * @return true/false
+       */
+      virtual bool canLoadChannels(std::string fn) {
+        (void) fn;
+        return false;
+      }
+      /**
+       * @brief read the channel layout without decoding any pixel
+       *
+       * @param fn path to image file
+       * @param h height of image
+       * @param w width of image
+       * @param _max_value maximum possible intensity value
+       * @return names of all channels stored in the file, empty if the
+       *         header cannot be read
+       */
+      virtual std::vector<std::string> channelNames(std::string fn, int *h, int *w, float *_max_value) {
+        (void) fn; (void) h; (void) w; (void) _max_value;
+        return std::vector<std::string>();
+      }
+      /**
+       * @brief decode a single channel
+       *
+       * @param fn path to image file
+       * @param name channel name as reported by channelNames
+       * @param dst pre-allocated plane of size [H,W]
+       * @return false if the channel cannot be decoded
+       */
+      virtual bool loadChannel(std::string fn, std::string name, float *dst) {
+        (void) fn; (void) name; (void) dst;
+        return false;
+      }
+
+      /**
+       * @brief channels to display when a file is opened
+       * @details R,G,B if all present, otherwise Y or just the first channel
+       *
+       * @param names all channel names of the file
+       * @return channel ids
+       */
+      static std::vector<int> defaultChannels(const std::vector<std::string> &names) {
+        std::vector<int> ids;
+        for (auto && wanted : {"R", "G", "B"}) {
+          for (size_t c = 0; c < names.size(); ++c) {
+            if (names[c] == wanted) {
+              ids.push_back(c);
+              break;
+            }
+          }
+        }
+        if (ids.size() == 3)
+          return ids;
+        ids.clear();
+        for (size_t c = 0; c < names.size(); ++c) {
+          if (names[c] == "Y") {
+            ids.push_back(c);
+            return ids;
+          }
+        }
+        if (!names.empty())
+          ids.push_back(0);
+        return ids;
+      }
+
     };
   }; // namespace Loader
 }; // namespace Utils
@@ -1,8 +1,25 @@
 
 #include "opticalflow_loader.h"
+#include "../tile_store.h"
+#include <FreeImage.h>
 #include <glog/logging.h>
+#include <algorithm>
 #include <cmath>
+#include <cstring>
+#include <sstream>
 #include <string>
+#include <fnmatch.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include <gflags/gflags.h>
+
+DEFINE_double(flow_max_radius, 0,
+              "initial radius optical flow colors are normalized by (0: per file maximum)");
+DEFINE_string(flow_patterns, "*_flow.*,*_flow_*,flow_*,flow_occ/*,flow_noc/*",
+              "png/pfm files whose name matches one of these comma separated patterns "
+              "are read as optical flow, patterns with '/' include the parent directory "
+              "(empty: never)");
 
 
 namespace Utils {
@@ -67,15 +84,184 @@ OpticalFlowLoader::~OpticalFlowLoader() {
 
 }
 
-bool OpticalFlowLoader::canLoad(std::string fn) {
-  return (fn.substr(fn.length() - 4) == ".flo");
+namespace {
+typedef OpticalFlowLoader::wheel_t wheel_t;
+const int NCOLS = OpticalFlowLoader::NCOLS;
+
+std::string lower(std::string s) {
+  std::transform(s.begin(), s.end(), s.begin(), ::tolower);
+  return s;
 }
 
+bool endsWith(const std::string &s, const std::string &suffix) {
+  return s.length() >= suffix.length() &&
+         s.compare(s.length() - suffix.length(), suffix.length(), suffix) == 0;
+}
 
-float* OpticalFlowLoader::load(std::string fn, int *_height, int *_width, int *_channels, float *_max_value)  {
+// png and pfm are only treated as flow if the file name says so
+bool isFlowPath(const std::string &fn) {
+  const std::string path = lower(fn);
+  const size_t slash = path.find_last_of('/');
+  const std::string name = (slash == std::string::npos) ? path : path.substr(slash + 1);
+  // parent directory and name, e.g. KITTI's "flow_occ/000000_10.png"
+  const size_t parent = (slash == std::string::npos || slash == 0)
+                        ? std::string::npos : path.find_last_of('/', slash - 1);
+  const std::string parent_name = (parent == std::string::npos) ? path : path.substr(parent + 1);
+
+  std::stringstream patterns(lower(FLAGS_flow_patterns));
+  std::string pattern;
+  while (std::getline(patterns, pattern, ',')) {
+    if (pattern.empty())
+      continue;
+    const std::string &subject = (pattern.find('/') == std::string::npos) ? name : parent_name;
+    if (fnmatch(pattern.c_str(), subject.c_str(), FNM_PATHNAME) == 0)
+      return true;
+  }
+  return false;
+}
+
+// first bytes of the file match the magic
+bool hasMagic(const std::string &fn, const char *magic, size_t n) {
+  FILE *stream = fopen(fn.c_str(), "rb");
+  if (stream == nullptr)
+    return false;
+  char buf[4];
+  const bool ok = n <= sizeof(buf) && fread(buf, 1, n, stream) == n &&
+                  memcmp(buf, magic, n) == 0;
+  fclose(stream);
+  return ok;
+}
+
+// Middlebury tag 202021.25 as little endian float
+const char FLO_MAGIC[] = "PIEH";
+
+const float INVALID_GRAY = 128.f;
+
+// Middlebury coloring of a single pixel, rad is already normalized
+inline float wheelColor(const float *wheel, int k0, float f, float rad) {
+  const float col = (1 - f) * wheel[k0] + f * wheel[k0 + 1];
+  // increase saturation with radius, out of range flow gets darker
+  return 255.f * ((rad <= 1.f) ? 1 - rad * (1 - col) : col * 0.75f);
+}
+
+void colorizeRowScalar(const float *u, const float *v, const uint8_t *valid,
+                       int begin, int end, float inv_max_rad,
+                       const wheel_t &wheel, float **rgb) {
+  for (int w = begin; w < end; w++) {
+    if (!valid[w]) {
+      for (int c = 0; c < 3; ++c)
+        rgb[c][w] = INVALID_GRAY;
+      continue;
+    }
+    const float rad = std::sqrt(u[w] * u[w] + v[w] * v[w]) * inv_max_rad;
+    const float a = std::atan2(-v[w], -u[w]) / (float) M_PI;
+    const float fk = (a + 1.0f) / 2.0f * (NCOLS - 1);
+    const int k0 = static_cast<int>(fk);
+    const float f = fk - k0;
+    for (int c = 0; c < 3; ++c)
+      rgb[c][w] = wheelColor(wheel.col[c], k0, f, rad);
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/**
+ * @brief colorize 8 pixels at once
+ * @details atan2 is a minimax polynomial on [0, 1] with range reduction,
+ *          max. error ~1e-5 rad which is far below one color wheel step
+ * @return number of processed pixels (multiple of 8), the rest is left to the scalar path
+ */
+__attribute__((target("avx2,fma")))
+int colorizeRowAvx2(const float *u, const float *v, const uint8_t *valid,
+                    int width, float inv_max_rad,
+                    const wheel_t &wheel, float **rgb) {
+  const __m256 sign = _mm256_set1_ps(-0.f);
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 one = _mm256_set1_ps(1.f);
+  const __m256 pi = _mm256_set1_ps(M_PI);
+  const __m256 pi_2 = _mm256_set1_ps(M_PI / 2);
+  const __m256 inv_pi = _mm256_set1_ps(1.f / M_PI);
+  const __m256 scale = _mm256_set1_ps((NCOLS - 1) / 2.f);
+  const __m256 rad_scale = _mm256_set1_ps(inv_max_rad);
+  const __m256 c255 = _mm256_set1_ps(255.f);
+  const __m256 dark = _mm256_set1_ps(0.75f);
+  const __m256 gray = _mm256_set1_ps(INVALID_GRAY);
+
+  int w = 0;
+  for (; w + 8 <= width; w += 8) {
+    // atan2(-v, -u)
+    const __m256 x = _mm256_xor_ps(_mm256_loadu_ps(u + w), sign);
+    const __m256 y = _mm256_xor_ps(_mm256_loadu_ps(v + w), sign);
+    const __m256 ax = _mm256_andnot_ps(sign, x);
+    const __m256 ay = _mm256_andnot_ps(sign, y);
+    const __m256 mx = _mm256_max_ps(ax, ay);
+    const __m256 mn = _mm256_min_ps(ax, ay);
+    const __m256 t = _mm256_blendv_ps(_mm256_div_ps(mn, mx), zero,
+                                      _mm256_cmp_ps(mx, zero, _CMP_EQ_OQ));
+    const __m256 s = _mm256_mul_ps(t, t);
+    __m256 p = _mm256_fmadd_ps(_mm256_set1_ps(-0.0464964749f), s, _mm256_set1_ps(0.15931422f));
+    p = _mm256_fmadd_ps(p, s, _mm256_set1_ps(-0.327622764f));
+    __m256 r = _mm256_fmadd_ps(_mm256_mul_ps(p, s), t, t);
+    r = _mm256_blendv_ps(r, _mm256_sub_ps(pi_2, r), _mm256_cmp_ps(ay, ax, _CMP_GT_OQ));
+    r = _mm256_blendv_ps(r, _mm256_sub_ps(pi, r), _mm256_cmp_ps(x, zero, _CMP_LT_OQ));
+    r = _mm256_or_ps(r, _mm256_and_ps(y, sign));
+
+    // position in the color wheel
+    const __m256 fk = _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(r, inv_pi), one), scale);
+    const __m256 fk0 = _mm256_floor_ps(fk);
+    const __m256i k0 = _mm256_cvttps_epi32(fk0);
+    const __m256i k1 = _mm256_add_epi32(k0, _mm256_set1_epi32(1));
+    const __m256 f = _mm256_sub_ps(fk, fk0);
+
+    const __m256 ux = _mm256_loadu_ps(u + w);
+    const __m256 vy = _mm256_loadu_ps(v + w);
+    const __m256 rad = _mm256_mul_ps(_mm256_sqrt_ps(_mm256_fmadd_ps(ux, ux, _mm256_mul_ps(vy, vy))),
+                                     rad_scale);
+    const __m256 in_range = _mm256_cmp_ps(rad, one, _CMP_LE_OQ);
+
+    const __m256i mask8 = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(valid + w)));
+    const __m256 is_valid = _mm256_castsi256_ps(_mm256_cmpgt_epi32(mask8, _mm256_setzero_si256()));
+
+    for (int c = 0; c < 3; ++c) {
+      const __m256 col0 = _mm256_i32gather_ps(wheel.col[c], k0, 4);
+      const __m256 col1 = _mm256_i32gather_ps(wheel.col[c], k1, 4);
+      const __m256 col = _mm256_fmadd_ps(f, _mm256_sub_ps(col1, col0), col0);
+      const __m256 sat = _mm256_fnmadd_ps(rad, _mm256_sub_ps(one, col), one);
+      __m256 out = _mm256_mul_ps(_mm256_blendv_ps(_mm256_mul_ps(col, dark), sat, in_range), c255);
+      out = _mm256_blendv_ps(gray, out, is_valid);
+      _mm256_storeu_ps(rgb[c] + w, out);
+    }
+  }
+  return w;
+}
+#endif
+}; // anonymous namespace
+
+bool OpticalFlowLoader::canLoad(std::string fn) {
+  const std::string ext = lower(fn);
+  if (endsWith(ext, ".flo"))
+    return hasMagic(fn, FLO_MAGIC, 4);
+  // "PF" has 3 channels (u, v, _), single channel "Pf" (e.g. disparity or
+  // occlusion maps next to the flow) are left to the generic loader
+  if (endsWith(ext, ".pfm"))
+    return isFlowPath(fn) && hasMagic(fn, "PF", 2);
+  if (endsWith(ext, ".png") && isFlowPath(fn)) {
+    // KITTI stores flow as 16-bit rgb, read the header only
+    FIBITMAP *header = FreeImage_Load(FIF_PNG, fn.c_str(), FIF_LOAD_NOPIXELS);
+    if (header == nullptr)
+      return false;
+    const bool is_rgb16 = (FreeImage_GetImageType(header) == FIT_RGB16);
+    FreeImage_Unload(header);
+    return is_rgb16;
+  }
+  return false;
+}
 
+bool OpticalFlowLoader::decodeFlo(std::string fn, flow_t *flow) const {
   FILE *stream = fopen(fn.c_str(), "rb");
-  CHECK(stream != 0) << "cannot open flo file";
+  if (stream == nullptr) {
+    LOG(WARNING) << "cannot open flo file " << fn;
+    return false;
+  }
 
   int width, height;
   float tag;
@@ -87,78 +273,233 @@ float* OpticalFlowLoader::load(std::string fn, int *_height, int *_width, int *_
   DLOG(INFO) << "height " << height;
   DLOG(INFO) << "width " << width;
   DLOG(INFO) << "tag " << tag;
-  CHECK(ret != true) << "cannot read meta from flo file";
+  if (ret || width <= 0 || height <= 0) {
+    LOG(WARNING) << "cannot read meta from flo file " << fn;
+    fclose(stream);
+    return false;
+  }
 
-  *_width = width;
-  *_height = height;
-  *_channels = 3;
-  *_max_value = 255;
+  // the payload needs to match the header, corrupt sizes must not allocate
+  const long header_size = ftell(stream);
+  fseek(stream, 0, SEEK_END);
+  const long file_size = ftell(stream);
+  fseek(stream, header_size, SEEK_SET);
+  const uint64_t payload = (uint64_t)height * width * 2 * sizeof(float);
+  if (header_size < 0 || file_size < header_size || payload != (uint64_t)(file_size - header_size)) {
+    LOG(WARNING) << "flo file " << fn << " of " << file_size << " bytes does not hold "
+                 << width << "x" << height << " flow vectors";
+    fclose(stream);
+    return false;
+  }
 
-  // read flow file
-  // ---------------------------------------------------------------------------------------
-  float* _motion_buf = new float[(*_height) * 2 * (*_width)];
+  // read flow file at once, interleaved [H,W,2]
+  std::vector<float> motion((size_t)height * width * 2);
+  const bool complete = fread(motion.data(), sizeof(float), motion.size(), stream) == motion.size();
+  fclose(stream);
+  if (!complete) {
+    LOG(WARNING) << "truncated flo file " << fn;
+    return false;
+  }
 
+  flow->allocate(height, width);
+
+  float max_sq = 0;
+  #pragma omp parallel for reduction(max:max_sq)
   for (int h = 0; h < height; h++) {
-    CHECK((int)fread(_motion_buf + h * 2 * width, sizeof(float), 2 * (*_width), stream) == 2 * (*_width));
+    for (int w = 0; w < width; w++) {
+      const size_t i = (size_t)h * width + w;
+      const float fx = motion[2 * i + 0];
+      const float fy = motion[2 * i + 1];
+      const bool valid = std::isfinite(fx) && std::isfinite(fy) &&
+                         std::fabs(fx) < UNKNOWN_FLOW_THRESH &&
+                         std::fabs(fy) < UNKNOWN_FLOW_THRESH;
+      flow->u[i] = valid ? fx : 0.f;
+      flow->v[i] = valid ? fy : 0.f;
+      flow->valid[i] = valid;
+      max_sq = std::max(max_sq, flow->u[i] * flow->u[i] + flow->v[i] * flow->v[i]);
+    }
   }
+  flow->max_rad = std::sqrt(max_sq);
+  return true;
+}
 
+bool OpticalFlowLoader::decodeKitti(std::string fn, flow_t *flow) const {
+  FIBITMAP *img = FreeImage_Load(FIF_PNG, fn.c_str());
+  if (img == nullptr) {
+    LOG(WARNING) << "cannot load kitti flow " << fn;
+    return false;
+  }
+  if (FreeImage_GetImageType(img) != FIT_RGB16) {
+    LOG(WARNING) << "kitti flow needs to be 16-bit rgb " << fn;
+    FreeImage_Unload(img);
+    return false;
+  }
 
-  const int RY = 15;
-  const int YG = 6;
-  const int GC = 4;
-  const int CB = 11;
-  const int BM = 13;
-  const int MR = 6;
-  const int NCOLS = RY + YG + GC + CB + BM + MR;
-
+  const int height = FreeImage_GetHeight(img);
+  const int width = FreeImage_GetWidth(img);
+  flow->allocate(height, width);
 
-  float max_rad = 0;
+  // u = (r - 2^15) / 64, v = (g - 2^15) / 64, valid = b > 0
+  float max_sq = 0;
+  #pragma omp parallel for reduction(max:max_sq)
   for (int h = 0; h < height; h++) {
+    const FIRGB16 *line = (FIRGB16 *) FreeImage_GetScanLine(img, height - 1 - h);
     for (int w = 0; w < width; w++) {
-      float fx = _motion_buf[ h * 2 * width + 2 * w + 0];
-      float fy = _motion_buf[ h * 2 * width + 2 * w + 1];
+      const size_t i = (size_t)h * width + w;
+      const bool valid = line[w].blue > 0;
+      flow->u[i] = valid ? ((float) line[w].red - 32768.f) / 64.f : 0.f;
+      flow->v[i] = valid ? ((float) line[w].green - 32768.f) / 64.f : 0.f;
+      flow->valid[i] = valid;
+      max_sq = std::max(max_sq, flow->u[i] * flow->u[i] + flow->v[i] * flow->v[i]);
+    }
+  }
+  flow->max_rad = std::sqrt(max_sq);
+  FreeImage_Unload(img);
+  return true;
+}
+
+bool OpticalFlowLoader::decodePfm(std::string fn, flow_t *flow) const {
+  FILE *stream = fopen(fn.c_str(), "rb");
+  if (stream == nullptr) {
+    LOG(WARNING) << "cannot open pfm file " << fn;
+    return false;
+  }
+
+  char tag[3] = {0, 0, 0};
+  int width, height;
+  float scale;
+  bool ret = fscanf(stream, "%2s %d %d %f", tag, &width, &height, &scale) != 4;
+  if (ret || width <= 0 || height <= 0) {
+    LOG(WARNING) << "cannot read meta from pfm file " << fn;
+    fclose(stream);
+    return false;
+  }
+  // exactly one whitespace separates header and data
+  fgetc(stream);
 
-      const float rad = sqrt(fx * fx + fy * fy);
+  if (std::string(tag) != "PF") {
+    LOG(WARNING) << "pfm flow needs (u, v, _) channels " << fn;
+    fclose(stream);
+    return false;
+  }
+  const int channels = 3;
+
+  std::vector<float> data((size_t)height * width * channels);
+  const bool complete = fread(data.data(), sizeof(float), data.size(), stream) == data.size();
+  fclose(stream);
+  if (!complete) {
+    LOG(WARNING) << "truncated pfm file " << fn;
+    return false;
+  }
 
-      if (rad > max_rad) {
-        max_rad = rad;
-      }
+  // negative scale means little endian
+  const bool swap = (scale < 0) != (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__);
+  auto value = [&](size_t i) {
+    if (!swap)
+      return data[i];
+    uint32_t raw;
+    memcpy(&raw, &data[i], sizeof(raw));
+    raw = __builtin_bswap32(raw);
+    float f;
+    memcpy(&f, &raw, sizeof(f));
+    return f;
+  };
+
+  flow->allocate(height, width);
+
+  // rows are stored bottom to top
+  float max_sq = 0;
+  #pragma omp parallel for reduction(max:max_sq)
+  for (int h = 0; h < height; h++) {
+    const size_t row = (size_t)(height - 1 - h) * width;
+    for (int w = 0; w < width; w++) {
+      const size_t i = (size_t)h * width + w;
+      const float fx = value((row + w) * channels + 0);
+      const float fy = value((row + w) * channels + 1);
+      const bool valid = std::isfinite(fx) && std::isfinite(fy) &&
+                         std::fabs(fx) < UNKNOWN_FLOW_THRESH &&
+                         std::fabs(fy) < UNKNOWN_FLOW_THRESH;
+      flow->u[i] = valid ? fx : 0.f;
+      flow->v[i] = valid ? fy : 0.f;
+      flow->valid[i] = valid;
+      max_sq = std::max(max_sq, flow->u[i] * flow->u[i] + flow->v[i] * flow->v[i]);
     }
   }
+  flow->max_rad = std::sqrt(max_sq);
+  return true;
+}
+
+void OpticalFlowLoader::colorize(const flow_t &flow, float max_rad, float *dst) const {
+  const int height = flow.height;
+  const int width = flow.width;
+  const size_t area = (size_t)height * width;
 
+  if (max_rad <= 0)
+    max_rad = 1;
+
+  // planar color wheel in [0, 1], entry NCOLS repeats entry 0 to avoid the modulo
+  wheel_t wheel;
+  for (int k = 0; k <= NCOLS; ++k)
+    for (int c = 0; c < 3; ++c)
+      wheel.col[c][k] = colorWheel[(k % NCOLS) * 3 + c] / 255.0f;
+
+#if defined(__x86_64__) || defined(__i386__)
+  static const bool use_avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#else
+  const bool use_avx2 = false;
+#endif
+  DLOG(INFO) << "colorize flow with " << (use_avx2 ? "avx2" : "scalar") << " code path";
 
   // convert to hsv image space
   // ---------------------------------------------------------------------------------------
-  float* _raw_buf = new float[(*_channels) * (*_height) * (*_width)];
+  #pragma omp parallel for
   for (int h = 0; h < height; h++) {
-    for (int w = 0; w < width; w++) {
+    const size_t off = (size_t)h * width;
+    float *rgb[3] = {dst + off, dst + area + off, dst + 2 * area + off};
+    int w = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    if (use_avx2)
+      w = colorizeRowAvx2(flow.u.data() + off, flow.v.data() + off, flow.valid.data() + off,
+                          width, 1.f / max_rad, wheel, rgb);
+#endif
+    colorizeRowScalar(flow.u.data() + off, flow.v.data() + off, flow.valid.data() + off,
+                      w, width, 1.f / max_rad, wheel, rgb);
+  }
+}
 
+bool OpticalFlowLoader::decode(std::string fn, flow_t *flow) const {
+  const std::string ext = lower(fn);
+  if (endsWith(ext, ".png"))
+    return decodeKitti(fn, flow);
+  if (endsWith(ext, ".pfm"))
+    return decodePfm(fn, flow);
+  return decodeFlo(fn, flow);
+}
 
-      float fx = _motion_buf[ h * 2 * width + 2 * w + 0];
-      float fy = _motion_buf[ h * 2 * width + 2 * w + 1];
+float OpticalFlowLoader::initialRadius(const flow_t &flow) {
+  // a fixed radius allows to compare several flow fields
+  return (FLAGS_flow_max_radius > 0) ? FLAGS_flow_max_radius : flow.max_rad;
+}
 
-      const float rad = sqrt(fx * fx + fy * fy);
-      const float a = atan2(-fy, -fx) / (float) M_PI;
-      const float fk = (a + 1.0f) / 2.0f * (NCOLS - 1);
-      const int k0 = static_cast<int>(fk);
-      const int k1 = (k0 + 1) % NCOLS;
-      const float f = fk - k0;
+float* OpticalFlowLoader::load(std::string fn, int *_height, int *_width, int *_channels, float *_max_value)  {
 
-      for (int c = 0; c < *_channels; ++c) {
-        const float col0 = colorWheel[k0 * 3 + c] / 255.0f;
-        const float col1 = colorWheel[k1 * 3 + c] / 255.0f;
+  flow_t flow;
+  if (!decode(fn, &flow))
+    return nullptr;
+
+  *_width = flow.width;
+  *_height = flow.height;
+  *_channels = 3;
+  *_max_value = 255;
 
-        float col = (1 - f) * col0 + f * col1;
-        col = 1 - (rad / max_rad) * (1 - col);
+  const float max_rad = initialRadius(flow);
+  DLOG(INFO) << "max radius " << flow.max_rad << " normalized by " << max_rad;
 
-        _raw_buf[c * (height * width) + h * width + w] = col * 255.;
-      }
-    }
-  }
-  fclose(stream);
+  const size_t elements = (*_channels) * ((size_t)(*_height) * (*_width));
+  float* _raw_buf = TileStore::allocate(elements, TileStore::outOfCore(elements * sizeof(float)));
+  colorize(flow, max_rad, _raw_buf);
   return _raw_buf;
 }
 
-
 }; // namespace Loader
 }; // namespace Utils
\ No newline at end of file
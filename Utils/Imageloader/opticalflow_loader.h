@@ -1,6 +1,8 @@
 #ifndef OPTICALFLOW_LOADER_H
 #define OPTICALFLOW_LOADER_H
 
+#include <cstdint>
+#include <vector>
 #include "image_loader.h"
 
 namespace Utils
@@ -9,12 +11,62 @@ namespace Utils
   {
     /**
      * @brief loading all filetypes that OpticalFlow library can handle
+     * @details Supported are Middlebury (*.flo), KITTI 16-bit png and pfm flow.
+     *          As png and pfm files usually are regular images, they are only
+     *          treated as flow when the name matches --flow_patterns (e.g.
+     *          "frame_flow.png" or KITTI's "flow_occ/000000_10.png") and the
+     *          header matches: 16-bit rgb png and 3-channel "PF" pfm.
+     *          Middlebury files are recognized by their tag and size.
      */
     class OpticalFlowLoader : public ImageLoader
     {
+    public:
+      /**
+       * @brief raw flow field with validity mask
+       * @details u, v and valid are planes of size [H,W]
+       */
+      struct flow_t {
+        int height;
+        int width;
+        std::vector<float> u;
+        std::vector<float> v;
+        std::vector<uint8_t> valid;
+        // largest radius of all valid flow vectors
+        float max_rad;
+        void allocate(int h, int w) {
+          height = h;
+          width = w;
+          u.resize((size_t)h * w);
+          v.resize((size_t)h * w);
+          valid.resize((size_t)h * w);
+        }
+      };
 
+    private:
       uint8_t colorWheel[55 * 3];
+
+      // Middlebury marks unknown flow by huge values
+      static constexpr float UNKNOWN_FLOW_THRESH = 1e9;
+
+      /**
+       * @brief decode the flow field
+       * @return false (with a warning) if the file is not readable or corrupt
+       */
+      bool decodeFlo(std::string fn, flow_t *flow) const;
+      bool decodeKitti(std::string fn, flow_t *flow) const;
+      bool decodePfm(std::string fn, flow_t *flow) const;
+
     public:
+      // number of entries in the color wheel
+      static const int NCOLS = 55;
+      /**
+       * @brief color wheel as planes of floats in [0, 1]
+       * @details entry NCOLS repeats entry 0, such that k0 + 1 needs no wrap-around
+       */
+      struct wheel_t {
+        float col[3][NCOLS + 1];
+      };
+
       OpticalFlowLoader();
       ~OpticalFlowLoader();
 
@@ -24,8 +76,31 @@ namespace Utils
       bool canLoad(std::string fn);
       float* load(std::string fn, int *h, int *w, int *_channels, float *_max_value) ;
 
+      /**
+       * @brief decode the flow field without coloring it
+       * @details lets the caller keep the raw flow to color it again with
+       *          another radius
+       * @return false (with a warning) if the file is not readable or corrupt
+       */
+      bool decode(std::string fn, flow_t *flow) const;
+      /**
+       * @brief radius a freshly opened flow field is normalized by
+       * @details --flow_max_radius if set, otherwise the largest radius of the file
+       */
+      static float initialRadius(const flow_t &flow);
+
+      /**
+       * @brief Middlebury color coding, invalid pixels are gray
+       * @details rows are processed in parallel using AVX2 if the cpu supports it
+       *
+       * @param flow decoded flow field
+       * @param max_rad radius mapped to full saturation
+       * @param dst planar rgb buffer [3,H,W] in [0, 255]
+       */
+      void colorize(const flow_t &flow, float max_rad, float *dst) const;
+
     };
   }; // namespace Loader
 }; // namespace Utils
 
-#endif // OPTICALFLOW_LOADER_H
\ No newline at end of file
+#endif // OPTICALFLOW_LOADER_H
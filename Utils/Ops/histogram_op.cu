@@ -17,9 +17,8 @@ __global__ void cuda(const float *src, float *dst,
       float scaled = inp / _scaling.scale;
       scaled -= _scaling.min / _scaling.scale;
       scaled /= (_scaling.max - _scaling.min) / _scaling.scale;
-      // apply clipping
-      scaled = min(scaled, 1.f);
-      scaled = max(scaled, 0.f);
+      // apply clipping, NaN fails the comparison and becomes 0
+      scaled = (scaled > 0.f) ? min(scaled, 1.f) : 0.f;
       dst[c * H * W + h * W + w] = scaled;
     }
   }
@@ -39,9 +38,8 @@ void HistogramOp::apply_cpu(const float* src, float* dst,
     float scaled = src[i] / _scaling.scale;
     scaled -= _scaling.min / _scaling.scale;
     scaled /= (_scaling.max - _scaling.min) / _scaling.scale;
-    // apply clipping
-    scaled = std::min(scaled, 1.f);
-    dst[i] = std::max(scaled, 0.f);
+    // apply clipping, NaN fails the comparison and becomes 0
+    dst[i] = (scaled > 0.f) ? std::min(scaled, 1.f) : 0.f;
   }
 }
 
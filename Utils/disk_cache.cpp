@@ -0,0 +1,280 @@
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include <QDir>
+#include <QFileInfo>
+#include <QStandardPaths>
+
+#include <glog/logging.h>
+#include <gflags/gflags.h>
+
+#include "disk_cache.h"
+#include "image_data.h"
+#include "histogram_data.h"
+#include "mipmap.h"
+#include "mipmap_level.h"
+#include "mipmap_tile.h"
+#include "gl_object.h"
+
+DEFINE_bool(disk_cache, true,
+            "reuse decoded images, histograms and pyramids of previously opened files");
+DEFINE_string(disk_cache_dir, "",
+              "cache directory (default: $XDG_CACHE_HOME/saccade)");
+DEFINE_int32(disk_cache_size, 4096,
+             "size limit of the cache directory in MB");
+
+namespace {
+const char MAGIC[8] = "SACCADE";
+const uint32_t VERSION = 1;
+// sections start at page boundaries to be mapped in place
+const uint64_t ALIGNMENT = 4096;
+// content is sampled at the beginning, middle and end of the file
+const size_t SAMPLE_SIZE = 64 * 1024;
+
+uint64_t align(uint64_t offset) {
+  return (offset + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+}
+
+// FNV-1a
+void hash(uint64_t *h, const char* data, size_t len) {
+  for (size_t i = 0; i < len; ++i) {
+    *h ^= (unsigned char) data[i];
+    *h *= 1099511628211ull;
+  }
+}
+
+void pad(std::ofstream &out, uint64_t offset) {
+  static const char zeros[ALIGNMENT] = {0};
+  const uint64_t missing = offset - out.tellp();
+  out.write(zeros, missing);
+}
+}; // anonymous namespace
+
+// entry
+// ==========================================================================================
+Utils::DiskCache::Entry::Entry(void* addr, size_t size)
+  : _addr(static_cast<const char*>(addr)), _size(size) {}
+
+Utils::DiskCache::Entry::~Entry() {
+  munmap(const_cast<char*>(_addr), _size);
+}
+
+const Utils::DiskCache::header_t* Utils::DiskCache::Entry::header() const {
+  return reinterpret_cast<const header_t*>(_addr);
+}
+
+const float* Utils::DiskCache::Entry::image() const {
+  return reinterpret_cast<const float*>(_addr + header()->image_offset);
+}
+
+const double* Utils::DiskCache::Entry::histogram(int c) const {
+  return reinterpret_cast<const double*>(_addr + header()->histogram_offset) + c * header()->bins;
+}
+
+const float* Utils::DiskCache::Entry::level(int l) const {
+  return reinterpret_cast<const float*>(_addr + header()->level_offset[l]);
+}
+
+// cache
+// ==========================================================================================
+bool Utils::DiskCache::enabled() {
+  return FLAGS_disk_cache && !directory().empty();
+}
+
+std::string Utils::DiskCache::directory() {
+  // thread-safe initialization, read by the GUI and the cache writer thread
+  static const std::string dir = [] {
+    QString path = QString::fromStdString(FLAGS_disk_cache_dir);
+    if (path.isEmpty())
+      path = QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation) + "/saccade";
+    if (QDir().mkpath(path))
+      return path.toStdString();
+    LOG(WARNING) << "cannot create cache directory " << path.toStdString();
+    return std::string();
+  }();
+  return dir;
+}
+
+std::string Utils::DiskCache::entryPath(std::string key) {
+  return directory() + "/" + key + ".sac";
+}
+
+std::string Utils::DiskCache::key(std::string fn) {
+  struct stat st;
+  if (stat(fn.c_str(), &st) != 0)
+    return "";
+
+  uint64_t h = 14695981039346656037ull;
+  const std::string path = QFileInfo(QString::fromStdString(fn)).absoluteFilePath().toStdString();
+  hash(&h, path.c_str(), path.size());
+  const int64_t meta[3] = {(int64_t) st.st_size, (int64_t) st.st_mtim.tv_sec, (int64_t) st.st_mtim.tv_nsec};
+  hash(&h, reinterpret_cast<const char*>(meta), sizeof(meta));
+
+  std::ifstream in(fn, std::ios::binary);
+  if (!in)
+    return "";
+  std::vector<char> buf(SAMPLE_SIZE);
+  const size_t size = st.st_size;
+  const size_t starts[3] = {0, size / 2, (size > SAMPLE_SIZE) ? size - SAMPLE_SIZE : 0};
+  for (size_t start : starts) {
+    in.seekg(start);
+    in.read(buf.data(), SAMPLE_SIZE);
+    hash(&h, buf.data(), in.gcount());
+    in.clear();
+  }
+
+  std::stringstream stream;
+  stream << std::hex << std::setw(16) << std::setfill('0') << h;
+  return stream.str();
+}
+
+Utils::DiskCache::Entry_ptr Utils::DiskCache::lookup(std::string fn) {
+  if (!enabled())
+    return nullptr;
+  const std::string k = key(fn);
+  if (k.empty())
+    return nullptr;
+  const std::string path = entryPath(k);
+
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return nullptr;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(header_t)) {
+    close(fd);
+    return nullptr;
+  }
+  // private writable mapping: accidental writes stay copy-on-write
+  void* addr = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED)
+    return nullptr;
+
+  Entry_ptr entry(new Entry(addr, st.st_size));
+  const header_t *hdr = entry->header();
+  bool valid = memcmp(hdr->magic, MAGIC, sizeof(MAGIC)) == 0 && hdr->version == VERSION
+               && hdr->levels > 0 && hdr->levels <= MAX_LEVELS;
+  if (valid) {
+    const uint32_t l = hdr->levels - 1;
+    const uint64_t end = hdr->level_offset[l] + (uint64_t) hdr->level_height[l]
+                         * hdr->level_width[l] * hdr->channels * sizeof(float);
+    valid = end <= (uint64_t) st.st_size;
+  }
+  if (!valid) {
+    LOG(WARNING) << "drop corrupted cache entry " << path;
+    unlink(path.c_str());
+    return nullptr;
+  }
+
+  // least recently used is tracked by mtime
+  utime(path.c_str(), nullptr);
+  DLOG(INFO) << "cache hit " << fn << " -> " << path;
+  return entry;
+}
+
+bool Utils::DiskCache::store(std::string fn,
+                             const ImageData *img,
+                             const HistogramData *hist,
+                             const Mipmap *mipmap,
+                             float scaling_min, float scaling_max) {
+  if (!enabled())
+    return false;
+  if (mipmap->_levels.empty() || mipmap->_levels.size() > (size_t) MAX_LEVELS)
+    return false;
+  const std::string k = key(fn);
+  if (k.empty())
+    return false;
+
+  header_t hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, MAGIC, sizeof(MAGIC));
+  hdr.version = VERSION;
+  hdr.height = img->height();
+  hdr.width = img->width();
+  hdr.channels = img->channels();
+  hdr.max_value = img->max();
+  hdr.range_min = hist->range_used()->min;
+  hdr.range_max = hist->range_used()->max;
+  hdr.scaling_min = scaling_min;
+  hdr.scaling_max = scaling_max;
+  hdr.bins = hist->bins();
+  hdr.tile_size = mipmap->_levels[0]->tileSize();
+  hdr.levels = mipmap->_levels.size();
+
+  uint64_t offset = align(sizeof(header_t));
+  hdr.image_offset = offset;
+  offset = align(offset + img->elements() * sizeof(float));
+  hdr.histogram_offset = offset;
+  offset = align(offset + (uint64_t) hdr.channels * hdr.bins * sizeof(double));
+  for (uint32_t l = 0; l < hdr.levels; ++l) {
+    const MipmapLevel *level = mipmap->_levels[l];
+    hdr.level_offset[l] = offset;
+    hdr.level_height[l] = level->height();
+    hdr.level_width[l] = level->width();
+    offset = align(offset + (uint64_t) level->height() * level->width() * hdr.channels * sizeof(float));
+  }
+
+  // write to a temporary file first, such that readers never see partial entries
+  const std::string path = entryPath(k);
+  const std::string tmp = path + ".tmp";
+  std::ofstream out(tmp, std::ios::binary);
+  if (!out)
+    return false;
+
+  out.write(reinterpret_cast<const char*>(&hdr), sizeof(hdr));
+  pad(out, hdr.image_offset);
+  out.write(reinterpret_cast<const char*>(img->data()), img->elements() * sizeof(float));
+  pad(out, hdr.histogram_offset);
+  for (uint32_t c = 0; c < hdr.channels; ++c)
+    for (uint32_t b = 0; b < hdr.bins; ++b) {
+      const double count = hist->counts()[c][b];
+      out.write(reinterpret_cast<const char*>(&count), sizeof(double));
+    }
+  for (uint32_t l = 0; l < hdr.levels; ++l) {
+    MipmapLevel *level = mipmap->_levels[l];
+    pad(out, hdr.level_offset[l]);
+    for (uint h = 0; h < level->gridHeight(); ++h)
+      for (uint w = 0; w < level->gridWidth(); ++w) {
+        // uploaded tiles might have dropped their data
+        const float* data = level->acquire(h, w);
+        out.write(reinterpret_cast<const char*>(data), level->tile(h, w)->obj()->size());
+        level->release(h, w);
+      }
+  }
+  out.close();
+
+  if (!out || rename(tmp.c_str(), path.c_str()) != 0) {
+    LOG(WARNING) << "cannot write cache entry " << path;
+    unlink(tmp.c_str());
+    return false;
+  }
+  DLOG(INFO) << "cached " << fn << " -> " << path;
+  evict();
+  return true;
+}
+
+void Utils::DiskCache::evict() {
+  QDir dir(QString::fromStdString(directory()));
+  // oldest last
+  QFileInfoList entries = dir.entryInfoList(QStringList("*.sac"), QDir::Files, QDir::Time);
+
+  const qint64 limit = (qint64) FLAGS_disk_cache_size * 1024 * 1024;
+  qint64 total = 0;
+  for (auto && entry : entries) {
+    total += entry.size();
+    if (total > limit) {
+      DLOG(INFO) << "evict cache entry " << entry.fileName().toStdString();
+      // mapped entries stay valid until they are unmapped
+      dir.remove(entry.fileName());
+    }
+  }
+}
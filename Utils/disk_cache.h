@@ -0,0 +1,131 @@
+#ifndef DISK_CACHE_H
+#define DISK_CACHE_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace Utils  {
+
+class ImageData;
+class HistogramData;
+class Mipmap;
+
+/**
+ * @brief persistent cache of decoded images, histograms and pyramids
+ * @details Every entry is a single file "<key>.sac" in the cache directory
+ *          ($XDG_CACHE_HOME/saccade by default). The key is a hash of the
+ *          absolute path, mtime, size and some sampled content of the source
+ *          file, such that edited files miss. An entry is mapped read-only
+ *          and its sections are page aligned, so the pyramid tiles are used in
+ *          place and paged in by the kernel when they are uploaded.
+ *
+ *          Layout: header | image [C,H,W] | histogram [C,bins] (double) |
+ *          level 0 | level 1 | ... where a level is the sequence of its tiles
+ *          in row-major grid order and each tile is interleaved [h,w,C].
+ *
+ *          The directory is trimmed to --disk_cache_size by removing the
+ *          least recently used entries (hits touch the file).
+ */
+class DiskCache {
+ public:
+  static const int MAX_LEVELS = 32;
+
+  struct header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t height;
+    uint32_t width;
+    uint32_t channels;
+    float max_value;
+    // HistogramData::range_used
+    float range_min;
+    float range_max;
+    // histogram scaling the pyramid was built with
+    float scaling_min;
+    float scaling_max;
+    uint32_t bins;
+    uint32_t tile_size;
+    uint32_t levels;
+    uint64_t image_offset;
+    uint64_t histogram_offset;
+    uint64_t level_offset[MAX_LEVELS];
+    uint32_t level_height[MAX_LEVELS];
+    uint32_t level_width[MAX_LEVELS];
+  };
+
+  /**
+   * @brief mapped cache file, unmapped when the last user is gone
+   */
+  class Entry {
+   public:
+    ~Entry();
+    const header_t* header() const;
+    /**
+     * @brief decoded source image [C,H,W]
+     */
+    const float* image() const;
+    /**
+     * @brief histogram counts of channel c
+     */
+    const double* histogram(int c) const;
+    /**
+     * @brief tiles of pyramid level l
+     */
+    const float* level(int l) const;
+
+   private:
+    friend class DiskCache;
+    Entry(void* addr, size_t size);
+    const char* _addr;
+    size_t _size;
+  };
+  typedef std::shared_ptr<Entry> Entry_ptr;
+
+  /**
+   * @brief cache is enabled and its directory is usable
+   */
+  static bool enabled();
+  /**
+   * @brief cache directory, created on first use
+   * @details empty if it cannot be created, does not change afterwards
+   */
+  static std::string directory();
+
+  /**
+   * @brief map cached data of given image file
+   * @return nullptr on a miss
+   */
+  static Entry_ptr lookup(std::string fn);
+
+  /**
+   * @brief write image, histogram and pyramid of given image file
+   * @details expensive, meant to be called from a background thread
+   *
+   * @param scaling_min histogram scaling the pyramid was built with
+   * @param scaling_max histogram scaling the pyramid was built with
+   * @return entry was written
+   */
+  static bool store(std::string fn,
+                    const ImageData *img,
+                    const HistogramData *hist,
+                    const Mipmap *mipmap,
+                    float scaling_min, float scaling_max);
+
+  /**
+   * @brief remove least recently used entries until the size limit holds
+   */
+  static void evict();
+
+ private:
+  /**
+   * @brief hash of path, mtime, size and sampled content ("" if unreadable)
+   */
+  static std::string key(std::string fn);
+  static std::string entryPath(std::string key);
+};
+
+}; // namespace Utils
+
+#endif // DISK_CACHE_H
@@ -5,7 +5,8 @@
 #include "../GUI/slides.h"
 #include "../GUI/canvas.h"
 
-Utils::GlManager::GlManager(QOpenGLContext* context) {
+Utils::GlManager::GlManager(QOpenGLContext* context)
+  : _incomplete(false), _uploaded(0), _uploads(0) {
   ctx = context;
 }
 Utils::GlManager::~GlManager() {}
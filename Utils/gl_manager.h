@@ -3,6 +3,7 @@
 
 #include <QOpenGLFunctions>
 #include <iostream>
+#include <gflags/gflags.h>
 
 #include "gl_object.h"
 
@@ -11,6 +12,9 @@ class Canvas;
 class Marker;
 }; // namespace GUI
 
+// defined next to the tiles, which are uploaded by the core library
+DECLARE_int32(upload_budget);
+
 namespace Utils {
 
 /**
@@ -23,6 +27,11 @@ namespace Utils {
 class GlManager : public QOpenGLFunctions {
   QOpenGLContext* ctx;
 
+  // state of the current frame
+  bool _incomplete;
+  size_t _uploaded;
+  int _uploads;
+
  public:
   GlManager(QOpenGLContext* context);
   ~GlManager();
@@ -38,28 +47,60 @@ class GlManager : public QOpenGLFunctions {
   void modelview_identity();
   void enable_texture_blend();
 
+  /**
+   * @brief start a new frame, resets the texture upload budget
+   */
+  void beginFrame() {
+    _incomplete = false;
+    _uploaded = 0;
+    _uploads = 0;
+  }
+
+  /**
+   * @brief account a texture upload against the budget of this frame
+   * @details the budget is given by --upload_budget, the first upload of a
+   *          frame always fits
+   * @return upload should happen in this frame
+   */
+  bool allowUpload(size_t bytes) {
+    if (_uploads > 0
+        && _uploaded + bytes > (size_t) FLAGS_upload_budget * 1024 * 1024)
+      return false;
+    _uploaded += bytes;
+    _uploads++;
+    return true;
+  }
+
+  /**
+   * @brief some tiles were not ready, the frame should be drawn again soon
+   */
+  void markIncomplete() {_incomplete = true;}
+  bool incomplete() const {return _incomplete;}
+
   /**
    * @brief prepare data for OpenGL
    * @details [long description]
    *
    * @param obj containing raw buffer and shape
-   * @param type float / unsigned char
-   * @param interpolation nearestneighbor / linear
-   * @param generate_buffer prevent multiple buffers for same texture
+   * @param texture recycled texture of the same shape and format (or 0)
+   * @param buffer recycled pixel buffer (or 0)
    * @tparam Dtype [description]
    */
   template<typename Dtype>
-  void prepare(GlObject<Dtype> *obj) {
+  void prepare(GlObject<Dtype> *obj, GLuint texture = 0, GLuint buffer = 0) {
 
-    obj->texture_id = 0;
+    obj->texture_id = texture;
 
     if (!obj->loaded) {
-      glGenBuffers(1, &obj->buffer_id);
-      glBindBuffer(GL_PIXEL_UNPACK_BUFFER_ARB, obj->buffer_id);
+      obj->buffer_id = buffer;
+      if (obj->buffer_id == 0)
+        glGenBuffers(1, &obj->buffer_id);
       obj->loaded = true;
     }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER_ARB, obj->buffer_id);
 
-    glGenTextures(1, &obj->texture_id);
+    if (obj->texture_id == 0)
+      glGenTextures(1, &obj->texture_id);
     glBindTexture(GL_TEXTURE_2D, obj->texture_id);
 
     glPixelStorei(GL_PACK_ALIGNMENT, 1);
@@ -76,9 +117,14 @@ class GlManager : public QOpenGLFunctions {
     glBufferData(GL_PIXEL_UNPACK_BUFFER_ARB,
                  obj->size(),
                  obj->data, GL_DYNAMIC_DRAW);
-    glTexImage2D(GL_TEXTURE_2D, 0, obj->internalformat(),
-                 obj->width, obj->height, 0,
-                 obj->internalformat(), obj->type(), NULL);
+    // recycled textures keep their storage
+    if (texture != 0)
+      glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, obj->width, obj->height,
+                      obj->internalformat(), obj->type(), NULL);
+    else
+      glTexImage2D(GL_TEXTURE_2D, 0, obj->internalformat(),
+                   obj->width, obj->height, 0,
+                   obj->internalformat(), obj->type(), NULL);
 
     glBindBuffer(GL_PIXEL_UNPACK_BUFFER_ARB, 0);
   }
@@ -106,6 +152,37 @@ class GlManager : public QOpenGLFunctions {
     glBindBuffer(GL_PIXEL_UNPACK_BUFFER_ARB, 0);
   }
 
+  /**
+   * @brief draw a quad of a single color without a texture
+   * @details the color matches a texture of uniform pixels with the given
+   *          value (luminance, rgb or rgba)
+   *
+   * @param value one value per channel
+   */
+  void drawFlat(const float* value, size_t channels,
+                double top, double left,
+                double bottom, double right,
+                double depth = 1) {
+    float rgba[4] = {value[0], value[0], value[0], 1.f};
+    if (channels > 1)
+      for (size_t c = 1; c < 3; ++c)
+        rgba[c] = (c < channels) ? value[c] : 0.f;
+    if (channels == 4)
+      rgba[3] = value[3];
+
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glColor4f(rgba[0], rgba[1], rgba[2], rgba[3]);
+
+    glBegin(GL_QUADS);
+    glVertex3d(left, top, depth);
+    glVertex3d(right, top, depth);
+    glVertex3d(right, bottom, depth);
+    glVertex3d(left, bottom, depth);
+    glEnd();
+
+    glColor4f(1.f, 1.f, 1.f, 1.f);
+  }
+
   /**
    * @brief draw pixel location marker
    * @details [long description]
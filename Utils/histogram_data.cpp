@@ -1,5 +1,6 @@
 #include "histogram_data.h"
 
+#include <cmath>
 #include <limits>
 #include <random>
 
@@ -54,8 +55,11 @@ void Utils::HistogramData::setImage(const ImageData *data, float scale) {
 
   for (int c = 0; c < _channels; ++c) {
     std::vector<double> channelBins(_nbins, 0.);
-    for (int n = 0; n < data->area(); n += sampling_freq) {
+    for (size_t n = 0; n < data->area(); n += sampling_freq) {
       const double value = data->value(n, c);
+      // NaN/Inf have no bin and would spoil the used range
+      if (!std::isfinite(value))
+        continue;
 
       _range_used.min = std::min(_range_used.min, (float)value);
       _range_used.max = std::max(_range_used.max, (float)value);
@@ -84,6 +88,33 @@ Utils::HistogramData::range_t* Utils::HistogramData::range() {
   return &_range;
 }
 
+void Utils::HistogramData::setCounts(const ImageData *data, float scale,
+                                     const std::vector<std::vector<double> > &counts,
+                                     range_t range_used) {
+  _available = false;
+
+  _channels = data->channels();
+  _img = data;
+  _data = counts;
+  _nbins = _data.empty() ? 0 : _data[0].size();
+
+  _range.min = 0;
+  _range.max = scale;
+  _range_used = range_used;
+
+  _bin_info.clear();
+  for (auto && channelBins : _data)
+    for (auto && count : channelBins)
+      if (count > 0)
+        _bin_info.update(count);
+
+  _available = true;
+}
+
+const std::vector<std::vector<double> >& Utils::HistogramData::counts() const {
+  return _data;
+}
+
 const Utils::HistogramData::range_t* Utils::HistogramData::range() const {
   return &_range;
 }
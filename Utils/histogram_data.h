@@ -70,8 +70,21 @@ class HistogramData {
   int amount(int channel, int bin) const;
 
   const bin_info_t bin_info() const;
+  /**
+   * @brief bin counts of all channels [C][bins]
+   */
+  const std::vector<std::vector<double> >& counts() const;
 
   void setImage(const ImageData *data, float max = 1.0f);
+  /**
+   * @brief restore a previously computed histogram (e.g. from the disk cache)
+   *
+   * @param counts bin counts of all channels [C][bins]
+   * @param range_used value range of the image
+   */
+  void setCounts(const ImageData *data, float max,
+                 const std::vector<std::vector<double> > &counts,
+                 range_t range_used);
 
 };
 
@@ -1,4 +1,5 @@
 #include "image_data.h"
+#include <algorithm>
 #include <iostream>
 #include <iomanip>
 #include <sstream>
@@ -8,68 +9,11 @@
 #include <string.h>
 #include <glog/logging.h>
 #include "misc.h"
+#include "tile_store.h"
+#include "image_writer.h"
 #include "Imageloader/freeimage_loader.h"
 #include "Imageloader/opticalflow_loader.h"
-
-
-// threads
-// ==========================================================================================
-Utils::threads::ImageWriterThread::ImageWriterThread() {
-	_running = false;
-}
-
-bool Utils::threads::ImageWriterThread::notify( float* copied_buffer,
-    int top, int left, int bottom, int right,
-    int height, int width, int channels,
-    std::string fn) {
-	if (_running)
-		return false;
-	_running = true;
-	_buffer = copied_buffer;
-	_top = std::max(top, 0);
-	_left = std::max(left, 0);
-	_bottom = std::min(bottom, height);
-	_right = std::min(right, width);
-	_height = height;
-	_width = width;
-	_channels = channels;
-	_fn = fn;
-	return true;
-}
-
-void Utils::threads::ImageWriterThread::run() {
-	typedef FIBITMAP* FIBitmapPtr;
-	const int n_height = _bottom - _top;
-	const int n_width = _right - _left;
-
-	auto read_accessor = [&](int h, int w, int c){return (_channels - c - 1) * (_height * _width) + h * _width + w;};
-	auto write_accessor = [&](int h, int w, int c){return h * n_width * _channels + w * _channels + c;};
-
-	BYTE* pixels = new BYTE[3 * n_width * n_height];
-
-	for (int c = 0; c < _channels; ++c) {
-		for (int hh = 0; hh < n_height; ++hh) {
-			int h = hh + _top;
-			for (int ww = 0; ww < n_width; ++ww) {
-				int w = ww + _left;
-				pixels[write_accessor(hh, ww, c)] = (BYTE) 255. * _buffer[read_accessor(h, w, c)];
-			}
-		}
-	}
-
-	const int bpp = 8 * 3;
-	const bool topleft = true;
-	const int scanwidth = n_width * 3;
-
-	FIBitmapPtr Image = FreeImage_ConvertFromRawBits(pixels, n_width, n_height,
-	                    scanwidth, bpp,
-	                    0xFF0000, 0x00FF00, 0x0000FF, topleft);
-	FreeImage_Save(FIF_PNG, Image, _fn.c_str(), 0);
-	delete[] pixels;
-	FreeImage_Unload(Image);
-	delete[] _buffer;
-	_running = false;
-}
+#include "Imageloader/exr_loader.h"
 
 
 /* This file is responsible to load the image data
@@ -84,12 +28,7 @@ JPG:
 */
 
 bool Utils::ImageData::knownImageFormat(std::string filename) {
-	// todo (remove this construction all the time)
-	std::vector<Loader::ImageLoader*> _tmp_loaders;
-	_tmp_loaders.push_back(new Loader::FreeImageLoader());
-	_tmp_loaders.push_back(new Loader::OpticalFlowLoader());
-
-	for (auto && loader : _tmp_loaders) {
+	for (auto && loader : loaders()) {
 		if (loader->canLoad(filename)) {
 			return true;
 		}
@@ -99,63 +38,145 @@ bool Utils::ImageData::knownImageFormat(std::string filename) {
 }
 
 Utils::ImageData::~ImageData() {
-	registerLoaders();
+	clear();
 }
 
 Utils::ImageData::ImageData(float*d, int h, int w, int c)
-	: _raw_buf(d), _height(h), _width(w), _channels(c) {
-	registerLoaders();
+	: _raw_buf(d), _height(h), _width(w), _channels(c), _tile_size(0), _plane_loader(nullptr),
+	  _flow_radius(0), _owned(false) {}
+
+const std::vector<Utils::Loader::ImageLoader*>& Utils::ImageData::loaders() {
+	// thread-safe initialization, the loaders themselves are stateless
+	static const std::vector<Loader::ImageLoader*> registry = [] {
+		std::vector<Loader::ImageLoader*> l;
+#ifdef FREEIMAGE_LIB
+		// the shared library initializes its plugins when it is loaded
+		FreeImage_Initialise();
+#endif // FREEIMAGE_LIB
+#ifdef OPENEXR_ENABLED
+		// needs to come first, FreeImage would collapse the channels to rgb(a)
+		l.push_back(new Loader::ExrLoader());
+#endif // OPENEXR_ENABLED
+		// flow stored as png/pfm would otherwise be read as a regular image
+		l.push_back(flowLoader());
+		l.push_back(new Loader::FreeImageLoader());
+		return l;
+	}();
+	return registry;
 }
 
-void Utils::ImageData::registerLoaders() {
-	_loaders.push_back(new Loader::FreeImageLoader());
-	_loaders.push_back(new Loader::OpticalFlowLoader());
+Utils::Loader::OpticalFlowLoader* Utils::ImageData::flowLoader() {
+	static Loader::OpticalFlowLoader* loader = new Loader::OpticalFlowLoader();
+	return loader;
 }
 
-Utils::ImageData::ImageData(Utils::ImageData *img) {
+Utils::ImageData::ImageData(const Utils::ImageData *img, int tileSize)
+	: _tile_size(tileSize), _plane_loader(nullptr), _flow_radius(0), _owned(true) {
 	_height = img->height();
 	_width = img->width();
 	_channels = img->channels();
-	_raw_buf = new float[img->elements()];
-	memcpy( _raw_buf, img->data(), sizeof(float) * img->elements() );
+	_max_value = img->max();
+	// display buffers of gigapixel images are paged by the OS
+	_raw_buf = TileStore::allocate(img->elements(), TileStore::outOfCore(img->elements() * sizeof(float)));
+	if (_tile_size == img->tileSize()) {
+		memcpy( _raw_buf, img->data(), sizeof(float) * img->elements() );
+		return;
+	}
+	CHECK_EQ(img->tileSize(), 0) << "cannot retile a tiled image";
+
+	// gather each tile from the planes, tiles are written in one go
+	const int T = _tile_size;
+	const int gridH = (_height + T - 1) / T;
+	const int gridW = (_width + T - 1) / T;
+	const size_t plane = area();
+	const float* src = img->data();
+	#pragma omp parallel for schedule(dynamic)
+	for (int n = 0; n < gridH * gridW; ++n) {
+		const int minH = (n / gridW) * T;
+		const int minW = (n % gridW) * T;
+		const int rows = std::min(T, _height - minH);
+		const int cols = std::min(T, _width - minW);
+		float* d = _raw_buf + offset(minH, minW, 0);
+		for (int h = 0; h < rows; ++h)
+			for (int c = 0; c < _channels; ++c) {
+				const float* s = src + c * plane + (size_t)(minH + h) * _width + minW;
+				float* t = d + (size_t)h * cols * _channels + c;
+				for (int w = 0; w < cols; ++w)
+					t[(size_t)w * _channels] = s[w];
+			}
+	}
 }
 
 void Utils::ImageData::write(std::string filename) const {
 	write(filename, 0, 0, _height, _width);
 }
 
-void Utils::ImageData::writerFinished() {
-	QObject * sender = QObject::sender();
-	if (sender) {
-		threads::ImageWriterThread * t = dynamic_cast<threads::ImageWriterThread*>(sender);
-		if ( ! t->isFinished()) {
-			DLOG(INFO) << "found running thread";
-			t->wait();
-		}
-		delete t;
-	}
-}
-
 void Utils::ImageData::write(std::string filename, int t, int l, int b, int r) const {
+	int height, width;
+	float *tmp_buf = crop(t, l, b, r, &height, &width);
+	WriterPool::instance()->enqueue(tmp_buf, height, width, _channels, filename);
+}
 
-	threads::ImageWriterThread *writer = new threads::ImageWriterThread();
-	float *tmp_buf = new float[elements()];
-	memcpy( tmp_buf, _raw_buf, sizeof(float) * elements() );
-	if (writer->notify(tmp_buf, t, l, b, r, _height, _width, _channels, filename)) {
-		connect( writer, SIGNAL( finished() ), this, SLOT( writerFinished() ));
-		writer->start();
+float* Utils::ImageData::crop(int t, int l, int b, int r, int *height, int *width) const {
+	if (_tile_size == 0)
+		return ImageWriter::crop(_raw_buf, _height, _width, _channels,
+		                         t, l, b, r, height, width);
+	t = std::max(t, 0);
+	l = std::max(l, 0);
+	b = std::min(b, _height);
+	r = std::min(r, _width);
+	*height = std::max(b - t, 0);
+	*width = std::max(r - l, 0);
+
+	const size_t crop_area = (size_t)(*height) * (*width);
+	float* dst = new float[crop_area * _channels];
+	#pragma omp parallel for
+	for (int n = 0; n < _channels * (*height); ++n) {
+		const int c = n / (*height);
+		const int h = n % (*height);
+		float* d = dst + c * crop_area + (size_t)h * (*width);
+		for (int w = 0; w < *width; ++w)
+			d[w] = _raw_buf[offset(h + t, w + l, c)];
 	}
-
+	return dst;
 }
-Utils::ImageData::ImageData(std::string filename) {
+Utils::ImageData::ImageData(std::string filename)
+	: _filename(filename), _raw_buf(nullptr), _height(0), _width(0), _channels(0),
+	  _max_value(0), _tile_size(0), _plane_loader(nullptr), _flow_radius(0), _owned(true) {
 	DLOG(INFO) << "Utils::ImageData::ImageData " << filename;
-	registerLoaders();
 
 	int l_id = 0;
-	for (auto && loader : _loaders) {
+	for (auto && loader : loaders()) {
 		if (loader->canLoad(filename)) {
 			DLOG(INFO) << "loader " << l_id << " can load " << filename;
-			_raw_buf = loader->load(filename, &_height, &_width, &_channels, &_max_value);
+			if (loader->canLoadChannels(filename)) {
+				// decode only what is displayed
+				_plane_loader = loader;
+				_channel_names = loader->channelNames(filename, &_height, &_width, &_max_value);
+				if (!_channel_names.empty())
+					selectChannels(Loader::ImageLoader::defaultChannels(_channel_names));
+			} else if (loader == flowLoader()) {
+				// keep the raw flow to allow another radius later on
+				auto flow = std::make_shared<Loader::OpticalFlowLoader::flow_t>();
+				if (flowLoader()->decode(filename, flow.get())) {
+					_flow = flow;
+					_height = flow->height;
+					_width = flow->width;
+					_channels = 3;
+					_max_value = 255;
+					_raw_buf = TileStore::allocate(elements(), TileStore::outOfCore(elements() * sizeof(float)));
+					setFlowRadius(Loader::OpticalFlowLoader::initialRadius(*flow));
+				}
+			} else {
+				_raw_buf = loader->load(filename, &_height, &_width, &_channels, &_max_value);
+			}
+			// corrupt files leave data() empty, the caller decides what to do
+			if (_raw_buf == nullptr) {
+				LOG(WARNING) << "cannot decode " << filename;
+				_height = 0;
+				_width = 0;
+				_channels = 0;
+			}
 			break;
 		} else {
 			DLOG(INFO) << "loader " << l_id << " cannot load " << filename;
@@ -166,25 +187,121 @@ Utils::ImageData::ImageData(std::string filename) {
 	// _raw_buf = _loaders[0]->load(filename, &_height, &_width, &_channels, &_max_value);
 }
 
+Utils::ImageData::ImageData(std::string filename, DiskCache::Entry_ptr entry)
+	: _filename(filename), _tile_size(0), _plane_loader(nullptr), _flow_radius(0), _owned(false),
+	  _entry(entry) {
+	DLOG(INFO) << "Utils::ImageData::ImageData (cached) " << filename;
+	const DiskCache::header_t *hdr = entry->header();
+	// the mapping is private, hence the buffer is never written back
+	_raw_buf = const_cast<float*>(entry->image());
+	_height = hdr->height;
+	_width = hdr->width;
+	_channels = hdr->channels;
+	_max_value = hdr->max_value;
+}
+
 // pixel value accessors
 float Utils::ImageData::operator()(int h, int w, int c) const {
 	return value(h, w, c);
 }
 float Utils::ImageData::value(int h, int w, int c) const {
-	return _raw_buf[c * (_height * _width) + h * _width + w];
+	return _raw_buf[offset(h, w, c)];
+}
+
+float Utils::ImageData::value(size_t t, int c) const {
+	if (_tile_size == 0)
+		return _raw_buf[c * area() + t];
+	return value(t / _width, t % _width, c);
 }
 
-float Utils::ImageData::value(int t, int c) const {
-	return _raw_buf[c * (_height * _width) + t];
+size_t Utils::ImageData::offset(int h, int w, int c) const {
+	if (_tile_size == 0)
+		return c * area() + (size_t)h * _width + w;
+	// tiles before the grid row of (h, w) span whole rows of the image
+	const int T = _tile_size;
+	const int minH = h - h % T;
+	const int minW = w - w % T;
+	const size_t rows = std::min(T, _height - minH);
+	const size_t cols = std::min(T, _width - minW);
+	return ((size_t)minH * _width + minW * rows + (h - minH) * cols + (w - minW)) * _channels + c;
 }
 
 
 float* Utils::ImageData::data() const {return _raw_buf;}
-size_t Utils::ImageData::elements() const {return _height * _width * _channels;}
+size_t Utils::ImageData::elements() const {return area() * _channels;}
 int Utils::ImageData::width() const {return _width;}
 int Utils::ImageData::height() const {return _height;}
 int Utils::ImageData::channels() const {return _channels;}
-int Utils::ImageData::area() const {return _height * _width;}
+int Utils::ImageData::tileSize() const {return _tile_size;}
+int Utils::ImageData::sourceChannels() const {
+	return (_plane_loader == nullptr) ? _channels : _channel_names.size();
+}
+
+std::string Utils::ImageData::channelName(int c) const {
+	if (_plane_loader == nullptr) {
+		const char* rgb[] = {"R", "G", "B"};
+		return (_channels == 3) ? rgb[c] : "Y";
+	}
+	return _channel_names[c];
+}
+
+std::vector<int> Utils::ImageData::selectedChannels() const {
+	if (_plane_loader == nullptr) {
+		std::vector<int> ids;
+		for (int c = 0; c < _channels; ++c)
+			ids.push_back(c);
+		return ids;
+	}
+	return _selected_channels;
+}
+
+void Utils::ImageData::selectChannels(std::vector<int> ids) {
+	CHECK(_plane_loader != nullptr) << "image has no separately decodable channels";
+	CHECK(ids.size() >= 1 && ids.size() <= 3) << "select 1 to 3 channels";
+	for (auto && id : ids)
+		CHECK(0 <= id && id < sourceChannels()) << "unknown channel " << id;
+
+	const int channels = (ids.size() == 1) ? 1 : 3;
+	const size_t plane_size = area();
+
+	// planes are decoded right into the buffer, displayed ones are reused
+	float* buf = TileStore::allocate(channels * plane_size,
+	                                 TileStore::outOfCore(channels * plane_size * sizeof(float)));
+	for (int c = 0; c < channels; ++c) {
+		float* dst = buf + c * plane_size;
+		if (c >= (int) ids.size()) {
+			memset(dst, 0, sizeof(float) * plane_size);
+			continue;
+		}
+		auto shown = std::find(_selected_channels.begin(), _selected_channels.end(), ids[c]);
+		if (_raw_buf != nullptr && shown != _selected_channels.end()) {
+			memcpy(dst, _raw_buf + (shown - _selected_channels.begin()) * plane_size,
+			       sizeof(float) * plane_size);
+			continue;
+		}
+		if (!_plane_loader->loadChannel(_filename, _channel_names[ids[c]], dst)) {
+			LOG(WARNING) << "keep the previous channels, cannot decode " << _channel_names[ids[c]];
+			TileStore::release(buf);
+			return;
+		}
+	}
+
+	_selected_channels = ids;
+	TileStore::release(_raw_buf);
+	_raw_buf = buf;
+	_channels = channels;
+}
+
+bool Utils::ImageData::isFlow() const {return _flow != nullptr;}
+float Utils::ImageData::flowRadius() const {return _flow_radius;}
+
+void Utils::ImageData::setFlowRadius(float radius) {
+	CHECK(_flow != nullptr) << "image is no optical flow";
+	DLOG(INFO) << "max radius " << _flow->max_rad << " normalized by " << radius;
+	_flow_radius = radius;
+	flowLoader()->colorize(*_flow, radius, _raw_buf);
+}
+size_t Utils::ImageData::area() const {return (size_t)_height * _width;}
 float Utils::ImageData::max() const {return _max_value;}
 
 std::string Utils::ImageData::colorString(int h, int w, bool formated) const {
@@ -231,12 +348,13 @@ std::string Utils::ImageData::colorString(int h, int w, bool formated) const {
 }
 
 
-void Utils::ImageData::clear(bool remove) {
+void Utils::ImageData::clear() {
 	DLOG(INFO) << "Utils::ImageData::clear";
-	// the _buf_data is already delete (so dont do it here again)
-	if (remove)
-		if (_raw_buf != nullptr)
-			delete[] _raw_buf;
+	if (_raw_buf != nullptr && _owned)
+		TileStore::release(_raw_buf);
+	_raw_buf = nullptr;
+	_entry.reset();
+	_flow.reset();
 	_height = 0;
 	_width = 0;
 	_channels = 0;
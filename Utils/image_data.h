@@ -7,68 +7,73 @@
 #include <vector>
 #include <QObject>
 #include <QThread>
+#include "disk_cache.h"
+#include "Imageloader/opticalflow_loader.h"
 
 namespace Utils {
-namespace Loader {
-class ImageLoader;
-}; // namespace Loader
-
 namespace Ops {
 class ImgOp;
 }
 
-namespace threads {
-/**
- * @brief Write given image to disk.
- */
-class ImageWriterThread : public QThread {
- public:
-  ImageWriterThread();
-  /**
-   * @brief setup all parameters when dumping image to disk
-   * @details [long description]
-   *
-   * @param copied_buffer [description]
-   * @param top top margin
-   * @param left left margin
-   * @param bottom bottom margin
-   * @param right right margin
-   * @param height original image height
-   * @param width original image width
-   * @param channels original image channels
-   * @param fn target filename
-   * @return [description]
-   */
-  bool notify( float* copied_buffer,
-               int top, int left, int bottom, int rright,
-               int height, int width, int channels,
-               std::string fn);
-  void run();
- private:
-  float* _buffer;
-  int _top, _left, _bottom, _right, _height, _width, _channels;
-  std::string _fn;
-  bool _running;
-};
-}
-
 class ImageData : QObject {
 
   Q_OBJECT
 
  public:
+  /**
+   * @brief decode an image file
+   * @details data() is nullptr if no loader can decode the file
+   */
   ImageData(std::string filename);
+  /**
+   * @brief image decoded in a previous session
+   * @details the buffer is mapped from the cache entry, nothing is decoded
+   */
+  ImageData(std::string filename, DiskCache::Entry_ptr entry);
+  /**
+   * @brief image of a planar buffer which stays owned by the caller
+   */
   ImageData(float*d, int h, int w, int c);
-  ImageData(ImageData* i);
+  /**
+   * @brief copy of an image
+   *
+   * @param tileSize store the copy natively tiled (see tileSize), 0 keeps
+   *                 the planar layout
+   */
+  ImageData(const ImageData* i, int tileSize = 0);
+  /**
+   * @brief releases the buffer unless it is adopted or mapped (see clear)
+   */
   ~ImageData();
 
   /**
    * @brief pointer to raw float array
-   * @details memory layout is [C,H,W] meaning [c*H*W + h*W + w]
+   * @details memory layout is [C,H,W] meaning [c*H*W + h*W + w] unless the
+   *          image is tiled, use offset() to be independent of the layout
    * @return [description]
    */
   float* data() const;
 
+  /**
+   * @brief edge length of the tiles, 0 for planar images
+   * @details Tiled images store square tiles in row-major grid order, each
+   *          interleaved [h,w,C] and as large as it fits into the image.
+   *          This equals the layout of a pyramid level, thus level 0 uses
+   *          the buffer without copying.
+   */
+  int tileSize() const;
+
+  /**
+   * @brief index of a value in data()
+   */
+  size_t offset(int h, int w, int c) const;
+
+  /**
+   * @brief planar [C,H,W] copy of the rows [t, b) and columns [l, r)
+   * @details clipped to the image, the caller deletes the buffer
+   */
+  float* crop(int t, int l, int b, int r, int *height, int *width) const;
+
   /**
    * @brief number of total values (all channels)
    * @details [long description]
@@ -92,20 +97,69 @@ class ImageData : QObject {
    * @details [long description]
    * @return [description]
    */
-  int area() const;
+  size_t area() const;
 
   /**
    * @brief channels of image
-   * @details only 3 or 4 is supported
+   * @details number of displayed channels (1 or 3), see selectChannels
    * @return [description]
    */
   int channels() const;
-  void clear(bool remove = true);
+
+  /**
+   * @brief number of channels stored in the file
+   * @details might be much larger than channels() for files with AOVs
+   * @return [description]
+   */
+  int sourceChannels() const;
+  /**
+   * @brief name of a channel stored in the file
+   */
+  std::string channelName(int c) const;
+  /**
+   * @brief ids of the source channels which are currently displayed
+   */
+  std::vector<int> selectedChannels() const;
+  /**
+   * @brief choose which source channels are displayed
+   * @details Only the selected planes are held. Those which are displayed
+   *          already are reused, the others are decoded from the file right
+   *          into the new buffer. Two channels are padded by an empty third
+   *          one, as OpenGL textures are either gray or rgb. The selection
+   *          is kept if one of the planes cannot be decoded.
+   *
+   * @param ids 1 to 3 source channel ids
+   */
+  void selectChannels(std::vector<int> ids);
+
+  /**
+   * @brief image is a colored optical flow field
+   * @details the raw flow is kept, such that the radius can be changed
+   */
+  bool isFlow() const;
+  /**
+   * @brief radius mapped to full saturation, 0 if the image is no flow
+   */
+  float flowRadius() const;
+  /**
+   * @brief color the kept flow field again
+   * @details the buffer is overwritten in place, starts with --flow_max_radius
+   *          or the largest radius of the file
+   *
+   * @param radius radius mapped to full saturation
+   */
+  void setFlowRadius(float radius);
+  /**
+   * @brief release the buffer
+   * @details buffers passed by the caller and disk cache mappings are not
+   *          released, but the image does not refer to them anymore
+   */
+  void clear();
 
   float max() const;
 
   float value(int h, int w, int c) const;
-  float value(int t, int c) const;
+  float value(size_t t, int c) const;
 
   std::string colorString(int h, int w, bool formated = true) const;
 
@@ -114,18 +168,27 @@ class ImageData : QObject {
 
   static bool knownImageFormat(std::string filename);
 
+  /**
+   * @brief write image in background, format by file extension
+   * @details see ImageWriter, only the crop rows [t, b) and columns [l, r)
+   *          are copied before the job is queued in the WriterPool
+   */
   void write(std::string filename) const;
   void write(std::string filename, int t, int l, int b, int r) const;
 
- public slots:
-  void writerFinished();
-
  private:
   /**
-   * @brief register all possible loaders from "Imageloader/"
+   * @brief all possible loaders from "Imageloader/"
+   * @details created once on first use, not at startup
+   */
+  static const std::vector<Loader::ImageLoader*>& loaders();
+  /**
+   * @brief the flow loader of the registry, which is used directly to keep
+   *        the raw flow
    */
-  void registerLoaders();
+  static Loader::OpticalFlowLoader* flowLoader();
   void buildScale();
+
   std::string _filename;
   // typedef std::unique_ptr<FIBITMAP, decltype(&FreeImage_Unload)> FIBitmapPtr;
   typedef FIBITMAP* FIBitmapPtr;
@@ -136,8 +199,22 @@ class ImageData : QObject {
   int _width;
   int _channels;
   float _max_value;
+  int _tile_size;
+
+  // loader able to decode single channels (nullptr if file is loaded at once)
+  Loader::ImageLoader* _plane_loader;
+  std::vector<std::string> _channel_names;
+  std::vector<int> _selected_channels;
+
+  // raw flow field if the image is colored flow (nullptr otherwise)
+  std::shared_ptr<const Loader::OpticalFlowLoader::flow_t> _flow;
+  float _flow_radius;
+
+  // _raw_buf was allocated by this image (loader or copy)
+  bool _owned;
 
-  std::vector<Loader::ImageLoader*> _loaders;
+  // owner of _raw_buf if the image comes from the disk cache
+  DiskCache::Entry_ptr _entry;
 
 };
 
@@ -0,0 +1,408 @@
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include <FreeImage.h>
+#include <glog/logging.h>
+#include <gflags/gflags.h>
+
+#include "image_writer.h"
+
+DEFINE_int32(writer_threads, 0,
+             "threads encoding exported images (0: one per core)");
+DEFINE_string(export_speed, "default",
+              "png compression of exported images: fastest, fast, default, small");
+
+namespace {
+int pngFlags() {
+  if (FLAGS_export_speed == "fastest")
+    return PNG_Z_NO_COMPRESSION;
+  if (FLAGS_export_speed == "fast")
+    return PNG_Z_BEST_SPEED;
+  if (FLAGS_export_speed == "small")
+    return PNG_Z_BEST_COMPRESSION;
+  LOG_IF(WARNING, FLAGS_export_speed != "default") << "unknown --export_speed " << FLAGS_export_speed;
+  return PNG_DEFAULT;
+}
+
+/**
+ * @brief QOI stream of a strip of rows, see https://qoiformat.org
+ * @details Each strip starts with a full RGBA pixel and only refers to
+ *          index entries set within the strip. Hence, strips can be encoded
+ *          independently and their concatenation is a valid QOI stream.
+ *          Rows are quantized one at a time into packed RGBA words, the
+ *          image is read once.
+ *
+ * @param planes 4 planes [H,W] (RGBA) in [0, 1], no alpha plane is opaque
+ * @param top first row of strip
+ * @param bottom row after strip
+ * @param size length of the stream (output)
+ */
+std::unique_ptr<uint8_t[]> qoiStrip(const float* const* planes, int width,
+                                    int top, int bottom, size_t* size) {
+  uint32_t index[64];
+  bool valid[64] = {false};
+  // worst case: one RGBA chunk per pixel, uninitialized
+  std::unique_ptr<uint8_t[]> out(new uint8_t[5 * (size_t)(bottom - top) * width]);
+  uint8_t* dst = out.get();
+  std::vector<uint32_t> row(width);
+
+  uint32_t prev = 0xff000000;
+  int run = 0;
+  for (int y = top; y < bottom; ++y) {
+    const size_t offset = (size_t)y * width;
+    const float *r = planes[0] + offset, *g = planes[1] + offset, *b = planes[2] + offset;
+    const float *a = planes[3] ? planes[3] + offset : nullptr;
+    int x = 0;
+#ifdef __SSE2__
+    // as Utils::ImageWriter::quantize, max returns 0 for NaN
+    auto q4 = [](const float* p) {
+      const __m128 v = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(p), _mm_setzero_ps()), _mm_set1_ps(1.f));
+      return _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(v, _mm_set1_ps(255.f)), _mm_set1_ps(0.5f)));
+    };
+    for (; x + 4 <= width; x += 4) {
+      const __m128i alpha = a ? _mm_slli_epi32(q4(a + x), 24) : _mm_set1_epi32((int)0xff000000);
+      const __m128i px = _mm_or_si128(_mm_or_si128(q4(r + x), _mm_slli_epi32(q4(g + x), 8)),
+                                      _mm_or_si128(_mm_slli_epi32(q4(b + x), 16), alpha));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(row.data() + x), px);
+    }
+#endif  // __SSE2__
+    auto q = [](float v) {
+      return static_cast<uint32_t>(std::min(1.f, std::max(0.f, v)) * 255.f + 0.5f);
+    };
+    for (; x < width; ++x)
+      row[x] = q(r[x]) | q(g[x]) << 8 | q(b[x]) << 16 | (a ? q(a[x]) : 255) << 24;
+
+    for (x = 0; x < width; ++x) {
+      const uint32_t px = row[x];
+      const bool first = (y == top && x == 0);
+      if (px == prev && !first) {
+        if (++run == 62) {
+          *dst++ = 0xc0 | (run - 1);
+          run = 0;
+        }
+        continue;
+      }
+      if (run > 0) {
+        *dst++ = 0xc0 | (run - 1);
+        run = 0;
+      }
+
+      const uint8_t pr = px, pg = px >> 8, pb = px >> 16, pa = px >> 24;
+      const int h = (pr * 3 + pg * 5 + pb * 7 + pa * 11) % 64;
+      if (valid[h] && index[h] == px) {
+        *dst++ = h;
+      } else {
+        index[h] = px;
+        valid[h] = true;
+        const int8_t dr = pr - uint8_t(prev);
+        const int8_t dg = pg - uint8_t(prev >> 8);
+        const int8_t db = pb - uint8_t(prev >> 16);
+        const int8_t dr_dg = dr - dg;
+        const int8_t db_dg = db - dg;
+        if (first || pa != (prev >> 24)) {
+          // the decoder state before the strip is unknown
+          *dst++ = 0xff;
+          *dst++ = pr;
+          *dst++ = pg;
+          *dst++ = pb;
+          *dst++ = pa;
+        } else if (dr > -3 && dr < 2 && dg > -3 && dg < 2 && db > -3 && db < 2) {
+          *dst++ = 0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2);
+        } else if (dr_dg > -9 && dr_dg < 8 && dg > -33 && dg < 32 && db_dg > -9 && db_dg < 8) {
+          *dst++ = 0x80 | (dg + 32);
+          *dst++ = (dr_dg + 8) << 4 | (db_dg + 8);
+        } else {
+          *dst++ = 0xfe;
+          *dst++ = pr;
+          *dst++ = pg;
+          *dst++ = pb;
+        }
+      }
+      prev = px;
+    }
+  }
+  if (run > 0)
+    *dst++ = 0xc0 | (run - 1);
+  *size = dst - out.get();
+  return out;
+}
+
+bool writeQoi(std::string fn, const float* const* planes,
+              int height, int width, int channels) {
+  // strips of at least 64 rows, the rows of large images form about 64 strips
+  const int strip_rows = std::max(64, (height + 63) / 64);
+  const int strips = (height + strip_rows - 1) / strip_rows;
+  std::vector<std::unique_ptr<uint8_t[]>> streams(strips);
+  std::vector<size_t> sizes(strips);
+
+  #pragma omp parallel for schedule(dynamic)
+  for (int s = 0; s < strips; ++s)
+    streams[s] = qoiStrip(planes, width, s * strip_rows,
+                          std::min((s + 1) * strip_rows, height), &sizes[s]);
+
+  std::ofstream file(fn, std::ios::binary);
+  if (!file)
+    return false;
+  const uint8_t header[14] = {'q', 'o', 'i', 'f',
+                              uint8_t(width >> 24), uint8_t(width >> 16), uint8_t(width >> 8), uint8_t(width),
+                              uint8_t(height >> 24), uint8_t(height >> 16), uint8_t(height >> 8), uint8_t(height),
+                              uint8_t(channels), 0
+                             };
+  file.write(reinterpret_cast<const char*>(header), sizeof(header));
+  for (int s = 0; s < strips; ++s)
+    file.write(reinterpret_cast<const char*>(streams[s].get()), sizes[s]);
+  const uint8_t padding[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+  file.write(reinterpret_cast<const char*>(padding), sizeof(padding));
+  return bool(file);
+}
+
+std::string extension(std::string fn) {
+  const size_t dot = fn.find_last_of('.');
+  if (dot == std::string::npos)
+    return "";
+  std::string ext = fn.substr(dot + 1);
+  std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+  return ext;
+}
+
+/**
+ * @brief interleave planes into the scanlines of a bitmap
+ * @details FreeImage stores the rows bottom-up
+ *
+ * @param planes one plane [H,W] per written channel
+ * @param position index of each channel within a pixel
+ */
+template<typename T>
+void fill(FIBITMAP *bmp, const std::vector<const T*> &planes,
+          int height, int width, const int* position) {
+  const int channels = planes.size();
+  #pragma omp parallel for
+  for (int h = 0; h < height; ++h) {
+    T* line = reinterpret_cast<T*>(FreeImage_GetScanLine(bmp, height - 1 - h));
+    for (int c = 0; c < channels; ++c) {
+      const T* src = planes[c] + (size_t)h * width;
+      const int pos = position[c];
+      for (int w = 0; w < width; ++w)
+        line[w * channels + pos] = src[w];
+    }
+  }
+}
+}; // anonymous namespace
+
+template<typename T>
+void Utils::ImageWriter::quantize(const float* src, T* dst, size_t n, float scale) {
+  // max(0, NaN) is 0
+  #pragma omp parallel for simd
+  for (size_t i = 0; i < n; ++i) {
+    const float v = std::min(1.f, std::max(0.f, src[i]));
+    dst[i] = static_cast<T>(v * scale + 0.5f);
+  }
+}
+template void Utils::ImageWriter::quantize<uint8_t>(const float*, uint8_t*, size_t, float);
+template void Utils::ImageWriter::quantize<uint16_t>(const float*, uint16_t*, size_t, float);
+
+Utils::ImageWriter::Format Utils::ImageWriter::format(std::string fn) {
+  const std::string ext = extension(fn);
+  if (ext == "tif" || ext == "tiff")
+    return Format::TIFF16;
+  if (ext == "exr")
+    return Format::EXR;
+  if (ext == "pfm")
+    return Format::PFM;
+  if (ext == "qoi")
+    return Format::QOI;
+  return Format::PNG;
+}
+
+bool Utils::ImageWriter::lossless(Format f) {
+  return f == Format::EXR || f == Format::PFM;
+}
+
+float* Utils::ImageWriter::crop(const float* src,
+                                int src_height, int src_width, int channels,
+                                int top, int left, int bottom, int right,
+                                int *height, int *width) {
+  top = std::max(top, 0);
+  left = std::max(left, 0);
+  bottom = std::min(bottom, src_height);
+  right = std::min(right, src_width);
+  *height = std::max(bottom - top, 0);
+  *width = std::max(right - left, 0);
+
+  const size_t src_area = (size_t)src_height * src_width;
+  const size_t area = (size_t)(*height) * (*width);
+  float* dst = new float[area * channels];
+
+  #pragma omp parallel for
+  for (int n = 0; n < channels * (*height); ++n) {
+    const int c = n / (*height);
+    const int h = n % (*height);
+    memcpy(dst + c * area + (size_t)h * (*width),
+           src + c * src_area + (size_t)(h + top) * src_width + left,
+           sizeof(float) * (*width));
+  }
+  return dst;
+}
+
+float* Utils::ImageWriter::fromInterleaved(const uint8_t* src,
+    int height, int width, int channels,
+    size_t stride) {
+  const size_t area = (size_t)height * width;
+  float* dst = new float[area * channels];
+  #pragma omp parallel for
+  for (int h = 0; h < height; ++h) {
+    const uint8_t* line = src + h * stride;
+    for (int c = 0; c < channels; ++c) {
+      float* plane = dst + c * area + (size_t)h * width;
+      for (int w = 0; w < width; ++w)
+        plane[w] = line[w * channels + c] / 255.f;
+    }
+  }
+  return dst;
+}
+
+bool Utils::ImageWriter::write(std::string fn, const float* data,
+                               int height, int width, int channels) {
+  const Format f = format(fn);
+  const size_t area = (size_t)height * width;
+
+  int out_channels = 3;
+  if (channels == 1)
+    out_channels = 1;
+  else if (channels >= 4 && f != Format::PFM)
+    out_channels = 4;
+
+  // missing channels (2-channel images) are written as zeros
+  std::vector<float> zeros;
+  std::vector<const float*> planes;
+  for (int c = 0; c < out_channels; ++c) {
+    if (c < channels) {
+      planes.push_back(data + c * area);
+    } else {
+      zeros.resize(area, 0.f);
+      planes.push_back(zeros.data());
+    }
+  }
+
+  const int rgba[4] = {FI_RGBA_RED, FI_RGBA_GREEN, FI_RGBA_BLUE, FI_RGBA_ALPHA};
+  const int ordered[4] = {0, 1, 2, 3};
+
+  FIBITMAP *bmp = nullptr;
+  FREE_IMAGE_FORMAT fif = FIF_PNG;
+  int flags = 0;
+
+  if (f == Format::QOI) {
+    // QOI knows RGB and RGBA only, gray is replicated
+    const float* qplanes[4];
+    for (int c = 0; c < 3; ++c)
+      qplanes[c] = planes[std::min(c, out_channels - 1)];
+    qplanes[3] = (out_channels == 4) ? planes[3] : nullptr;
+    const bool ok = writeQoi(fn, qplanes, height, width, (out_channels == 4) ? 4 : 3);
+    LOG_IF(ERROR, !ok) << "cannot write " << fn;
+    return ok;
+  } else if (f == Format::PNG) {
+    // 8 bit are stored as BGR(A) on little-endian machines
+    std::vector<uint8_t> q(area * out_channels);
+    std::vector<const uint8_t*> qplanes;
+    for (int c = 0; c < out_channels; ++c) {
+      quantize(planes[c], q.data() + c * area, area, 255.f);
+      qplanes.push_back(q.data() + c * area);
+    }
+    bmp = FreeImage_Allocate(width, height, 8 * out_channels);
+    fill(bmp, qplanes, height, width, (out_channels == 1) ? ordered : rgba);
+    fif = FIF_PNG;
+    flags = pngFlags();
+  } else if (f == Format::TIFF16) {
+    std::vector<uint16_t> q(area * out_channels);
+    std::vector<const uint16_t*> qplanes;
+    for (int c = 0; c < out_channels; ++c) {
+      quantize(planes[c], q.data() + c * area, area, 65535.f);
+      qplanes.push_back(q.data() + c * area);
+    }
+    const FREE_IMAGE_TYPE types[5] = {FIT_UNKNOWN, FIT_UINT16, FIT_UNKNOWN, FIT_RGB16, FIT_RGBA16};
+    bmp = FreeImage_AllocateT(types[out_channels], width, height);
+    fill(bmp, qplanes, height, width, ordered);
+    fif = FIF_TIFF;
+  } else {
+    const FREE_IMAGE_TYPE types[5] = {FIT_UNKNOWN, FIT_FLOAT, FIT_UNKNOWN, FIT_RGBF, FIT_RGBAF};
+    bmp = FreeImage_AllocateT(types[out_channels], width, height);
+    fill(bmp, planes, height, width, ordered);
+    fif = (f == Format::EXR) ? FIF_EXR : FIF_PFM;
+    // FreeImage would store half floats otherwise
+    flags = (f == Format::EXR) ? EXR_FLOAT : 0;
+  }
+
+  if (bmp == nullptr) {
+    LOG(ERROR) << "cannot allocate " << width << "x" << height << "x" << out_channels << " image for " << fn;
+    return false;
+  }
+  const bool ok = FreeImage_Save(fif, bmp, fn.c_str(), flags);
+  FreeImage_Unload(bmp);
+  LOG_IF(ERROR, !ok) << "cannot write " << fn;
+  return ok;
+}
+
+// pool
+// ==========================================================================================
+Utils::WriterPool::WriterPool() : _total(0), _done(0), _failed(0) {
+  if (FLAGS_writer_threads > 0)
+    _pool.setMaxThreadCount(FLAGS_writer_threads);
+}
+
+Utils::WriterPool* Utils::WriterPool::instance() {
+  static WriterPool pool;
+  return &pool;
+}
+
+void Utils::WriterPool::enqueue(float* copied_buffer,
+                                int height, int width, int channels,
+                                std::string fn) {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _total++;
+  }
+  // the pool deletes the job after running it
+  _pool.start(new WriterJob(copied_buffer, height, width, channels, fn));
+}
+
+void Utils::WriterPool::wait() {
+  _pool.waitForDone();
+}
+
+void Utils::WriterPool::jobFinished(bool ok) {
+  int done, total, failed;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    done = ++_done;
+    total = _total;
+    if (!ok)
+      _failed++;
+    failed = _failed;
+    if (done == total)
+      _total = _done = _failed = 0;
+  }
+  emit sigProgress(done, total);
+  if (done == total)
+    emit sigFinished(failed);
+}
+
+Utils::WriterJob::WriterJob(float* copied_buffer,
+                            int height, int width, int channels,
+                            std::string fn)
+  : _buffer(copied_buffer), _height(height), _width(width),
+    _channels(channels), _fn(fn) {}
+
+void Utils::WriterJob::run() {
+  const bool ok = ImageWriter::write(_fn, _buffer, _height, _width, _channels);
+  delete[] _buffer;
+  WriterPool::instance()->jobFinished(ok);
+}
@@ -0,0 +1,141 @@
+#ifndef IMAGE_WRITER_H
+#define IMAGE_WRITER_H
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <QObject>
+#include <QRunnable>
+#include <QThreadPool>
+
+namespace Utils {
+
+/**
+ * @brief encode planar float images [C,H,W] to disk
+ * @details The format follows the file extension:
+ *          - *.png  8-bit (values in [0, 1]), compression by --export_speed
+ *          - *.qoi  8-bit (values in [0, 1]), fast lossless encoding of
+ *                   independent strips in parallel
+ *          - *.tif  16-bit (values in [0, 1])
+ *          - *.exr  32-bit float (values unchanged)
+ *          - *.pfm  32-bit float (values unchanged)
+ *          1, 3 and 4 (alpha) channels are supported, 2 channels are padded
+ *          by an empty blue channel. PFM has no alpha channel, it is dropped.
+ */
+class ImageWriter {
+ public:
+  enum class Format {PNG, TIFF16, EXR, PFM, QOI};
+
+  /**
+   * @brief format by file extension (PNG if unknown)
+   */
+  static Format format(std::string fn);
+
+  /**
+   * @brief format stores float values unchanged
+   * @details otherwise values are expected in [0, 1]
+   */
+  static bool lossless(Format f);
+
+  /**
+   * @brief copy of a crop of a planar image
+   * @details rows [top, bottom) and columns [left, right), clipped to the
+   *          image; only the crop is copied
+   *
+   * @param height of the crop (output)
+   * @param width of the crop (output)
+   * @return planar [C,height,width] buffer (owned by caller)
+   */
+  static float* crop(const float* src,
+                     int src_height, int src_width, int channels,
+                     int top, int left, int bottom, int right,
+                     int *height, int *width);
+
+  /**
+   * @brief planar copy of an interleaved 8-bit image, e.g. a screenshot
+   *
+   * @param stride bytes per row of src
+   * @return planar [C,height,width] buffer in [0, 1] (owned by caller)
+   */
+  static float* fromInterleaved(const uint8_t* src,
+                                int height, int width, int channels,
+                                size_t stride);
+
+  /**
+   * @brief write planar buffer
+   * @return file was written
+   */
+  static bool write(std::string fn, const float* data,
+                    int height, int width, int channels);
+
+  /**
+   * @brief clamp to [0, 1], scale and round to nearest (NaN -> 0)
+   */
+  template<typename T>
+  static void quantize(const float* src, T* dst, size_t n, float scale);
+};
+
+/**
+ * @brief fixed number of writer threads working off a queue
+ * @details The number of threads is given by --writer_threads. Progress is
+ *          counted over all jobs queued since the pool was idle the last time
+ *          and reported from the writer threads (use queued connections).
+ */
+class WriterPool : public QObject {
+  Q_OBJECT
+
+ public:
+  static WriterPool* instance();
+
+  /**
+   * @brief queue writing of a planar buffer
+   *
+   * @param copied_buffer planar buffer [C,H,W], the pool takes ownership
+   * @param fn target filename (format by extension)
+   */
+  void enqueue(float* copied_buffer,
+               int height, int width, int channels,
+               std::string fn);
+
+  /**
+   * @brief block until all queued jobs are written
+   */
+  void wait();
+
+ signals:
+  void sigProgress(int done, int total);
+  /**
+   * @brief all queued jobs are done
+   * @param failed number of files which could not be written
+   */
+  void sigFinished(int failed);
+
+ private:
+  WriterPool();
+  void jobFinished(bool ok);
+
+  QThreadPool _pool;
+  std::mutex _mutex;
+  int _total, _done, _failed;
+
+  friend class WriterJob;
+};
+
+/**
+ * @brief Write given image to disk.
+ */
+class WriterJob : public QRunnable {
+ public:
+  WriterJob(float* copied_buffer,
+            int height, int width, int channels,
+            std::string fn);
+  void run();
+ private:
+  float* _buffer;
+  int _height, _width, _channels;
+  std::string _fn;
+};
+
+}; // namespace Utils
+
+#endif // IMAGE_WRITER_H
@@ -1,42 +1,117 @@
+#include <algorithm>
+#include <atomic>
 #include <iostream>
 #include <math.h>
+#include <set>
+#include <utility>
+#include <vector>
+#include <QThreadPool>
+#include <QRunnable>
 #include <glog/logging.h>
+#include <gflags/gflags.h>
 #include "image_data.h"
 #include "mipmap.h"
 #include "mipmap_level.h"
+#include "mipmap_tile.h"
 #include "gl_manager.h"
+#include "tile_store.h"
+
+DEFINE_bool(drop_tile_data, true,
+            "free tiles of the two finest levels once uploaded, they are regenerated when evicted");
+
+namespace {
+// finest levels which hold most of the data, but are cheap to regenerate
+const int TRANSIENT_LEVELS = 2;
+
+/**
+ * @brief materialize a tile in the background
+ */
+class TileJob : public QRunnable {
+ public:
+  TileJob(std::shared_ptr<Utils::Mipmap::jobs_t> jobs, int level, uint h, uint w)
+    : _jobs(jobs), _level(level), _h(h), _w(w) {}
+  void run() {
+    {
+      std::lock_guard<std::mutex> lock(_jobs->mutex);
+      // the pyramid is gone already
+      if (_jobs->cancelled)
+        return;
+      _jobs->running++;
+    }
+    _jobs->mipmap->_levels[_level]->materialize(_h, _w, &_jobs->cancelled);
+    std::lock_guard<std::mutex> lock(_jobs->mutex);
+    _jobs->running--;
+    _jobs->idle.notify_all();
+  }
+ private:
+  std::shared_ptr<Utils::Mipmap::jobs_t> _jobs;
+  int _level;
+  uint _h, _w;
+};
+
+// shared by all pyramids, such that tiles of the current view come first
+QThreadPool& tilePool() {
+  static QThreadPool pool;
+  return pool;
+}
+
+// visible tiles come before prefetched ones
+const int VISIBLE = 1;
+const int PREFETCH = 0;
+}; // anonymous namespace
 
 
 void Utils::Mipmap::clear() {
+  cancelJobs();
   _empty = true;
   for (auto && level : _levels) {
     level->clear();
     delete level;
   }
   _levels.clear();
+  _entry.reset();
+  _source.reset();
+  _built = 0;
 }
 bool Utils::Mipmap::empty() {
   return _empty;
 }
 
-Utils::Mipmap::~Mipmap() {}
-Utils::Mipmap::Mipmap() {
+Utils::Mipmap::~Mipmap() {
+  // tiles and their textures would leak otherwise
+  clear();
+}
+Utils::Mipmap::Mipmap()
+  : _built(0), _pinned(false), _reduction(PyramidReduction::MEAN) {
   _empty = true;
+  cancelJobs();
   DLOG(INFO) << "Utils::Mipmap::Mipmap";
 
 }
 
-void Utils::Mipmap::setData(float *ptr,
-                            uint height, uint width, uint channels,
-                            uint tileSize) {
+void Utils::Mipmap::setPinned(bool pinned) {
+  _pinned = pinned;
+}
 
-  DLOG(INFO) << "Utils::Mipmap::set_image START";
+bool Utils::Mipmap::pinned() const {
+  return _pinned;
+}
 
+void Utils::Mipmap::setReduction(PyramidReduction reduction) {
+  _reduction = reduction;
+}
 
-  // unload old textures
+PyramidReduction Utils::Mipmap::reduction() const {
+  return _reduction;
+}
 
-  // get new dimensions
+int Utils::Mipmap::depth() const {
+  return _levels.size();
+}
 
+void Utils::Mipmap::initLevels(const float* ptr,
+                               uint height, uint width, uint channels,
+                               uint tileSize) {
   // find next greater power of 2, e.g. 512 -> 2**10
   // data should fit powers of 2**x
   uint depth = 1.0;
@@ -46,160 +121,170 @@ void Utils::Mipmap::setData(float *ptr,
     depth = 1.0 + log(height) / log(2.0);
   }
 
-  uint working_height = height;
-  uint working_width = width;
-  float *working_ptr = ptr;
-
-  MipmapLevel* level = new MipmapLevel();
-  _levels.push_back(level);
-  _levels[0]->setData(working_ptr,
-                      working_height, working_width, channels,
-                      tileSize);
-
-  DLOG(INFO) << "create level " << 0
-            << " " << working_height
-            << " " << working_width;
+  // gigapixel images keep their tiles in a memory-mapped scratch file
+  const bool scratch = TileStore::outOfCore((size_t)height * width * channels * sizeof(float));
+  DLOG_IF(INFO, scratch) << "out-of-core pyramid";
 
-  for (uint d = 1; d < depth; ++d) {
-
-    float* old_ptr = working_ptr;
-    working_ptr = downsample(old_ptr,
-                             &working_height, &working_width, channels);
-    if(d>1)
-      delete[] old_ptr;
-
-
-    DLOG(INFO) << "create level " << d
-              << " " << working_height
-              << " " << working_width;
+  // all tiles are virtual
+  for (uint d = 0; d < depth; ++d) {
     MipmapLevel* level = new MipmapLevel();
+    level->initGrid(height, width, channels, tileSize);
+    level->setSource(ptr, d > 0 ? _levels[d - 1] : nullptr, scratch);
+    level->setTransient(FLAGS_drop_tile_data && (int)d < TRANSIENT_LEVELS);
+    level->setReduction(_reduction);
     _levels.push_back(level);
-    _levels[d]->setData(working_ptr,
-                        working_height, working_width, channels,
-                        tileSize);
+    DLOG(INFO) << "create level " << d
+               << " " << height
+               << " " << width;
+    height = (height + 1) / 2;
+    width = (width + 1) / 2;
   }
-  delete [] working_ptr;
-
-
-  DLOG(INFO) << "Utils::Mipmap::set_image END";
-  _empty = false;
 }
 
-float* Utils::Mipmap::downsample(const float* ptr,
-                                 uint* ptr_height, uint* ptr_width, uint channels) const {
-
-  uint height = *ptr_height;
-  uint width = *ptr_width;
-
-  //Downsampling by using "space" aspect for each pixel
-  uint nwidth = width / 2;
-  uint nheight = height / 2;
-
-  // downsample the width
-  float* working_Data = new float[nwidth * height * channels ];
-  // downsample the height
-  float* d = new float[nwidth * nheight * channels ];
+void Utils::Mipmap::setData(float *ptr,
+                            uint height, uint width, uint channels,
+                            uint tileSize) {
 
-  // sampling factors
-  double widthRatio = (double)nwidth / (double)width;
-  double heightRatio = (double)nheight / (double)height;
+  DLOG(INFO) << "Utils::Mipmap::set_image START";
+  initLevels(ptr, height, width, channels, tileSize);
 
-  // ==============================================================
-  // downsample H,W,C --> H,W/2,C
-  // ==============================================================
+  // the caller might release ptr
+  MipmapLevel* level = _levels[0];
+  #pragma omp parallel for
+  for (uint n = 0; n < level->gridHeight() * level->gridWidth(); n++ )
+    level->materialize(n / level->gridWidth(), n % level->gridWidth());
+  level->setSource(nullptr, nullptr, false);
+  _built = 1;
 
-  for ( uint c = 0; c < channels; c++ ) {
-    // initialize to zero
-    for ( uint h = 0; h < height; h++ ) {
-      for ( uint w = 0; w < nwidth; w++ ) {
-        working_Data[(w + h * nwidth)*channels + c] = 0.0;
-      }
-    }
+  DLOG(INFO) << "Utils::Mipmap::set_image END";
+  _empty = false;
+}
 
-    // load pixel from bigger (original image) to halfsize image
-    for (uint h = 0; h < height; h++ ) {
-      for ( uint w = 0; w < width; w++ ) {
+void Utils::Mipmap::setData(std::shared_ptr<const ImageData> img,
+                            uint tileSize) {
+  _source = img;
+  if (img->tileSize() > 0)
+    tileSize = img->tileSize();
+  initLevels(img->data(), img->height(), img->width(), img->channels(), tileSize);
+  if (img->tileSize() > 0) {
+    // the tiled image is level 0 already
+    _levels[0]->setTiles(img->data(), img->height(), img->width(), img->channels(), tileSize);
+    _levels[0]->setSource(nullptr, nullptr, false);
+    // empty backgrounds and masks need no textures, coarser tiles inherit it
+    _levels[0]->detectUniform();
+    _built = 1;
+  }
+  _empty = false;
+}
 
-        // left and right pixel
-        uint b1 = int(w * widthRatio);
-        uint b2 = int((w + 1) * widthRatio);
+void Utils::Mipmap::buildLevels(int last, bool parallel) {
+  last = std::min(last, depth() - 1);
+  if (last < _built)
+    return;
+  std::lock_guard<std::mutex> lock(_build_mutex);
+  const int first = _built;
+  if (last < first)
+    return;
 
-        // double span = ((w + 1) * widthRatio) - (w * widthRatio);
-        if ( b1 == b2 ) {
-          // perfect match
-          working_Data[(b1 + h * nwidth)*channels + c] +=
-            widthRatio * ptr[(w + h * width) * channels + c];
+  /*
+  One task per tile which depends on the (up to) 2x2 tiles of the finer
+  level, expressed by one token per tile. Thus tiles of the next level are
+  reduced while the current level is still in progress. Tiles which are
+  materialized already are skipped. Prefilters also read neighbors of the
+  2x2 tiles, which are materialized within the task if necessary.
+  */
+  std::vector<size_t> first_tile(last + 2, 0);
+  for (int d = first; d <= last; ++d)
+    first_tile[d + 1] = first_tile[d] + (size_t)_levels[d]->gridHeight() * _levels[d]->gridWidth();
+  char* tiles = new char[first_tile[last + 1]];
+
+  #pragma omp parallel if(parallel)
+  #pragma omp single
+  for (int d = first; d <= last; ++d) {
+    MipmapLevel* level = _levels[d];
+    const uint gw = level->gridWidth();
+    for (uint h = 0; h < level->gridHeight(); ++h) {
+      for (uint w = 0; w < gw; ++w) {
+        const size_t tile = first_tile[d] + h * gw + w;
+        if (d == first) {
+          #pragma omp task depend(out: tiles[tile])
+          level->materialize(h, w);
         } else {
-          // get weight (linear interpolation)
-          double lFactor = (b2 - (w * widthRatio) ) / widthRatio;
-          double rFactor = 1.0 - lFactor;
-          if ( b1 < nwidth )
-            working_Data[(b1 + h * nwidth)*channels + c] +=
-              widthRatio * lFactor * ptr[(w + h * width) * channels + c];
-          if ( b2 < nwidth ) {
-            working_Data[(b2 + h * nwidth)*channels + c] +=
-              widthRatio * rFactor * ptr[(w + h * width) * channels + c];
-          }
+          // finer tiles of the same level, clipped to the grid
+          const uint fh = _levels[d - 1]->gridHeight(), fw = _levels[d - 1]->gridWidth();
+          const size_t row0 = first_tile[d - 1] + (size_t)std::min(2 * h, fh - 1) * fw;
+          const size_t row1 = first_tile[d - 1] + (size_t)std::min(2 * h + 1, fh - 1) * fw;
+          const uint col0 = std::min(2 * w, fw - 1);
+          const uint col1 = std::min(2 * w + 1, fw - 1);
+          #pragma omp task depend(in: tiles[row0 + col0], tiles[row0 + col1], \
+                                      tiles[row1 + col0], tiles[row1 + col1]) \
+                           depend(out: tiles[tile])
+          level->materialize(h, w);
         }
       }
     }
   }
+  delete[] tiles;
 
-  // ==============================================================
-  // downsample H,W/2,C -> H/2,W/2,C
-  // ==============================================================
+  _built = last + 1;
+  DLOG(INFO) << "built levels " << first << " - " << last;
+}
 
-  for ( uint c = 0; c < channels; c++ ) {
-    for ( uint h = 0; h < nheight; h++ ) {
-      for ( uint w = 0; w < nwidth; w++ ) {
-        d[(w + h * nwidth)*channels + c] = 0.0;
-      }
-    }
-    for ( uint w = 0; w < nwidth; w++ ) {
-      for (uint h = 0; h < height; h++ ) {
-        uint b1 = int(h * heightRatio);
-        uint b2 = int((h + 1) * heightRatio);
-        if ( b1 == b2 ) {
-          d[(w + b1 * nwidth)*channels + c] += heightRatio * working_Data[(w + h * nwidth) * channels + c];
-        } else {
-          double lFactor = (b2 - (h * heightRatio) ) / heightRatio;
-          double rFactor = 1.0 - lFactor;
-          if ( b1 < nheight )
-            d[(w + b1 * nwidth)*channels + c] += heightRatio * lFactor * working_Data[(w + h * nwidth) * channels + c];
-          if ( b2 < nheight ) {
-            d[(w + b2 * nwidth)*channels + c] += heightRatio * rFactor * working_Data[(w + h * nwidth) * channels + c];
-          }
-        }
-      }
-    }
+void Utils::Mipmap::requestTile(int level, uint h, uint w, int priority) {
+  if (!_levels[level]->request(h, w))
+    return;
+  tilePool().start(new TileJob(_jobs, level, h, w), priority);
+}
+
+void Utils::Mipmap::cancelJobs() {
+  if (_jobs) {
+    std::unique_lock<std::mutex> lock(_jobs->mutex);
+    _jobs->cancelled = true;
+    _jobs->idle.wait(lock, [this] { return _jobs->running == 0; });
   }
-  delete [] working_Data;
-  *ptr_width = nwidth;
-  *ptr_height = nheight;
-  return d;
+  // queued jobs of the old state skip their work
+  _jobs = std::make_shared<jobs_t>();
+  _jobs->mipmap = this;
+  _jobs->running = 0;
+  _jobs->cancelled = false;
 }
 
-void Utils::Mipmap::draw(Utils::GlManager *gl,
-                         int top, int left,
-                         int bottom, int right,
-                         double zoom) {
-  // DLOG(INFO) << "Utils::Mipmap::draw START";
-  // DLOG(INFO) << "top " << top
-  //           << "left " << left
-  //           << "bottom " << bottom
-  //           << "right " << right
-  //          ;
+void Utils::Mipmap::setData(DiskCache::Entry_ptr entry) {
+  const DiskCache::header_t *hdr = entry->header();
+  _entry = entry;
+  _reduction = PyramidReduction::MEAN;
+  for (uint l = 0; l < hdr->levels; ++l) {
+    MipmapLevel* level = new MipmapLevel();
+    level->setTiles(entry->level(l),
+                    hdr->level_height[l], hdr->level_width[l], hdr->channels,
+                    hdr->tile_size);
+    // empty tiles of sparse masks need no textures, non-uniform tiles
+    // stop at their first differing pixel
+    level->detectUniform();
+    _levels.push_back(level);
+  }
+  _built = _levels.size();
+  _empty = false;
+}
 
-  // find best level for given zoom_level
-  int currentLevel = 0;
-  if ( zoom < 1.0 )
-    currentLevel = (unsigned int)(-(log(zoom) / log(2.0)) + 0.01);
+int Utils::Mipmap::levelForZoom(double zoom) {
   /*
   zoom_level --> current_level
   1/2 -> 1.01 -> 1
   1/4 -> 2.01 -> 2
   1/8 -> 3.01 -> 3
   */
+  if ( zoom < 1.0 )
+    return (unsigned int)(-(log(zoom) / log(2.0)) + 0.01);
+  return 0;
+}
+
+void Utils::Mipmap::draw(Utils::GlManager *gl,
+                         int top, int left,
+                         int bottom, int right,
+                         double zoom) {
+  // find best level for given zoom_level
+  int currentLevel = levelForZoom(zoom);
   // clip values to [0, num_levels]
   currentLevel = std::max(currentLevel, 0);
   currentLevel = std::min(currentLevel, (int)_levels.size() - 1);
@@ -211,12 +296,67 @@ void Utils::Mipmap::draw(Utils::GlManager *gl,
   4 -> 0.0625
   */
   zoom = pow( 2.0, -(double)currentLevel );
+  MipmapLevel* level = _levels[currentLevel];
 
-  // DLOG(INFO) << "Utils::Mipmap::draw LEVEL " << currentLevel;
-
+  std::vector<std::pair<uint, uint> > ready, missing;
+  const TileRange visible = level->visibleRange(top, left, bottom, right, zoom);
 
-  _levels[currentLevel]->draw(gl, top, left, bottom, right, zoom);
-  // DLOG(INFO) << "Utils::Mipmap::draw END";
-  // https://doc-snapshots.qt.io/qt5-dev/qopenglfunctions.html
+  visible.forEach([&](uint h, uint w) {
+    MipmapTile* tile = level->tile(h, w);
+    if (tile == nullptr) {
+      requestTile(currentLevel, h, w, VISIBLE);
+      missing.push_back({h, w});
+      return;
+    }
+    // drawn as flat quad
+    if (tile->uniform()) {
+      ready.push_back({h, w});
+      return;
+    }
+    if (!tile->uploaded()) {
+      // the texture was evicted after the data was dropped
+      if (!level->hasData(h, w)) {
+        requestTile(currentLevel, h, w, VISIBLE);
+        missing.push_back({h, w});
+        return;
+      }
+      if (!gl->allowUpload(tile->obj()->size())) {
+        missing.push_back({h, w});
+        return;
+      }
+      tile->upload(gl, &_pinned);
+      level->dropData(h, w);
+    }
+    ready.push_back({h, w});
+  });
+
+  if (missing.empty()) {
+    // zooming out is likely, prepare the covering tiles of the next levels
+    for (int l = currentLevel + 1; l <= std::min(currentLevel + 2, depth() - 1); ++l) {
+      visible.coarser(l - currentLevel).forEach([&](uint h, uint w) {
+        requestTile(l, h, w, PREFETCH);
+      });
+    }
+  } else {
+    gl->markIncomplete();
+    // uploaded tiles of coarser levels stand in for missing tiles
+    std::set<std::pair<int, std::pair<uint, uint> > > placeholders;
+    for (auto && t : missing) {
+      for (int l = currentLevel + 1; l < depth(); ++l) {
+        const uint shift = l - currentLevel;
+        const MipmapTile* tile = _levels[l]->tile(t.first >> shift, t.second >> shift);
+        if (tile != nullptr && (tile->uploaded() || tile->uniform())) {
+          placeholders.insert({l, {t.first >> shift, t.second >> shift}});
+          break;
+        }
+      }
+    }
+    // coarsest first, finer ones are drawn on top
+    for (auto it = placeholders.rbegin(); it != placeholders.rend(); ++it)
+      _levels[it->first]->drawTile(gl, it->second.first, it->second.second,
+                                   pow(2.0, -(double)it->first));
+  }
 
-}
\ No newline at end of file
+  for (auto && t : ready)
+    level->drawTile(gl, t.first, t.second, zoom);
+}
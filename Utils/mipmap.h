@@ -1,9 +1,13 @@
 #ifndef MIPMAP_H
 #define MIPMAP_H
 
+#include <atomic>
+#include <condition_variable>
 #include <memory>
+#include <mutex>
 #include <vector>
 #include "misc.h"
+#include "disk_cache.h"
 
 namespace Utils  {
 
@@ -16,26 +20,125 @@ class Mipmap {
   Mipmap();
   ~Mipmap();
 
+  /**
+   * @brief slice level 0 right away, the data can be released afterwards
+   */
   void setData(float* ptr,
                uint height, uint width, uint channels,
                uint tileSize = 512);
 
-  float* downsample(const float* ptr,
-                    uint* height, uint* width, uint channels) const;
-  void bindBuffer();
+  /**
+   * @brief tiles are materialized from the image when they become visible
+   * @details The image is kept alive and must not change. Level 0 of tiled
+   *          images (ImageData::tileSize) points into the image buffer and
+   *          uses its tile size.
+   */
+  void setData(std::shared_ptr<const ImageData> img,
+               uint tileSize = 512);
+
+  /**
+   * @brief use the pyramid of a disk cache entry
+   * @details tiles point into the mapped entry, which is kept alive, uniform
+   *          tiles are detected like for tiled images
+   */
+  void setData(DiskCache::Entry_ptr entry);
+
+  /**
+   * @brief materialize all tiles of levels [0, last]
+   * @details Tiles of a level are reduced as soon as their (up to) 2x2 finer
+   *          tiles exist, such that consecutive levels overlap. Prefilters
+   *          materialize the neighbors they read on their own.
+   *
+   * @param parallel use all OpenMP threads (otherwise build on this thread)
+   */
+  void buildLevels(int last, bool parallel = true);
+
+  /**
+   * @brief number of levels (materialized or not)
+   */
+  int depth() const;
+
+  /**
+   * @brief draw the visible tiles of the level matching the zoom
+   * @details Missing tiles are computed by background jobs and uploaded
+   *          within the budget of the frame. Until then the tiles of coarser
+   *          levels are drawn in their place and the frame is marked
+   *          incomplete (see GlManager).
+   */
   void draw(Utils::GlManager *gl,
             int top, int left, int bottom, int right,
             double zoom);
 
+  /**
+   * @brief pyramid level which is drawn for a given zoom
+   * @details 1/2 -> 1, 1/4 -> 2, ... (not clipped to available levels)
+   *
+   * @param zoom pixel size
+   */
+  static int levelForZoom(double zoom);
+
+  /**
+   * @brief keep the textures of this pyramid in video memory
+   * @details pinned pyramids are skipped by the eviction of the TextureStore
+   */
+  void setPinned(bool pinned);
+  bool pinned() const;
+
+  /**
+   * @brief mean, maximum or minimum of 2x2 pixels per coarser level, or a
+   *        Lanczos-3/Gaussian prefilter against aliasing
+   * @details applies to pyramids set up afterwards (setData), those of the
+   *          disk cache are always averaged
+   */
+  void setReduction(PyramidReduction reduction);
+  PyramidReduction reduction() const;
+
   std::vector<MipmapLevel*> _levels;
 
   void clear();
   bool empty();
 
+  /**
+   * @brief state shared with the background jobs of the pyramid
+   */
+  struct jobs_t {
+    Mipmap* mipmap;
+    std::mutex mutex;
+    std::condition_variable idle;
+    int running;
+    std::atomic<bool> cancelled;
+  };
+
  private:
-  ImageData *_img;
+  void initLevels(const float* ptr,
+                  uint height, uint width, uint channels,
+                  uint tileSize);
+
+  /**
+   * @brief materialize tile in the background unless requested before
+   * @param priority jobs of higher priority run first
+   */
+  void requestTile(int level, uint h, uint w, int priority);
+
+  /**
+   * @brief stop background jobs and wait for those running
+   */
+  void cancelJobs();
+
   bool _empty;
+  // backing memory of cached tiles
+  DiskCache::Entry_ptr _entry;
+  // source of virtual tiles of level 0
+  std::shared_ptr<const ImageData> _source;
+
+  // number of levels which are completely materialized
+  std::atomic<int> _built;
+  std::mutex _build_mutex;
+
+  std::shared_ptr<jobs_t> _jobs;
 
+  std::atomic<bool> _pinned;
+  PyramidReduction _reduction;
 };
 
 }; // namespace Utils
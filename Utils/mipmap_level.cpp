@@ -1,32 +1,419 @@
 #include <iostream>
 #include <algorithm>
+#include <cmath>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include <glog/logging.h>
 
 #include "misc.h"
 #include "mipmap_tile.h"
+#include "tile_store.h"
 #include "mipmap_level.h"
 #include "gl_manager.h"
 
+namespace {
+/*
+2x2 box filter of the interleaved [w,C] source rows a and b into the row d,
+one output pixel per pair of columns. All code paths sum in the same order
+(a + b per column, then both columns), hence they produce identical values.
+*/
 
+#ifdef __SSE2__
+// single channel, returns number of written outputs (multiple of 4)
+uint reduceRowsSse2(const float* a, const float* b, float* d, uint n) {
+  const __m128 quarter = _mm_set1_ps(0.25f);
+  uint w = 0;
+  for (; w + 4 <= n; w += 4) {
+    const __m128 s0 = _mm_add_ps(_mm_loadu_ps(a + 2 * w), _mm_loadu_ps(b + 2 * w));
+    const __m128 s1 = _mm_add_ps(_mm_loadu_ps(a + 2 * w + 4), _mm_loadu_ps(b + 2 * w + 4));
+    const __m128 even = _mm_shuffle_ps(s0, s1, _MM_SHUFFLE(2, 0, 2, 0));
+    const __m128 odd = _mm_shuffle_ps(s0, s1, _MM_SHUFFLE(3, 1, 3, 1));
+    _mm_storeu_ps(d + w, _mm_mul_ps(_mm_add_ps(even, odd), quarter));
+  }
+  return w;
+}
+
+// four channels, one pixel per register
+void reduceRowsSse2Rgba(const float* a, const float* b, float* d, uint n) {
+  const __m128 quarter = _mm_set1_ps(0.25f);
+  for (uint w = 0; w < n; ++w) {
+    const __m128 s0 = _mm_add_ps(_mm_loadu_ps(a + 8 * w), _mm_loadu_ps(b + 8 * w));
+    const __m128 s1 = _mm_add_ps(_mm_loadu_ps(a + 8 * w + 4), _mm_loadu_ps(b + 8 * w + 4));
+    _mm_storeu_ps(d + 4 * w, _mm_mul_ps(_mm_add_ps(s0, s1), quarter));
+  }
+}
+
+/*
+three channels, one pixel per register: loads and stores of 4 floats overlap
+the next pixel, whose values are overwritten by the next step. The last pair
+is left to the scalar path as it would read and write beyond the row.
+*/
+uint reduceRowsSse2Rgb(const float* a, const float* b, float* d, uint n) {
+  const __m128 quarter = _mm_set1_ps(0.25f);
+  uint w = 0;
+  for (; w + 1 < n; ++w) {
+    const __m128 s0 = _mm_add_ps(_mm_loadu_ps(a + 6 * w), _mm_loadu_ps(b + 6 * w));
+    const __m128 s1 = _mm_add_ps(_mm_loadu_ps(a + 6 * w + 3), _mm_loadu_ps(b + 6 * w + 3));
+    _mm_storeu_ps(d + 3 * w, _mm_mul_ps(_mm_add_ps(s0, s1), quarter));
+  }
+  return w;
+}
+#endif  // __SSE2__
+
+#if defined(__x86_64__) || defined(__i386__)
+// single channel, returns number of written outputs (multiple of 8)
+__attribute__((target("avx2")))
+uint reduceRowsAvx2(const float* a, const float* b, float* d, uint n) {
+  const __m256 quarter = _mm256_set1_ps(0.25f);
+  uint w = 0;
+  for (; w + 8 <= n; w += 8) {
+    const __m256 s0 = _mm256_add_ps(_mm256_loadu_ps(a + 2 * w), _mm256_loadu_ps(b + 2 * w));
+    const __m256 s1 = _mm256_add_ps(_mm256_loadu_ps(a + 2 * w + 8), _mm256_loadu_ps(b + 2 * w + 8));
+    // pairs within 128-bit lanes: s0[0..1] s1[0..1] | s0[2..3] s1[2..3]
+    const __m256 sums = _mm256_hadd_ps(s0, s1);
+    const __m256 ordered = _mm256_castpd_ps(
+                             _mm256_permute4x64_pd(_mm256_castps_pd(sums), _MM_SHUFFLE(3, 1, 2, 0)));
+    _mm256_storeu_ps(d + w, _mm256_mul_ps(ordered, quarter));
+  }
+  return w;
+}
+#endif
+
+#ifdef __SSE2__
+inline __m128 pickSse2(__m128 x, __m128 y, bool max) {
+  return max ? _mm_max_ps(x, y) : _mm_min_ps(x, y);
+}
+
+// maximum or minimum instead of the mean, layouts as above
+uint extremeRowsSse2(const float* a, const float* b, float* d, uint n, bool max) {
+  uint w = 0;
+  for (; w + 4 <= n; w += 4) {
+    const __m128 s0 = pickSse2(_mm_loadu_ps(a + 2 * w), _mm_loadu_ps(b + 2 * w), max);
+    const __m128 s1 = pickSse2(_mm_loadu_ps(a + 2 * w + 4), _mm_loadu_ps(b + 2 * w + 4), max);
+    const __m128 even = _mm_shuffle_ps(s0, s1, _MM_SHUFFLE(2, 0, 2, 0));
+    const __m128 odd = _mm_shuffle_ps(s0, s1, _MM_SHUFFLE(3, 1, 3, 1));
+    _mm_storeu_ps(d + w, pickSse2(even, odd, max));
+  }
+  return w;
+}
+
+void extremeRowsSse2Rgba(const float* a, const float* b, float* d, uint n, bool max) {
+  for (uint w = 0; w < n; ++w) {
+    const __m128 s0 = pickSse2(_mm_loadu_ps(a + 8 * w), _mm_loadu_ps(b + 8 * w), max);
+    const __m128 s1 = pickSse2(_mm_loadu_ps(a + 8 * w + 4), _mm_loadu_ps(b + 8 * w + 4), max);
+    _mm_storeu_ps(d + 4 * w, pickSse2(s0, s1, max));
+  }
+}
+
+uint extremeRowsSse2Rgb(const float* a, const float* b, float* d, uint n, bool max) {
+  uint w = 0;
+  for (; w + 1 < n; ++w) {
+    const __m128 s0 = pickSse2(_mm_loadu_ps(a + 6 * w), _mm_loadu_ps(b + 6 * w), max);
+    const __m128 s1 = pickSse2(_mm_loadu_ps(a + 6 * w + 3), _mm_loadu_ps(b + 6 * w + 3), max);
+    _mm_storeu_ps(d + 3 * w, pickSse2(s0, s1, max));
+  }
+  return w;
+}
+#endif  // __SSE2__
+
+/*
+Maximum (or minimum) of each 2x2 block, such that sparse features like single
+pixels or thin lines survive zooming out. The last row of odd heights is
+paired with itself, which leaves the result unchanged.
+The channel count is a template argument for the display layouts (1, 3 and 4
+channels), such that the scalar loops are unrolled, 0 reads it from channels.
+*/
+template<uint N>
+void extremeRowPair(const float* a, const float* b, float* d,
+                    uint width, uint channels, bool max) {
+  const uint pairs = width / 2;
+  const uint C = (N > 0) ? N : channels;
+  if (b == nullptr)
+    b = a;
+  auto pick = [max](float x, float y) {
+    return max ? std::max(x, y) : std::min(x, y);
+  };
+
+  uint w = 0;
+#ifdef __SSE2__
+  if (N == 1) {
+    w = extremeRowsSse2(a, b, d, pairs, max);
+  } else if (N == 3) {
+    w = extremeRowsSse2Rgb(a, b, d, pairs, max);
+  } else if (N == 4) {
+    extremeRowsSse2Rgba(a, b, d, pairs, max);
+    w = pairs;
+  }
+#endif
+  for (; w < pairs; ++w)
+    for (uint c = 0; c < C; ++c)
+      d[w * C + c] = pick(pick(a[2 * w * C + c], b[2 * w * C + c]),
+                          pick(a[(2 * w + 1) * C + c], b[(2 * w + 1) * C + c]));
+  if (width % 2)
+    for (uint c = 0; c < C; ++c)
+      d[pairs * C + c] = pick(a[(width - 1) * C + c], b[(width - 1) * C + c]);
+}
+
+/*
+The output has ceil(width/2) pixels, the last pixel of odd widths averages
+a single column. b is nullptr for the last row of odd heights.
+*/
+template<uint N>
+void reduceRowPair(const float* a, const float* b, float* d,
+                   uint width, uint channels, PyramidReduction mode) {
+  if (mode != PyramidReduction::MEAN) {
+    extremeRowPair<N>(a, b, d, width, channels, mode == PyramidReduction::MAX);
+    return;
+  }
+  const uint pairs = width / 2;
+  const uint C = (N > 0) ? N : channels;
+  if (b == nullptr) {
+    for (uint w = 0; w < pairs; ++w)
+      for (uint c = 0; c < C; ++c)
+        d[w * C + c] = 0.5f * (a[2 * w * C + c] + a[(2 * w + 1) * C + c]);
+    if (width % 2)
+      for (uint c = 0; c < C; ++c)
+        d[pairs * C + c] = a[(width - 1) * C + c];
+    return;
+  }
+
+  uint w = 0;
+#if defined(__x86_64__) || defined(__i386__)
+  static const bool use_avx2 = __builtin_cpu_supports("avx2");
+  if (N == 1 && use_avx2)
+    w = reduceRowsAvx2(a, b, d, pairs);
+#endif
+#ifdef __SSE2__
+  if (N == 1) {
+    w += reduceRowsSse2(a + 2 * w, b + 2 * w, d + w, pairs - w);
+  } else if (N == 3) {
+    w = reduceRowsSse2Rgb(a, b, d, pairs);
+  } else if (N == 4) {
+    reduceRowsSse2Rgba(a, b, d, pairs);
+    w = pairs;
+  }
+#endif
+  for (; w < pairs; ++w)
+    for (uint c = 0; c < C; ++c)
+      d[w * C + c] = 0.25f * ((a[2 * w * C + c] + b[2 * w * C + c])
+                              + (a[(2 * w + 1) * C + c] + b[(2 * w + 1) * C + c]));
+  if (width % 2)
+    for (uint c = 0; c < C; ++c)
+      d[pairs * C + c] = 0.5f * (a[(width - 1) * C + c] + b[(width - 1) * C + c]);
+}
+
+void reduceRowPair(const float* a, const float* b, float* d,
+                   uint width, uint channels, PyramidReduction mode) {
+  switch (channels) {
+  case 1: reduceRowPair<1>(a, b, d, width, channels, mode); return;
+  case 3: reduceRowPair<3>(a, b, d, width, channels, mode); return;
+  case 4: reduceRowPair<4>(a, b, d, width, channels, mode); return;
+  }
+  reduceRowPair<0>(a, b, d, width, channels, mode);
+}
+
+/*
+Separable prefilters for halving. Output pixel x is centered between the finer
+pixels 2x and 2x + 1 and tap t reads the finer pixel 2x - (radius - 1) + t.
+The phase is the same for all outputs, hence one set of weights serves every
+pixel of every level. Lanczos-3 stretched by 2 has 12 taps, the Gaussian with
+a sigma of one finer pixel (like the binomial of Burt-Adelson pyramids) 6.
+*/
+const uint MAX_TAPS = 12;
+
+struct kernel_t {
+  uint radius;
+  float weights[MAX_TAPS];
+};
 
-Utils::MipmapLevel::MipmapLevel() {}
+template<typename F>
+kernel_t makeKernel(uint radius, F f) {
+  kernel_t k;
+  k.radius = radius;
+  double sum = 0;
+  for (uint t = 0; t < radius; ++t)
+    sum += 2 * f((double)t - (radius - 1) - 0.5);
+  // normalized (constant regions stay constant) and exactly symmetric
+  for (uint t = 0; t < radius; ++t) {
+    k.weights[t] = f((double)t - (radius - 1) - 0.5) / sum;
+    k.weights[2 * radius - 1 - t] = k.weights[t];
+  }
+  return k;
+}
+
+// weights by distance to the output center in finer pixels
+const kernel_t& filterKernel(PyramidReduction mode) {
+  static const kernel_t lanczos = makeKernel(6, [](double d) {
+    auto sinc = [](double x) {
+      return (x == 0) ? 1.0 : std::sin(M_PI * x) / (M_PI * x);
+    };
+    return sinc(d / 2) * sinc(d / 6);
+  });
+  static const kernel_t gaussian = makeKernel(3, [](double d) {
+    return std::exp(-0.5 * d * d);
+  });
+  DCHECK(mode == PyramidReduction::LANCZOS || mode == PyramidReduction::GAUSSIAN);
+  return (mode == PyramidReduction::LANCZOS) ? lanczos : gaussian;
+}
+
+bool filtered(PyramidReduction mode) {
+  return mode == PyramidReduction::LANCZOS || mode == PyramidReduction::GAUSSIAN;
+}
+
+/*
+Weighted sum d[i] = sum_t weights[t] * src[t][i] of rows, which is the
+horizontal pass on deinterleaved rows as well as the vertical one. The
+weights are symmetric, hence the rows of tap t and taps - 1 - t are added
+before the multiplication, which halves the products.
+*/
+#if defined(__x86_64__) || defined(__i386__)
+// returns number of written outputs (multiple of 8), four independent sums
+// per iteration hide the latency of the additions
+__attribute__((target("avx2,fma")))
+size_t convolveAvx2(const float* const* src, const float* weights, uint taps,
+                    float* d, size_t n) {
+  const uint pairs = taps / 2;
+  __m256 w[MAX_TAPS / 2];
+  for (uint t = 0; t < pairs; ++t)
+    w[t] = _mm256_set1_ps(weights[t]);
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    __m256 acc2 = _mm256_setzero_ps(), acc3 = _mm256_setzero_ps();
+    for (uint t = 0; t < pairs; ++t) {
+      const float* a = src[t] + i;
+      const float* b = src[taps - 1 - t] + i;
+      acc0 = _mm256_fmadd_ps(w[t], _mm256_add_ps(_mm256_loadu_ps(a), _mm256_loadu_ps(b)), acc0);
+      acc1 = _mm256_fmadd_ps(w[t], _mm256_add_ps(_mm256_loadu_ps(a + 8), _mm256_loadu_ps(b + 8)), acc1);
+      acc2 = _mm256_fmadd_ps(w[t], _mm256_add_ps(_mm256_loadu_ps(a + 16), _mm256_loadu_ps(b + 16)), acc2);
+      acc3 = _mm256_fmadd_ps(w[t], _mm256_add_ps(_mm256_loadu_ps(a + 24), _mm256_loadu_ps(b + 24)), acc3);
+    }
+    _mm256_storeu_ps(d + i, acc0);
+    _mm256_storeu_ps(d + i + 8, acc1);
+    _mm256_storeu_ps(d + i + 16, acc2);
+    _mm256_storeu_ps(d + i + 24, acc3);
+  }
+  for (; i + 8 <= n; i += 8) {
+    __m256 acc = _mm256_setzero_ps();
+    for (uint t = 0; t < pairs; ++t)
+      acc = _mm256_fmadd_ps(w[t], _mm256_add_ps(_mm256_loadu_ps(src[t] + i),
+                                                _mm256_loadu_ps(src[taps - 1 - t] + i)), acc);
+    _mm256_storeu_ps(d + i, acc);
+  }
+  return i;
+}
+#endif
+
+void convolve(const float* const* src, const float* weights, uint taps,
+              float* d, size_t n) {
+  const uint pairs = taps / 2;
+  size_t i = 0;
+#if defined(__x86_64__) || defined(__i386__)
+  static const bool use_avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+  if (use_avx2)
+    i = convolveAvx2(src, weights, taps, d, n);
+#endif
+#ifdef __SSE2__
+  __m128 w[MAX_TAPS / 2];
+  for (uint t = 0; t < pairs; ++t)
+    w[t] = _mm_set1_ps(weights[t]);
+  for (; i + 4 <= n; i += 4) {
+    __m128 acc = _mm_setzero_ps();
+    for (uint t = 0; t < pairs; ++t)
+      acc = _mm_add_ps(acc, _mm_mul_ps(w[t], _mm_add_ps(_mm_loadu_ps(src[t] + i),
+                                                        _mm_loadu_ps(src[taps - 1 - t] + i))));
+    _mm_storeu_ps(d + i, acc);
+  }
+#endif  // __SSE2__
+  for (; i < n; ++i) {
+    float acc = 0.f;
+    for (uint t = 0; t < pairs; ++t)
+      acc += weights[t] * (src[t][i] + src[taps - 1 - t][i]);
+    d[i] = acc;
+  }
+}
+
+// split n pixels of interleaved [w,C] pairs into even and odd pixels
+template<uint C>
+void deinterleave(const float* s, float* even, float* odd, uint n) {
+  uint k = 0;
+#ifdef __SSE2__
+  if (C == 1)
+    for (; k + 4 <= n; k += 4) {
+      const __m128 a = _mm_loadu_ps(s + 2 * k);
+      const __m128 b = _mm_loadu_ps(s + 2 * k + 4);
+      _mm_storeu_ps(even + k, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+      _mm_storeu_ps(odd + k, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+    }
+  // one pixel per register, stores overlap the next pixel (see reduceRowsSse2Rgb)
+  if (C == 3)
+    for (; k + 1 < n; ++k) {
+      _mm_storeu_ps(even + 3 * k, _mm_loadu_ps(s + 6 * k));
+      _mm_storeu_ps(odd + 3 * k, _mm_loadu_ps(s + 6 * k + 3));
+    }
+#endif  // __SSE2__
+  for (; k < n; ++k)
+    for (uint c = 0; c < C; ++c) {
+      even[k * C + c] = s[2 * k * C + c];
+      odd[k * C + c] = s[(2 * k + 1) * C + c];
+    }
+}
+
+void deinterleave(const float* s, float* even, float* odd, uint n, uint channels) {
+  switch (channels) {
+  case 1: deinterleave<1>(s, even, odd, n); return;
+  case 2: deinterleave<2>(s, even, odd, n); return;
+  case 3: deinterleave<3>(s, even, odd, n); return;
+  case 4: deinterleave<4>(s, even, odd, n); return;
+  }
+  for (uint k = 0; k < n; ++k) {
+    std::copy_n(s + 2 * k * channels, channels, even + k * channels);
+    std::copy_n(s + (2 * k + 1) * channels, channels, odd + k * channels);
+  }
+}
+
+/*
+All pixels equal the first one iff every value equals the one of the next
+pixel. memcmp compares vectorized and stops at the first difference, which
+comes early for most tiles. The comparison is bitwise, thus tiles of NaN are
+uniform as well (min == max would miss them).
+*/
+bool isUniform(const float* d, size_t elements, uint channels) {
+  return elements <= channels
+         || memcmp(d, d + channels, (elements - channels) * sizeof(float)) == 0;
+}
+}; // anonymous namespace
+
+
+
+Utils::MipmapLevel::MipmapLevel()
+  : _source(nullptr), _finer(nullptr), _scratch(false), _transient(false),
+    _reduction(PyramidReduction::MEAN),
+    _tileSize(0), _gridHeight(0), _gridWidth(0), _height(0), _width(0), _channels(0) {}
 Utils::MipmapLevel::~MipmapLevel() {}
 void Utils::MipmapLevel::clear() {
-  for (auto && tile_line : _tiles) {
-    for (auto && tile : tile_line) {
-      tile->clear();
-      delete tile;
-    }
-    tile_line.clear();
+  for (uint n = 0; n < _gridHeight * _gridWidth; ++n) {
+    // virtual tiles do not exist
+    MipmapTile* tile = _slots[n].tile;
+    if (tile == nullptr)
+      continue;
+    tile->clear();
+    delete tile;
   }
-  _tiles.clear();
+  _slots.reset();
+  _gridHeight = _gridWidth = 0;
+  _source = nullptr;
+  _finer = nullptr;
 }
 
 
-void Utils::MipmapLevel::setData(float* ptr,
-                                 uint height, uint width, uint channels,
-                                 uint tileSize) {
-  // DLOG(INFO) << "Utils::MipmapLevel::setData " << height << " " << width << " " << tileSize;
+void Utils::MipmapLevel::initGrid(uint height, uint width, uint channels, uint tileSize) {
   _tileSize = tileSize;
+  _height = height;
+  _width = width;
+  _channels = channels;
 
   // generate enough tiles (like block and grid)
   uint tileNumH = width / tileSize;
@@ -37,55 +424,401 @@ void Utils::MipmapLevel::setData(float* ptr,
   _gridWidth = tileNumH + std::min(borderRight, 1u);
   _gridHeight = tileNumV + std::min(borderLower, 1u);
 
+  _slots.reset(new slot_t[_gridHeight * _gridWidth]);
+}
+
+void Utils::MipmapLevel::setSource(const float* ptr, MipmapLevel* finer, bool scratch) {
+  _source = ptr;
+  _finer = finer;
+  _scratch = scratch;
+}
+
+uint Utils::MipmapLevel::height() const {return _height;}
+uint Utils::MipmapLevel::width() const {return _width;}
+uint Utils::MipmapLevel::tileSize() const {return _tileSize;}
+uint Utils::MipmapLevel::gridHeight() const {return _gridHeight;}
+uint Utils::MipmapLevel::gridWidth() const {return _gridWidth;}
+
+Utils::MipmapLevel::slot_t& Utils::MipmapLevel::slot(uint h, uint w) const {
+  return _slots[h * _gridWidth + w];
+}
+const Utils::MipmapTile* Utils::MipmapLevel::tile(uint h, uint w) const {
+  return slot(h, w).tile;
+}
+Utils::MipmapTile* Utils::MipmapLevel::tile(uint h, uint w) {
+  return slot(h, w).tile;
+}
+
+void Utils::MipmapLevel::setTiles(const float* ptr,
+                                  uint height, uint width, uint channels,
+                                  uint tileSize) {
+  initGrid(height, width, channels, tileSize);
+
   for (uint h = 0; h < _gridHeight; ++h) {
-    _tiles.push_back(std::vector<MipmapTile*>(_gridWidth) );
+    for (uint w = 0; w < _gridWidth; ++w) {
+      const uint diffH = std::min((h + 1) * tileSize, height) - h * tileSize;
+      const uint diffW = std::min((w + 1) * tileSize, width) - w * tileSize;
+      // textures only read from the tile buffer
+      slot(h, w).tile = new MipmapTile(const_cast<float*>(ptr), diffH, diffW, channels, false);
+      ptr += (size_t)diffH * diffW * channels;
+    }
   }
+}
+
+bool Utils::MipmapLevel::request(uint h, uint w) {
+  return !slot(h, w).requested.exchange(true);
+}
+
+void Utils::MipmapLevel::materialize(uint h, uint w, const std::atomic<bool> *cancelled) {
+  slot_t &s = slot(h, w);
+  if (s.tile == nullptr) {
+    std::call_once(s.once, [&] {
+      // tiles of the disk cache exist from the start
+      if (s.tile != nullptr)
+        return;
+      if (_finer != nullptr) {
+        sourceRange(h, w).forEach([&](uint sh, uint sw) {
+          _finer->materialize(sh, sw, cancelled);
+        });
+        // the pyramid is about to be discarded
+        if (cancelled != nullptr && *cancelled)
+          return;
+      }
+      const uint minH = h * _tileSize;
+      const uint minW = w * _tileSize;
+      const uint diffH = std::min((h + 1) * _tileSize, _height) - minH;
+      const uint diffW = std::min((w + 1) * _tileSize, _width) - minW;
+      MipmapTile* tile;
+      const float* value = uniformCover(h, w);
+      if (value != nullptr) {
+        // the average (or extreme) of equal values is that value
+        tile = new MipmapTile(nullptr, diffH, diffW, _channels);
+        tile->setUniform(value);
+      } else {
+        float* d = computeTile(h, w);
+        tile = new MipmapTile(d, diffH, diffW, _channels);
+        if (isUniform(d, tile->obj()->elements(), _channels))
+          tile->setUniform(d);
+      }
+      s.tile = tile;
+    });
+    return;
+  }
+  if (s.dropped) {
+    std::lock_guard<std::mutex> lock(s.mutex);
+    if (s.dropped) {
+      s.tile.load()->setData(computeTile(h, w));
+      s.dropped = false;
+    }
+  }
+}
+
+const float* Utils::MipmapLevel::acquire(uint h, uint w) {
+  materialize(h, w);
+  slot_t &s = slot(h, w);
+  std::lock_guard<std::mutex> lock(s.mutex);
+  MipmapTile* t = s.tile;
+  // dropped again in the meantime
+  if (s.dropped) {
+    t->setData(computeTile(h, w));
+    s.dropped = false;
+  }
+  // uniform tiles are expanded while they are read
+  if (t->uniform() && t->obj()->data == nullptr) {
+    const size_t elements = t->obj()->elements();
+    float* d = TileStore::allocate(elements, _scratch);
+    for (size_t i = 0; i < elements; i += _channels)
+      std::copy(t->value(), t->value() + _channels, d + i);
+    t->setData(d);
+  }
+  s.readers++;
+  return t->obj()->data;
+}
+
+void Utils::MipmapLevel::release(uint h, uint w) {
+  slot_t &s = slot(h, w);
+  std::lock_guard<std::mutex> lock(s.mutex);
+  s.readers--;
+  MipmapTile* t = s.tile;
+  if (s.readers == 0 && t->uniform())
+    t->dropData();
+}
+
+void Utils::MipmapLevel::dropData(uint h, uint w) {
+  // the data could not be regenerated
+  if (!_transient || (_source == nullptr && _finer == nullptr))
+    return;
+  slot_t &s = slot(h, w);
+  std::lock_guard<std::mutex> lock(s.mutex);
+  MipmapTile* t = s.tile;
+  if (t == nullptr || t->uniform() || s.dropped || s.readers > 0 || !t->uploaded())
+    return;
+  t->dropData();
+  s.dropped = true;
+  // an evicted texture requests the tile again
+  s.requested = false;
+}
+
+bool Utils::MipmapLevel::hasData(uint h, uint w) const {
+  return !slot(h, w).dropped;
+}
+
+void Utils::MipmapLevel::setTransient(bool transient) {
+  _transient = transient;
+}
+
+void Utils::MipmapLevel::setReduction(PyramidReduction reduction) {
+  _reduction = reduction;
+}
+
+void Utils::MipmapLevel::detectUniform() {
+  size_t found = 0;
+  #pragma omp parallel for schedule(dynamic) reduction(+:found)
+  for (uint n = 0; n < _gridHeight * _gridWidth; ++n) {
+    MipmapTile* t = _slots[n].tile;
+    if (t == nullptr || t->uniform() || t->obj()->data == nullptr)
+      continue;
+    if (isUniform(t->obj()->data, t->obj()->elements(), _channels)) {
+      t->setUniform(t->obj()->data);
+      found++;
+    }
+  }
+  DLOG_IF(INFO, found > 0) << found << " of " << _gridHeight * _gridWidth << " tiles are uniform";
+}
+
+const float* Utils::MipmapLevel::uniformCover(uint h, uint w) const {
+  if (_finer == nullptr)
+    return nullptr;
+  const TileRange range = sourceRange(h, w);
+  const float* value = nullptr;
+  for (uint sh = range.top; sh < range.bottom; ++sh)
+    for (uint sw = range.left; sw < range.right; ++sw) {
+      const MipmapTile* t = _finer->tile(sh, sw);
+      if (t == nullptr || !t->uniform())
+        return nullptr;
+      if (value == nullptr)
+        value = t->value();
+      else if (memcmp(value, t->value(), _channels * sizeof(float)) != 0)
+        return nullptr;
+    }
+  return value;
+}
+
+Utils::TileRange Utils::MipmapLevel::sourceRange(uint h, uint w) const {
+  if (!filtered(_reduction))
+    return {2 * h, 2 * w,
+            std::min(2 * h + 2, _finer->_gridHeight), std::min(2 * w + 2, _finer->_gridWidth)};
+  // finer pixels read by the taps of the first and last pixel of the tile
+  const int radius = filterKernel(_reduction).radius;
+  auto span = [&](uint n, uint size, uint finerSize, uint *first, uint *last) {
+    const int lo = 2 * (int)(n * _tileSize) - (radius - 1);
+    const int hi = 2 * (int)(std::min((n + 1) * _tileSize, size) - 1) + radius;
+    *first = std::max(lo, 0) / _tileSize;
+    *last = std::min(hi, (int)finerSize - 1) / _tileSize + 1;
+  };
+  TileRange range;
+  span(h, _height, _finer->_height, &range.top, &range.bottom);
+  span(w, _width, _finer->_width, &range.left, &range.right);
+  return range;
+}
 
-  // n = h * width + w
-  #pragma omp parallel for
-  for (uint n = 0; n < _gridHeight * _gridWidth; n++ ) {
-    uint h = n / _gridWidth;
-    uint w = n % _gridWidth;
-    // for (uint h = 0; h < _gridHeight; ++h) {
-    //   for (uint w = 0; w < _gridWidth; ++w) {
+float* Utils::MipmapLevel::computeTile(uint h, uint w) {
+  if (_finer != nullptr)
+    return reduceTile(h, w);
+  CHECK(_source != nullptr) << "level without source";
+  return sliceTile(h, w);
+}
 
-    const uint minH = h * tileSize;
-    const uint minW = w * tileSize;
+float* Utils::MipmapLevel::sliceTile(uint h, uint w) const {
+  const uint minH = h * _tileSize;
+  const uint minW = w * _tileSize;
 
-    const uint maxH = std::min(((h + 1) * tileSize), height);
-    const uint maxW = std::min(((w + 1) * tileSize), width);
+  const uint maxH = std::min(((h + 1) * _tileSize), _height);
+  const uint maxW = std::min(((w + 1) * _tileSize), _width);
 
-    const uint diffH = maxH - minH;
-    const uint diffW = maxW - minW;
+  return getTileData(_source, _height, _width,
+                     minH, minW, maxH, maxW,
+                     _channels, _scratch);
+}
 
-    float* d = getTileData(ptr, height, width,
-                           minH, minW, maxH, maxW,
-                           channels);
+float* Utils::MipmapLevel::reduceTile(uint h, uint w) {
+  if (filtered(_reduction))
+    return filterTile(h, w);
+  // the tile is covered by (up to) 2x2 tiles of the finer level
+  DCHECK_EQ(_tileSize % 2, 0u);
+  const uint half = _tileSize / 2;
+  const uint minH = h * _tileSize;
+  const uint minW = w * _tileSize;
+  const uint diffH = std::min((h + 1) * _tileSize, _height) - minH;
+  const uint diffW = std::min((w + 1) * _tileSize, _width) - minW;
+  const uint lastH = std::min(2 * h + 2, _finer->_gridHeight);
+  const uint lastW = std::min(2 * w + 2, _finer->_gridWidth);
+
+  // finer tiles keep their data until reduced, uniform ones repeat one row
+  const float* data[2][2];
+  size_t stride[2][2];
+  std::vector<float> rows[2][2];
+  for (uint sh = 2 * h; sh < lastH; ++sh)
+    for (uint sw = 2 * w; sw < lastW; ++sw) {
+      const MipmapTile* t = _finer->tile(sh, sw);
+      const uint i = sh - 2 * h, j = sw - 2 * w;
+      if (t->uniform()) {
+        rows[i][j].resize(t->obj()->width * _channels);
+        for (size_t k = 0; k < rows[i][j].size(); k += _channels)
+          std::copy(t->value(), t->value() + _channels, rows[i][j].begin() + k);
+        data[i][j] = rows[i][j].data();
+        stride[i][j] = 0;
+      } else {
+        data[i][j] = _finer->acquire(sh, sw);
+        stride[i][j] = t->obj()->width * _channels;
+      }
+    }
 
-    MipmapTile *tile = new MipmapTile(d, diffH, diffW, channels);
-    _tiles[h][w] = tile;
+  float* d = TileStore::allocate((size_t)diffH * diffW * _channels, _scratch);
 
+  for (uint y = 0; y < diffH; ++y) {
+    const uint sh = 2 * h + (2 * y) / _tileSize;
+    const uint row = (2 * y) % _tileSize;
+    for (uint sw = 2 * w; sw < lastW; ++sw) {
+      const GlObject<float> *src = _finer->tile(sh, sw)->obj();
+      const size_t step = stride[sh - 2 * h][sw - 2 * w];
+      const float* a = data[sh - 2 * h][sw - 2 * w] + row * step;
+      const float* b = (row + 1 < src->height) ? a + step : nullptr;
+      float* dst = d + ((size_t)y * diffW + (sw - 2 * w) * half) * _channels;
+      reduceRowPair(a, b, dst, src->width, _channels, _reduction);
+    }
   }
-  // }
+
+  for (uint sh = 2 * h; sh < lastH; ++sh)
+    for (uint sw = 2 * w; sw < lastW; ++sw)
+      if (stride[sh - 2 * h][sw - 2 * w] != 0)
+        _finer->release(sh, sw);
+  return d;
 }
 
+float* Utils::MipmapLevel::filterTile(uint h, uint w) {
+  const kernel_t &kernel = filterKernel(_reduction);
+  const uint radius = kernel.radius;
+  const uint taps = 2 * radius;
+  const uint C = _channels;
+  const uint minH = h * _tileSize;
+  const uint minW = w * _tileSize;
+  const uint diffH = std::min((h + 1) * _tileSize, _height) - minH;
+  const uint diffW = std::min((w + 1) * _tileSize, _width) - minW;
+  const TileRange range = sourceRange(h, w);
+  const uint rangeW = range.right - range.left;
+
+  // finer tiles as in reduceTile, uniform ones repeat one row
+  std::vector<const float*> data(range.size());
+  std::vector<size_t> stride(range.size());
+  std::vector<std::vector<float> > rows(range.size());
+  range.forEach([&](uint sh, uint sw) {
+    const MipmapTile* t = _finer->tile(sh, sw);
+    const size_t n = (sh - range.top) * rangeW + (sw - range.left);
+    if (t->uniform()) {
+      rows[n].resize(t->obj()->width * C);
+      for (size_t k = 0; k < rows[n].size(); k += C)
+        std::copy(t->value(), t->value() + C, rows[n].begin() + k);
+      data[n] = rows[n].data();
+      stride[n] = 0;
+    } else {
+      data[n] = _finer->acquire(sh, sw);
+      stride[n] = t->obj()->width * C;
+    }
+  });
+
+  /*
+  The horizontal pass filters each finer row once into a ring of the last taps
+  rows, the vertical pass combines them per output row. Thus the finer tiles
+  are read once and the vertical pass stays in cache. A finer row is taken
+  from the even column first on, such that the parity of a column within the
+  row is its global parity. It is split into even and odd columns, then tap t
+  of output x reads the pixel x + (offset + t) / 2 of one of them, for all x of
+  the row at once. The segments of the finer tiles are split directly, without
+  gathering the row first.
+  */
+  const int first = 2 * (int)minW - 2 * (int)(radius / 2);
+  const uint offset = 2 * (radius / 2) - (radius - 1);
+  const uint half = diffW + radius + 1;
+  const int finerH = _finer->_height, finerW = _finer->_width;
+  // window columns within the image, others replicate the border
+  const int colLo = std::max(-first, 0);
+  const int colHi = std::min(finerW - first, (int)(2 * half));
+
+  const size_t rowSize = (size_t)diffW * C;
+  std::vector<float> even(half * C), odd(half * C);
+  std::vector<float> ring(taps * rowSize);
+  std::vector<const float*> src(taps), hsrc(taps);
+  for (uint t = 0; t < taps; ++t)
+    hsrc[t] = (((offset + t) % 2) ? odd.data() : even.data()) + ((offset + t) / 2) * C;
+  auto column = [&](int k) {
+    return ((k % 2) ? odd.data() : even.data()) + (k / 2) * C;
+  };
+
+  // finer rows 2y - (radius - 1), ..., 2y + radius of the image for output y,
+  // row r lives in ring slot (r - top) % taps
+  const int top = 2 * (int)minH - (int)(radius - 1);
+  int next = top;
+  float* d = TileStore::allocate((size_t)diffH * rowSize, _scratch);
+  for (uint y = 0; y < diffH; ++y) {
+    const int bottom = top + 2 * (int)y + (int)taps;
+    for (; next < bottom; ++next) {
+      const int row = std::min(std::max(next, 0), finerH - 1);
+      for (uint sw = range.left; sw < range.right; ++sw) {
+        int lo = std::max((int)(sw * _tileSize), first + colLo);
+        const int hi = std::min((int)((sw + 1) * _tileSize), first + colHi);
+        if (lo >= hi)
+          continue;
+        const size_t n = (row / _tileSize - range.top) * rangeW + (sw - range.left);
+        const float* s = data[n] + (row % _tileSize) * stride[n] + (lo - sw * _tileSize) * C;
+        // split pairs from an even column on, single columns at the ends
+        if ((lo - first) % 2) {
+          std::copy_n(s, C, column(lo - first));
+          s += C;
+          ++lo;
+        }
+        const uint pairs = (hi - lo) / 2;
+        deinterleave(s, column(lo - first), column(lo - first + 1), pairs, C);
+        if ((hi - lo) % 2)
+          std::copy_n(s + 2 * pairs * C, C, column(hi - 1 - first));
+      }
+      for (int k = 0; k < colLo; ++k)
+        std::copy_n(column(colLo), C, column(k));
+      for (int k = colHi; k < (int)(2 * half); ++k)
+        std::copy_n(column(colHi - 1), C, column(k));
+
+      convolve(hsrc.data(), kernel.weights, taps,
+               ring.data() + ((next - top) % taps) * rowSize, rowSize);
+    }
+    for (uint t = 0; t < taps; ++t)
+      src[t] = ring.data() + ((2 * y + t) % taps) * rowSize;
+    convolve(src.data(), kernel.weights, taps, d + y * rowSize, rowSize);
+  }
+
+  range.forEach([&](uint sh, uint sw) {
+    if (stride[(sh - range.top) * rangeW + (sw - range.left)] != 0)
+      _finer->release(sh, sw);
+  });
+  return d;
+}
 
 float* Utils::MipmapLevel::getTileData(const float* ptr,
                                        uint height, uint width,
                                        uint minH, uint minW,
                                        uint maxH, uint maxW,
-                                       uint channels) const {
+                                       uint channels, bool scratch) const {
 
   const uint diffW = maxW - minW;
   const uint diffH = maxH - minH;
+  const size_t plane = (size_t)height * width;
 
-  float *d = new float[diffH * diffW * channels];
+  float *d = TileStore::allocate((size_t)diffH * diffW * channels, scratch);
 
   for (uint c = 0; c < channels; ++c) {
     for (uint h = 0; h < diffH; ++h) {
+      const float *src = ptr + c * plane + (size_t)(h + minH) * width + minW;
       for (uint w = 0; w < diffW; ++w) {
-        d[h * diffW * channels + w * channels + c] =
-          ptr[c * (height * width) + (h + minH) * width + (w + minW)];
+        d[((size_t)h * diffW + w) * channels + c] = src[w];
       }
     }
   }
@@ -93,11 +826,9 @@ float* Utils::MipmapLevel::getTileData(const float* ptr,
   return d;
 }
 
-void Utils::MipmapLevel::draw(Utils::GlManager *gl,
-                              int top, int left,
-                              int bottom, int right,
-                              double zoom) {
-
+Utils::TileRange Utils::MipmapLevel::visibleRange(int top, int left,
+                                                  int bottom, int right,
+                                                  double zoom) const {
   // a visual fix ?
   right++;
   bottom++;
@@ -106,26 +837,57 @@ void Utils::MipmapLevel::draw(Utils::GlManager *gl,
   if ( right == 0 ) right++;
   if ( bottom == 0 ) bottom++;
 
-  // set zoom factor
-  if ( zoom < 1.0)
-    glScalef( 1.0 / zoom, 1.0 / zoom, 1.0 );
+  TileRange range;
+  visibleSpan(top, bottom, zoom, _height, _gridHeight, &range.top, &range.bottom);
+  visibleSpan(left, right, zoom, _width, _gridWidth, &range.left, &range.right);
+  return range;
+}
 
-  for (uint h = 0; h < _gridHeight; ++h) {
-    for (uint w = 0; w < _gridWidth; ++w) {
-      const double posW = (double) _tileSize * w;
-      const double posH = (double) _tileSize * h;
+void Utils::MipmapLevel::visibleSpan(int lo, int hi, double zoom,
+                                     uint size, uint grid,
+                                     uint *first, uint *last) const {
+  /*
+  Tile n covers [start(n), end(n)) in view coordinates, both increase with n.
+  It is visible if start(n) < hi and end(n) > lo. The guess from the tile size
+  is corrected at the borders by the exact test, which is the same as if
+  every tile of the grid was tested.
+  */
+  auto start = [&](uint n) {
+    return ((double) _tileSize * n) / zoom;
+  };
+  auto end = [&](uint n) {
+    return start(n) + std::min(_tileSize, size - n * _tileSize) / zoom;
+  };
+  auto guess = [&](double pos) {
+    return (uint) std::min(std::max(pos * zoom / _tileSize, 0.0), (double) grid);
+  };
 
-      const double checkPosW = posW / zoom;
-      const double checkPosH = posH / zoom;
+  uint b = guess(hi);
+  while (b > 0 && !(start(b - 1) < hi)) b--;
+  while (b < grid && start(b) < hi) b++;
 
-      const double checkPosW2 = (checkPosW + (_tiles[h][w]->obj()->width / zoom));
-      const double checkPosH2 = (checkPosH + (_tiles[h][w]->obj()->height / zoom));
+  uint a = guess(lo);
+  while (a > 0 && end(a - 1) > lo) a--;
+  while (a < grid && !(end(a) > lo)) a++;
 
-      if ( right > checkPosW && left < checkPosW2 &&
-           bottom > checkPosH && top < checkPosH2 ) {
-        _tiles[h][w]->draw(gl, posH, posW);
-      }
-    }
-  }
+  *first = a;
+  *last = std::max(a, b);
+}
 
+void Utils::MipmapLevel::visibleTiles(int top, int left,
+                                      int bottom, int right,
+                                      double zoom,
+                                      std::vector<std::pair<uint, uint> > *tiles) const {
+  visibleRange(top, left, bottom, right, zoom).forEach([&](uint h, uint w) {
+    tiles->push_back({h, w});
+  });
+}
+
+void Utils::MipmapLevel::drawTile(Utils::GlManager *gl, uint h, uint w, double zoom) {
+  glPushMatrix();
+  // set zoom factor
+  if ( zoom < 1.0)
+    glScalef( 1.0 / zoom, 1.0 / zoom, 1.0 );
+  tile(h, w)->draw(gl, (double) _tileSize * h, (double) _tileSize * w);
+  glPopMatrix();
 }
@@ -1,6 +1,10 @@
 #ifndef MIPMAP_LEVEL_H
 #define MIPMAP_LEVEL_H
 
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <utility>
 #include <vector>
 #include "misc.h"
 
@@ -8,20 +12,158 @@ namespace Utils  {
 class MipmapTile;
 class GlManager;
 
+/**
+ * @brief rectangle [top, bottom) x [left, right) of tile indices
+ */
+struct TileRange {
+  uint top, left, bottom, right;
+
+  bool empty() const {return top >= bottom || left >= right;}
+  size_t size() const {return empty() ? 0 : (size_t)(bottom - top) * (right - left);}
+
+  /**
+   * @brief tiles of the level coarser by 2^shift which cover this range
+   */
+  TileRange coarser(uint shift) const {
+    if (empty())
+      return {0, 0, 0, 0};
+    return {top >> shift, left >> shift, ((bottom - 1) >> shift) + 1, ((right - 1) >> shift) + 1};
+  }
+
+  /**
+   * @brief call f(h, w) for all tiles in row-major order
+   */
+  template<typename F>
+  void forEach(F f) const {
+    for (uint h = top; h < bottom; ++h)
+      for (uint w = left; w < right; ++w)
+        f(h, w);
+  }
+};
+
+/**
+ * @brief grid of tiles of one pyramid level
+ * @details Tiles are virtual: they are sliced from the source (level 0) or
+ *          reduced from the next finer level when they are materialized
+ *          the first time, e.g. because they became visible.
+ */
 class MipmapLevel {
  public:
   MipmapLevel();
   ~MipmapLevel();
 
-  void setData(float* ptr,
-               uint height, uint width, uint channels,
-               uint tileSize = 512);
+  /**
+   * @brief use tiles which are already sliced
+   * @details ptr holds all tiles in row-major grid order, each interleaved
+   *          [h,w,C]. The memory is not copied and must outlive the level.
+   */
+  void setTiles(const float* ptr,
+                uint height, uint width, uint channels,
+                uint tileSize = 512);
+
+  /**
+   * @brief prepare empty grid of tiles for given level size
+   * @details tiles are materialized afterwards from a source (setSource)
+   */
+  void initGrid(uint height, uint width, uint channels, uint tileSize);
+
+  /**
+   * @brief where virtual tiles come from
+   *
+   * @param ptr planar [C,H,W] data of this level (level 0), must not change
+   *            while the level exists
+   * @param finer next finer level (all other levels)
+   * @param scratch tiles live in the scratch file of the TileStore
+   */
+  void setSource(const float* ptr, MipmapLevel* finer, bool scratch);
+
+  uint height() const;
+  uint width() const;
+  uint tileSize() const;
+  uint gridHeight() const;
+  uint gridWidth() const;
+
+  /**
+   * @brief tile or nullptr if it is not materialized yet
+   */
+  const MipmapTile* tile(uint h, uint w) const;
+  MipmapTile* tile(uint h, uint w);
+
+  /**
+   * @brief compute the tile unless it exists, restore dropped data
+   * @details materializes the covering tiles of the finer levels first, can
+   *          be called concurrently (each tile is computed once)
+   *
+   * @param cancelled stops before reducing, the tile stays virtual for good
+   */
+  void materialize(uint h, uint w, const std::atomic<bool> *cancelled = nullptr);
+
+  /**
+   * @brief CPU data of a tile, which is not dropped until released
+   * @details materializes the tile and restores its data if necessary
+   */
+  const float* acquire(uint h, uint w);
+  void release(uint h, uint w);
+
+  /**
+   * @brief free the CPU data of an uploaded tile
+   * @details only transient levels which can regenerate the data from their
+   *          source drop it, tiles in use (acquire) keep it
+   */
+  void dropData(uint h, uint w);
+
+  /**
+   * @brief CPU data of the (materialized) tile exists
+   */
+  bool hasData(uint h, uint w) const;
+
+  /**
+   * @brief uploaded tiles drop their CPU data (see dropData)
+   */
+  void setTransient(bool transient);
 
-  void bindBuffer();
-  void draw(Utils::GlManager *gl,
-            int top, int left,
-            int bottom, int right,
-            double zoom);
+  /**
+   * @brief how tiles are reduced from the finer level, set before materializing
+   * @details the prefilters LANCZOS and GAUSSIAN read beyond the 2x2 finer
+   *          tiles, hence materializing a tile materializes its neighbors
+   */
+  void setReduction(PyramidReduction reduction);
+
+  /**
+   * @brief mark materialized tiles whose pixels are all equal as uniform
+   * @details computed tiles are checked when they are materialized, tiles
+   *          of setTiles only by this call
+   */
+  void detectUniform();
+
+  /**
+   * @brief mark tile as requested
+   * @return tile was not requested before
+   */
+  bool request(uint h, uint w);
+
+  /**
+   * @brief tiles intersecting the given region of the image
+   * @details computed from the tile size, independent of the grid size
+   *
+   * @param zoom scale of the level (1/2 for level 1, ...)
+   */
+  TileRange visibleRange(int top, int left,
+                         int bottom, int right,
+                         double zoom) const;
+
+  /**
+   * @brief tiles of visibleRange as list
+   */
+  void visibleTiles(int top, int left,
+                    int bottom, int right,
+                    double zoom,
+                    std::vector<std::pair<uint, uint> > *tiles) const;
+
+  /**
+   * @brief draw a (materialized) tile in image coordinates
+   */
+  void drawTile(Utils::GlManager *gl, uint h, uint w, double zoom);
 
   void clear();
 
@@ -29,14 +171,83 @@ class MipmapLevel {
   float* getTileData(const float* ptr,
                      uint height, uint width,
                      uint minH, uint minW, uint maxH, uint maxW,
-                     uint channels) const;
+                     uint channels, bool scratch) const;
+
+  /**
+   * @brief slice data of a single tile of the grid from the planar [C,H,W] source
+   */
+  float* sliceTile(uint h, uint w) const;
+
+  /**
+   * @brief compute data of a tile from the tiles of the next finer level
+   * @details averages 2x2 blocks (AVX2/SSE2 with scalar remainder), takes
+   *          their maximum/minimum or prefilters (see setReduction). The level has
+   *          ceil(H/2) x ceil(W/2) pixels of the finer level where the
+   *          blocks of the last row/column of odd sizes average 2 (or 1)
+   *          pixels. Only reads the (up to) 2x2 finer tiles covering it.
+   */
+  float* reduceTile(uint h, uint w);
+
+  /**
+   * @brief compute data of a tile by a separable prefilter (Lanczos-3 or Gaussian)
+   * @details per output row a vertical pass over the finer rows in place,
+   *          then the horizontal pass, both with fixed weights (AVX2/SSE2). Reads
+   *          the finer tiles of sourceRange, the image border is replicated.
+   */
+  float* filterTile(uint h, uint w);
+
+  /**
+   * @brief tiles of the finer level read to compute a tile
+   * @details (up to) 2x2 tiles, prefilters also read some pixels of the
+   *          neighboring tiles
+   */
+  TileRange sourceRange(uint h, uint w) const;
+
+  /**
+   * @brief data of a tile from the source (level 0) or the finer level
+   */
+  float* computeTile(uint h, uint w);
+
+  /**
+   * @brief value of the finer tiles covering a tile if all are uniform and equal
+   * @return nullptr unless the tile is uniform without being reduced
+   */
+  const float* uniformCover(uint h, uint w) const;
+
+  /**
+   * @brief tiles [first, last) of one axis intersecting the view [lo, hi)
+   */
+  void visibleSpan(int lo, int hi, double zoom,
+                   uint size, uint grid,
+                   uint *first, uint *last) const;
 
-  std::vector< std::vector<MipmapTile*> > _tiles;
  private:
+  struct slot_t {
+    slot_t() : tile(nullptr), requested(false), dropped(false), readers(0) {}
+    std::atomic<MipmapTile*> tile;
+    std::atomic<bool> requested;
+    std::once_flag once;
+    // CPU data was freed after the upload
+    std::atomic<bool> dropped;
+    // guards the CPU data of the tile
+    std::mutex mutex;
+    int readers;
+  };
+  slot_t& slot(uint h, uint w) const;
+
+  std::unique_ptr<slot_t[]> _slots;
+  const float* _source;
+  MipmapLevel* _finer;
+  bool _scratch;
+  bool _transient;
+  PyramidReduction _reduction;
 
   uint _tileSize;
   uint _gridHeight;
   uint _gridWidth;
+  uint _height;
+  uint _width;
+  uint _channels;
 
 };
 
@@ -1,13 +1,19 @@
 #include <iostream>
+#include <gflags/gflags.h>
 #include "gl_manager.h"
 #include "mipmap_tile.h"
 #include "gl_object.h"
+#include "tile_store.h"
+#include "texture_store.h"
 
 typedef unsigned int uint;
 
+DEFINE_int32(upload_budget, 32,
+             "MB of tile textures uploaded per frame, remaining tiles follow in later frames");
 
 Utils::MipmapTile::MipmapTile(float* ptr,
-                              uint height, uint width, uint channels) {
+                              uint height, uint width, uint channels,
+                              bool owned) : _owned(owned), _uniform(false) {
   _obj = new GlObject<float>();
   _obj->data = ptr;
   _obj->height = height;
@@ -20,18 +26,81 @@ Utils::MipmapTile::MipmapTile(float* ptr,
 Utils::MipmapTile::~MipmapTile() {}
 
 void Utils::MipmapTile::clear() {
-  glDeleteTextures(1, &(_obj->texture_id) );
+  // there might be no current context
+  TextureStore::release(this);
+  if (_owned)
+    TileStore::release(_obj->data, _obj->elements());
   delete _obj;
 }
 
+void Utils::MipmapTile::dropData() {
+  if (!_owned)
+    return;
+  TileStore::release(_obj->data, _obj->elements());
+  _obj->data = nullptr;
+}
+
+void Utils::MipmapTile::setData(float* ptr) {
+  if (_owned)
+    TileStore::release(_obj->data, _obj->elements());
+  _obj->data = ptr;
+  _owned = true;
+}
+
+void Utils::MipmapTile::setUniform(const float* value) {
+  _value.assign(value, value + _obj->channels);
+  _uniform = true;
+  if (_owned && _obj->data != nullptr) {
+    TileStore::release(_obj->data, _obj->elements());
+    _obj->data = nullptr;
+  }
+}
+
+bool Utils::MipmapTile::uniform() const {
+  return _uniform;
+}
+
+const float* Utils::MipmapTile::value() const {
+  return _value.data();
+}
+
 const Utils::GlObject<float> *Utils::MipmapTile::obj() const {
   return _obj;
 }
 
+bool Utils::MipmapTile::uploaded() const {
+  return _obj->loaded;
+}
+
+void Utils::MipmapTile::upload(Utils::GlManager *gl, const std::atomic<bool>* pinned) {
+  // out-of-core tiles are paged in for the upload
+  TileStore::touch(_obj->data);
+  // textures of released tiles are reused when their size matches
+  gl->prepare<float>(_obj,
+                     TextureStore::recycleTexture(_obj->height, _obj->width, _obj->channels),
+                     TextureStore::recycleBuffer());
+  // the pixel buffer is only needed for the transfer, it serves the next upload
+  TextureStore::releaseBuffer(_obj->buffer_id, _obj->size());
+  _obj->buffer_id = 0;
+  TextureStore::uploaded(this, _obj->size(), pinned);
+}
+
+void Utils::MipmapTile::unload(QOpenGLFunctions *gl) {
+  gl->glDeleteTextures(1, &_obj->texture_id);
+  _obj->texture_id = 0;
+  _obj->loaded = false;
+}
+
 void Utils::MipmapTile::draw(Utils::GlManager *gl,
                              double posH, double posW) {
+  if (_uniform) {
+    gl->drawFlat(_value.data(), _obj->channels, posH, posW,
+                 posH + _obj->height, posW + _obj->width, 1);
+    return;
+  }
   if (!_obj->loaded)
-    gl->prepare<float>(_obj);
+    upload(gl);
+  TextureStore::drawn(this);
   gl->draw<float>(_obj, posH, posW,
                   posH + _obj->height, posW + _obj->width, 1);
 }
@@ -1,9 +1,12 @@
 #ifndef MIPMAP_TILE_H
 #define MIPMAP_TILE_H
 
+#include <atomic>
 #include <vector>
 #include "misc.h"
 
+class QOpenGLFunctions;
+
 namespace Utils  {
 
 template<typename T>
@@ -12,11 +15,55 @@ class GlManager;
 
 class MipmapTile {
  public:
-  MipmapTile(float* ptr, uint height, uint width, uint channels);
+  /**
+   * @param owned tile releases the buffer (via TileStore) when cleared
+   */
+  MipmapTile(float* ptr, uint height, uint width, uint channels, bool owned = true);
   ~MipmapTile();
 
   void draw(Utils::GlManager *gl, double posH, double posW);
 
+  /**
+   * @brief texture exists on the GPU
+   */
+  bool uploaded() const;
+
+  /**
+   * @brief create texture, tracked by the TextureStore
+   * @param pinned flag of the pyramid which protects it from eviction
+   */
+  void upload(Utils::GlManager *gl, const std::atomic<bool>* pinned = nullptr);
+
+  /**
+   * @brief delete texture (evicted), the data remains for another upload
+   */
+  void unload(QOpenGLFunctions *gl);
+
+  /**
+   * @brief free the CPU data (owned tiles only), the texture stays
+   */
+  void dropData();
+
+  /**
+   * @brief take ownership of regenerated CPU data
+   */
+  void setData(float* ptr);
+
+  /**
+   * @brief all pixels of the tile have the given value
+   * @details Uniform tiles are drawn as flat quad without a texture. Owned
+   *          tiles free their data and keep the value only.
+   *
+   * @param value one value per channel (may point into the data)
+   */
+  void setUniform(const float* value);
+  bool uniform() const;
+
+  /**
+   * @brief value of all pixels of a uniform tile
+   */
+  const float* value() const;
+
   void clear();
 
   const Utils::GlObject<float> *obj() const;
@@ -24,6 +71,9 @@ class MipmapTile {
  private:
 
   Utils::GlObject<float> *_obj;
+  bool _owned;
+  bool _uniform;
+  std::vector<float> _value;
 
 };
 
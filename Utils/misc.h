@@ -14,6 +14,10 @@ struct always_false {
 
 enum class HistogramRefreshTarget {CURRENT, ENTIRE_CANVAS};
 
+// how 2x2 pixels of a pyramid level become one pixel of the next coarser level,
+// LANCZOS and GAUSSIAN prefilter a wider neighborhood against aliasing
+enum class PyramidReduction {MEAN, MAX, MIN, LANCZOS, GAUSSIAN};
+
 // color channels or gray channel
 const static QColor misc_theme_red(241, 79, 76, 255);
 const static QColor misc_theme_green(105, 213, 107, 255);
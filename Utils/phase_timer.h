@@ -0,0 +1,63 @@
+#ifndef PHASE_TIMER_H
+#define PHASE_TIMER_H
+
+#include <chrono>
+#include <string>
+#include <glog/logging.h>
+
+namespace Utils {
+
+/**
+ * @brief log durations of consecutive phases, e.g. of the startup
+ * @details messages are logged with LOG(INFO) and show up with --logtostderr
+ */
+class PhaseTimer {
+  typedef std::chrono::steady_clock clock;
+
+ public:
+  explicit PhaseTimer(std::string name)
+    : _name(name), _start(clock::now()), _last(_start), _finished(false) {}
+
+  /**
+   * @brief timer from process start to the first drawn frame
+   */
+  static PhaseTimer& startup() {
+    static PhaseTimer timer("startup");
+    return timer;
+  }
+
+  /**
+   * @brief log time since the previous phase ended
+   */
+  void mark(std::string phase) {
+    if (_finished)
+      return;
+    const clock::time_point now = clock::now();
+    LOG(INFO) << _name << ": " << phase
+              << " " << ms(_last, now) << " ms"
+              << " (total " << ms(_start, now) << " ms)";
+    _last = now;
+  }
+
+  /**
+   * @brief log last phase, later marks are ignored
+   */
+  void finish(std::string phase) {
+    mark(phase);
+    _finished = true;
+  }
+
+ private:
+  static double ms(clock::time_point a, clock::time_point b) {
+    return std::chrono::duration<double, std::milli>(b - a).count();
+  }
+
+  std::string _name;
+  clock::time_point _start;
+  clock::time_point _last;
+  bool _finished;
+};
+
+}; // namespace Utils
+
+#endif // PHASE_TIMER_H
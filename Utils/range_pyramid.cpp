@@ -0,0 +1,296 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include <glog/logging.h>
+
+#include "image_data.h"
+#include "range_pyramid.h"
+
+namespace {
+// blocks per side of a region which are combined at most
+const size_t MAX_SPAN = 32;
+// smallest highlighted region on screen (in screen pixels)
+const double MIN_SCREEN = 4;
+// zoomed out until a block is smaller, regions are whole blocks
+const double MIN_BLOCK_SCREEN = 8;
+// more visible non-finite pixels are shown as whole blocks
+const size_t MAX_PIXELS = 20000;
+
+/*
+Bit i is set where v[i] is NaN or Inf, i.e. all exponent bits are set, n <= 64.
+The test on the bits does not depend on the floating point environment.
+*/
+uint64_t nonFiniteBits(const float* v, uint n) {
+  uint64_t bits = 0;
+  uint i = 0;
+#ifdef __SSE2__
+  const __m128i exponent = _mm_set1_epi32(0x7f800000);
+  for (; i + 4 <= n; i += 4) {
+    const __m128i x = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(v + i)), exponent);
+    bits |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(x, exponent))) << i;
+  }
+#endif  // __SSE2__
+  for (; i < n; ++i) {
+    uint32_t x;
+    memcpy(&x, v + i, sizeof(x));
+    if ((x & 0x7f800000) == 0x7f800000)
+      bits |= (uint64_t)1 << i;
+  }
+  return bits;
+}
+}; // anonymous namespace
+
+Utils::RangePyramid::RangePyramid() : _height(0), _width(0) {}
+
+bool Utils::RangePyramid::available() const {
+  return !_levels.empty();
+}
+
+void Utils::RangePyramid::setImage(const ImageData *img) {
+  CHECK_EQ(img->tileSize(), 0) << "value ranges need a planar image";
+  _levels.clear();
+  _masks.clear();
+  _height = img->height();
+  _width = img->width();
+  if (img->data() == nullptr || img->area() == 0)
+    return;
+
+  level_t base;
+  base.height = (_height + BLOCK - 1) / BLOCK;
+  base.width = (_width + BLOCK - 1) / BLOCK;
+  base.min.assign((size_t)base.height * base.width, std::numeric_limits<float>::max());
+  base.max.assign((size_t)base.height * base.width, std::numeric_limits<float>::lowest());
+  base.nonfinite.assign((size_t)base.height * base.width, 0);
+
+  const float* data = img->data();
+  const size_t plane = img->area();
+  const int channels = img->channels();
+  // masks of the blocks with non-finite pixels, per row of blocks
+  std::vector<std::vector<std::pair<size_t, mask_t> > > found(base.height);
+  #pragma omp parallel for schedule(dynamic)
+  for (int bh = 0; bh < (int)base.height; ++bh) {
+    float* mn = &base.min[(size_t)bh * base.width];
+    float* mx = &base.max[(size_t)bh * base.width];
+    std::vector<mask_t> masks(base.width, mask_t());
+    const uint last = std::min((bh + 1) * BLOCK, _height);
+    for (int c = 0; c < channels; ++c)
+      for (uint h = bh * BLOCK; h < last; ++h) {
+        const float* row = data + c * plane + (size_t)h * _width;
+        for (uint bw = 0; bw < base.width; ++bw) {
+          const uint end = std::min((bw + 1) * BLOCK, _width);
+          const uint64_t bits = nonFiniteBits(row + bw * BLOCK, end - bw * BLOCK);
+          float lo = mn[bw], hi = mx[bw];
+          if (bits == 0) {
+            for (uint w = bw * BLOCK; w < end; ++w) {
+              lo = (row[w] < lo) ? row[w] : lo;
+              hi = (row[w] > hi) ? row[w] : hi;
+            }
+          } else {
+            // NaN/Inf would widen the range to infinity
+            for (uint w = bw * BLOCK; w < end; ++w) {
+              if ((bits >> (w - bw * BLOCK)) & 1)
+                continue;
+              lo = (row[w] < lo) ? row[w] : lo;
+              hi = (row[w] > hi) ? row[w] : hi;
+            }
+          }
+          mn[bw] = lo;
+          mx[bw] = hi;
+          masks[bw][h - bh * BLOCK] |= bits;
+        }
+      }
+    for (uint bw = 0; bw < base.width; ++bw) {
+      size_t count = 0;
+      for (uint64_t bits : masks[bw])
+        count += __builtin_popcountll(bits);
+      if (count == 0)
+        continue;
+      const size_t n = (size_t)bh * base.width + bw;
+      base.nonfinite[n] = count;
+      found[bh].emplace_back(n, masks[bw]);
+    }
+  }
+  for (auto &blocks : found)
+    for (auto &block : blocks)
+      _masks.insert(std::move(block));
+  _levels.push_back(std::move(base));
+
+  while (_levels.back().height > 1 || _levels.back().width > 1) {
+    const level_t &fine = _levels.back();
+    level_t coarse;
+    coarse.height = (fine.height + 1) / 2;
+    coarse.width = (fine.width + 1) / 2;
+    coarse.min.assign((size_t)coarse.height * coarse.width, std::numeric_limits<float>::max());
+    coarse.max.assign((size_t)coarse.height * coarse.width, std::numeric_limits<float>::lowest());
+    coarse.nonfinite.assign((size_t)coarse.height * coarse.width, 0);
+    for (uint h = 0; h < coarse.height; ++h)
+      for (uint w = 0; w < coarse.width; ++w) {
+        const size_t n = (size_t)h * coarse.width + w;
+        for (uint sh = 2 * h; sh < std::min(2 * h + 2, fine.height); ++sh)
+          for (uint sw = 2 * w; sw < std::min(2 * w + 2, fine.width); ++sw) {
+            const size_t s = (size_t)sh * fine.width + sw;
+            coarse.min[n] = std::min(coarse.min[n], fine.min[s]);
+            coarse.max[n] = std::max(coarse.max[n], fine.max[s]);
+            coarse.nonfinite[n] += fine.nonfinite[s];
+          }
+      }
+    _levels.push_back(std::move(coarse));
+  }
+  DLOG(INFO) << "value ranges of " << (size_t)_levels[0].height * _levels[0].width
+             << " blocks in " << _levels.size() << " levels, "
+             << nonFinite() << " non-finite pixels";
+}
+
+bool Utils::RangePyramid::range(int top, int left, int bottom, int right,
+                                float *min, float *max) const {
+  if (_levels.empty())
+    return false;
+  top = std::max(top, 0);
+  left = std::max(left, 0);
+  bottom = std::min(bottom, (int)_height);
+  right = std::min(right, (int)_width);
+  if (top >= bottom || left >= right)
+    return false;
+
+  // finest level where the region spans at most MAX_SPAN blocks per side
+  const size_t extent = std::max(bottom - top, right - left);
+  size_t l = 0;
+  while (l + 1 < _levels.size() && extent > MAX_SPAN * ((size_t)BLOCK << l))
+    l++;
+  const level_t &level = _levels[l];
+  const size_t block = (size_t)BLOCK << l;
+
+  float lo = std::numeric_limits<float>::max();
+  float hi = std::numeric_limits<float>::lowest();
+  for (size_t h = top / block; h <= (bottom - 1) / block; ++h)
+    for (size_t w = left / block; w <= (right - 1) / block; ++w) {
+      lo = std::min(lo, level.min[h * level.width + w]);
+      hi = std::max(hi, level.max[h * level.width + w]);
+    }
+  if (lo > hi)
+    return false;
+  *min = lo;
+  *max = hi;
+  return true;
+}
+
+size_t Utils::RangePyramid::nonFinite() const {
+  return _levels.empty() ? 0 : _levels.back().nonfinite[0];
+}
+
+bool Utils::RangePyramid::nextNonFinite(int afterH, int afterW, uint *h, uint *w) const {
+  if (nonFinite() == 0)
+    return false;
+  const level_t &base = _levels[0];
+  const size_t blocks = base.nonfinite.size();
+
+  // block and position within the block to continue after
+  size_t start = 0;
+  int after = -1;
+  if (afterH >= 0 && afterW >= 0 && afterH < (int)_height && afterW < (int)_width) {
+    start = (size_t)(afterH / BLOCK) * base.width + afterW / BLOCK;
+    after = (afterH % BLOCK) * BLOCK + afterW % BLOCK;
+  }
+
+  // the block of the start is visited twice: after and (wrapped) up to the start
+  for (size_t k = 0; k <= blocks; ++k) {
+    const size_t b = (start + k) % blocks;
+    if (base.nonfinite[b] == 0)
+      continue;
+    const mask_t &mask = _masks.at(b);
+    const int first = (k == 0) ? after + 1 : 0;
+    const int last = (k == blocks) ? after + 1 : (int)(BLOCK * BLOCK);
+    for (int i = first; i < last; i = (i / BLOCK + 1) * BLOCK) {
+      const uint64_t bits = mask[i / BLOCK] >> (i % BLOCK);
+      if (bits == 0)
+        continue;
+      const int j = i + __builtin_ctzll(bits);
+      if (j >= last)
+        break;
+      *h = (b / base.width) * BLOCK + j / BLOCK;
+      *w = (b % base.width) * BLOCK + j % BLOCK;
+      return true;
+    }
+  }
+  return false;
+}
+
+void Utils::RangePyramid::nonFiniteRegions(int top, int left, int bottom, int right,
+                                           double zoom,
+                                           std::vector<region_t> *regions) const {
+  regions->clear();
+  if (nonFinite() == 0 || zoom <= 0)
+    return;
+  top = std::max(top, 0);
+  left = std::max(left, 0);
+  bottom = std::min(bottom, (int)_height);
+  right = std::min(right, (int)_width);
+  if (top >= bottom || left >= right)
+    return;
+
+  // coarsest level whose blocks are still visible
+  size_t l = 0;
+  while (l + 1 < _levels.size() && (BLOCK << l) * zoom < MIN_BLOCK_SCREEN)
+    l++;
+  bool blocks = l > 0;
+  if (!blocks) {
+    // too many single pixels are shown as blocks
+    size_t visible = 0;
+    for (int bh = top / (int)BLOCK; bh <= (bottom - 1) / (int)BLOCK; ++bh)
+      for (int bw = left / (int)BLOCK; bw <= (right - 1) / (int)BLOCK; ++bw)
+        visible += _levels[0].nonfinite[(size_t)bh * _levels[0].width + bw];
+    blocks = visible > MAX_PIXELS;
+  }
+
+  const int minimum = (int)std::ceil(MIN_SCREEN / zoom);
+  auto add = [&](int t, int lt, int b, int r) {
+    // grow around the center
+    if (b - t < minimum) {
+      t -= (minimum - (b - t)) / 2;
+      b = t + minimum;
+    }
+    if (r - lt < minimum) {
+      lt -= (minimum - (r - lt)) / 2;
+      r = lt + minimum;
+    }
+    regions->push_back({t, lt, b, r});
+  };
+
+  if (blocks) {
+    const level_t &level = _levels[l];
+    const int block = BLOCK << l;
+    for (int bh = top / block; bh <= (bottom - 1) / block; ++bh)
+      for (int bw = left / block; bw <= (right - 1) / block; ++bw)
+        if (level.nonfinite[(size_t)bh * level.width + bw] > 0)
+          add(bh * block, bw * block,
+              std::min((bh + 1) * block, (int)_height),
+              std::min((bw + 1) * block, (int)_width));
+    return;
+  }
+
+  // horizontal runs of non-finite pixels
+  const level_t &base = _levels[0];
+  for (int bh = top / (int)BLOCK; bh <= (bottom - 1) / (int)BLOCK; ++bh)
+    for (int bw = left / (int)BLOCK; bw <= (right - 1) / (int)BLOCK; ++bw) {
+      const size_t b = (size_t)bh * base.width + bw;
+      if (base.nonfinite[b] == 0)
+        continue;
+      const mask_t &mask = _masks.at(b);
+      for (uint r = 0; r < BLOCK; ++r) {
+        uint64_t bits = mask[r];
+        while (bits != 0) {
+          const int first = __builtin_ctzll(bits);
+          // length of the run of set bits from first on
+          const uint64_t rest = ~(bits >> first);
+          const int length = (rest == 0) ? 64 - first : __builtin_ctzll(rest);
+          add(bh * BLOCK + r, bw * BLOCK + first,
+              bh * BLOCK + r + 1, bw * BLOCK + first + length);
+          bits = (first + length >= 64) ? 0 : bits & (~(uint64_t)0 << (first + length));
+        }
+      }
+    }
+}
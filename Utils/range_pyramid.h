@@ -0,0 +1,95 @@
+#ifndef RANGE_PYRAMID_H
+#define RANGE_PYRAMID_H
+
+#include <array>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+#include "misc.h"
+
+namespace Utils  {
+
+class ImageData;
+
+/**
+ * @brief value range of blocks of the original image, for all pyramid levels
+ * @details Level 0 holds min/max over all channels of each block of
+ *          BLOCK x BLOCK pixels, each coarser level combines 2x2 blocks. The
+ *          range of a region is answered from the level where it spans at
+ *          most a few dozen blocks per side, without touching pixels. Whole
+ *          blocks are taken into account, hence the range might be slightly
+ *          wider than the exact one at the border of the region. NaN and
+ *          Inf are ignored.
+ *          Non-finite pixels (NaN/Inf in any channel) are counted per block
+ *          on all levels, blocks containing some also keep a bitmask of
+ *          them. Both are built in the same pass as the ranges.
+ */
+class RangePyramid {
+ public:
+  static const uint BLOCK = 64;
+
+  struct region_t {
+    int top, left, bottom, right;
+  };
+
+  RangePyramid();
+
+  /**
+   * @brief scan a planar [C,H,W] image
+   */
+  void setImage(const ImageData *img);
+
+  /**
+   * @brief min/max of the region [top, bottom) x [left, right) of the image
+   * @return false if the region is outside of the image or has no values
+   */
+  bool range(int top, int left, int bottom, int right,
+             float *min, float *max) const;
+
+  /**
+   * @brief number of pixels with a NaN/Inf value in any channel
+   */
+  size_t nonFinite() const;
+
+  /**
+   * @brief next non-finite pixel after (afterH, afterW)
+   * @details blocks in row-major order, pixels in row-major order within a
+   *          block, wraps around at the end of the image
+   * @return false if the image has no non-finite pixel
+   */
+  bool nextNonFinite(int afterH, int afterW, uint *h, uint *w) const;
+
+  /**
+   * @brief regions [top, bottom) x [left, right) covering the non-finite
+   *        pixels within the region of the image
+   * @details Single pixels when zoomed in, whole blocks of the level which
+   *          stays visible when zoomed out (or if there are too many pixels).
+   *          Regions are enlarged to at least a few screen pixels.
+   *
+   * @param zoom screen pixels per image pixel
+   */
+  void nonFiniteRegions(int top, int left, int bottom, int right, double zoom,
+                        std::vector<region_t> *regions) const;
+
+  bool available() const;
+
+ private:
+  // bit w of row h is set for a non-finite pixel
+  typedef std::array<uint64_t, 64> mask_t;
+
+  struct level_t {
+    uint height, width;
+    // per block
+    std::vector<float> min, max;
+    std::vector<size_t> nonfinite;
+  };
+  std::vector<level_t> _levels;
+  // masks of level 0 blocks with non-finite pixels, by block index
+  std::unordered_map<size_t, mask_t> _masks;
+  uint _height;
+  uint _width;
+};
+
+}; // namespace Utils
+
+#endif // RANGE_PYRAMID_H
@@ -0,0 +1,234 @@
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <utility>
+#include <mutex>
+#include <vector>
+
+#include <QOpenGLFunctions>
+
+#include <glog/logging.h>
+#include <gflags/gflags.h>
+
+#include "texture_store.h"
+#include "mipmap_tile.h"
+#include "gl_object.h"
+
+DEFINE_int32(texture_budget, 2048,
+             "MB of tile textures kept in video memory, least recently drawn ones are evicted");
+DEFINE_int32(texture_pool, 256,
+             "MB of textures of released tiles kept for reuse by tiles of the same size");
+
+namespace {
+using std::chrono::steady_clock;
+
+// textures drawn recently are likely visible on some canvas
+const std::chrono::milliseconds GRACE(1000);
+// pixel buffers are only used for uploads, their size does not matter
+const size_t BUFFER_POOL = 64;
+
+// textures of the same shape can be reused
+uint64_t shapeKey(size_t height, size_t width, size_t channels) {
+  return ((uint64_t)height << 40) | ((uint64_t)width << 16) | channels;
+}
+
+struct texture_t {
+  size_t bytes;
+  const std::atomic<bool>* pinned;
+  steady_clock::time_point drawn;
+  std::list<Utils::MipmapTile*>::iterator lru;
+};
+
+/**
+ * @brief textures of all canvases
+ */
+class Residency {
+ public:
+  Residency() : _resident(0), _pooled(0), _buffered(0) {}
+
+  void uploaded(Utils::MipmapTile* tile, size_t bytes,
+                const std::atomic<bool>* pinned) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto it = _textures.find(tile);
+    if (it != _textures.end()) {
+      _resident -= it->second.bytes;
+      _lru.erase(it->second.lru);
+    }
+    _lru.push_front(tile);
+    _textures[tile] = {bytes, pinned, steady_clock::now(), _lru.begin()};
+    _resident += bytes;
+  }
+
+  void drawn(Utils::MipmapTile* tile) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto it = _textures.find(tile);
+    if (it == _textures.end())
+      return;
+    it->second.drawn = steady_clock::now();
+    _lru.splice(_lru.begin(), _lru, it->second.lru);
+  }
+
+  void release(Utils::MipmapTile* tile) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto it = _textures.find(tile);
+    if (it != _textures.end()) {
+      _resident -= it->second.bytes;
+      _lru.erase(it->second.lru);
+      _textures.erase(it);
+    }
+    const Utils::GlObject<float>* obj = tile->obj();
+    if (obj->texture_id != 0) {
+      // e.g. the next pyramid of a layer has tiles of the same size
+      if (_pooled + obj->size() <= (size_t) FLAGS_texture_pool * 1024 * 1024) {
+        _pool.insert({shapeKey(obj->height, obj->width, obj->channels), {obj->texture_id, obj->size()}});
+        _pooled += obj->size();
+      } else {
+        _textures_pending.push_back(obj->texture_id);
+      }
+    }
+    if (obj->buffer_id != 0)
+      poolBuffer(obj->buffer_id, obj->size());
+  }
+
+  void releaseBuffer(GLuint buffer, size_t bytes) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    poolBuffer(buffer, bytes);
+  }
+
+  GLuint recycleTexture(size_t height, size_t width, size_t channels) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto it = _pool.find(shapeKey(height, width, channels));
+    if (it == _pool.end())
+      return 0;
+    const GLuint id = it->second.first;
+    _pooled -= it->second.second;
+    _pool.erase(it);
+    return id;
+  }
+
+  GLuint recycleBuffer() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_buffer_pool.empty())
+      return 0;
+    const GLuint id = _buffer_pool.back().first;
+    _buffered -= _buffer_pool.back().second;
+    _buffer_pool.pop_back();
+    return id;
+  }
+
+  void collect(QOpenGLFunctions* gl) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (!_textures_pending.empty())
+      gl->glDeleteTextures(_textures_pending.size(), _textures_pending.data());
+    if (!_buffers_pending.empty())
+      gl->glDeleteBuffers(_buffers_pending.size(), _buffers_pending.data());
+    _textures_pending.clear();
+    _buffers_pending.clear();
+
+    // pooled textures and buffers hold video memory as well, they go first
+    const size_t budget = (size_t) FLAGS_texture_budget * 1024 * 1024;
+    if (_resident + _pooled + _buffered <= budget)
+      return;
+    while (_resident + _pooled + _buffered > budget && !_buffer_pool.empty()) {
+      gl->glDeleteBuffers(1, &_buffer_pool.back().first);
+      _buffered -= _buffer_pool.back().second;
+      _buffer_pool.pop_back();
+    }
+    while (_resident + _pooled + _buffered > budget && !_pool.empty()) {
+      auto pooled = _pool.begin();
+      gl->glDeleteTextures(1, &pooled->second.first);
+      _pooled -= pooled->second.second;
+      _pool.erase(pooled);
+    }
+
+    const steady_clock::time_point recent = steady_clock::now() - GRACE;
+    size_t evicted = 0;
+    auto it = _lru.end();
+    while (_resident + _pooled + _buffered > budget && it != _lru.begin()) {
+      --it;
+      Utils::MipmapTile* tile = *it;
+      texture_t &texture = _textures[tile];
+      if (texture.drawn > recent)
+        break;
+      if (texture.pinned != nullptr && *texture.pinned)
+        continue;
+      tile->unload(gl);
+      _resident -= texture.bytes;
+      evicted += texture.bytes;
+      _textures.erase(tile);
+      it = _lru.erase(it);
+    }
+    DLOG_IF(INFO, evicted > 0) << "evicted " << (evicted >> 20) << " MB of textures, "
+                               << ((_resident + _pooled + _buffered) >> 20) << " MB resident";
+  }
+
+  size_t resident() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _resident + _pooled + _buffered;
+  }
+
+ private:
+  // requires the lock
+  void poolBuffer(GLuint buffer, size_t bytes) {
+    if (_buffer_pool.size() < BUFFER_POOL) {
+      _buffer_pool.push_back({buffer, bytes});
+      _buffered += bytes;
+    } else {
+      _buffers_pending.push_back(buffer);
+    }
+  }
+
+  std::mutex _mutex;
+  size_t _resident;
+  std::map<Utils::MipmapTile*, texture_t> _textures;
+  // most recently drawn first
+  std::list<Utils::MipmapTile*> _lru;
+  // owners are gone, delete with the next current context
+  std::vector<GLuint> _textures_pending;
+  std::vector<GLuint> _buffers_pending;
+  // owners are gone, reused by the next uploads, id and bytes
+  std::multimap<uint64_t, std::pair<GLuint, size_t> > _pool;
+  size_t _pooled;
+  std::vector<std::pair<GLuint, size_t> > _buffer_pool;
+  size_t _buffered;
+};
+
+Residency& residency() {
+  static Residency r;
+  return r;
+}
+}; // anonymous namespace
+
+void Utils::TextureStore::uploaded(MipmapTile* tile, size_t bytes,
+                                   const std::atomic<bool>* pinned) {
+  residency().uploaded(tile, bytes, pinned);
+}
+
+void Utils::TextureStore::drawn(MipmapTile* tile) {
+  residency().drawn(tile);
+}
+
+void Utils::TextureStore::release(MipmapTile* tile) {
+  residency().release(tile);
+}
+
+GLuint Utils::TextureStore::recycleTexture(size_t height, size_t width, size_t channels) {
+  return residency().recycleTexture(height, width, channels);
+}
+
+GLuint Utils::TextureStore::recycleBuffer() {
+  return residency().recycleBuffer();
+}
+
+void Utils::TextureStore::releaseBuffer(GLuint buffer, size_t bytes) {
+  residency().releaseBuffer(buffer, bytes);
+}
+
+void Utils::TextureStore::collect(QOpenGLFunctions* gl) {
+  residency().collect(gl);
+}
+
+size_t Utils::TextureStore::resident() {
+  return residency().resident();
+}
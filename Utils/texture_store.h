@@ -0,0 +1,86 @@
+#ifndef TEXTURE_STORE_H
+#define TEXTURE_STORE_H
+
+#include <atomic>
+#include <cstddef>
+
+class QOpenGLFunctions;
+
+namespace Utils  {
+
+class MipmapTile;
+
+/**
+ * @brief residency of tile textures in video memory
+ * @details Textures of all pyramids (every layer on every canvas, contexts
+ *          are shared) count against --texture_budget, as do the textures
+ *          of released tiles and the pixel buffers kept for uploads. At the
+ *          start of a frame the pools are drained and then the least
+ *          recently drawn textures are deleted until the budget holds,
+ *          their tiles are uploaded again once they are drawn.
+ *          Textures of pinned pyramids (current slides, A/B set) and those
+ *          drawn within the last second are never evicted.
+ *          Deleting textures needs a current context, hence textures of
+ *          released tiles are queued and deleted by the next frame.
+ */
+class TextureStore {
+ public:
+  /**
+   * @brief track texture of tile
+   *
+   * @param bytes video memory of texture
+   * @param pinned flag of the owning pyramid, must outlive the tile
+   */
+  static void uploaded(MipmapTile* tile, size_t bytes,
+                       const std::atomic<bool>* pinned);
+
+  /**
+   * @brief mark texture as most recently used
+   */
+  static void drawn(MipmapTile* tile);
+
+  /**
+   * @brief forget tile and recycle its texture
+   * @details Textures are kept for tiles of the same shape up to
+   *          --texture_pool MB, the rest is queued for deletion. Safe without
+   *          a current context and from any thread.
+   */
+  static void release(MipmapTile* tile);
+
+  /**
+   * @brief texture of a released tile with the given shape
+   * @return texture id, 0 if there is none
+   */
+  static unsigned int recycleTexture(size_t height, size_t width, size_t channels);
+
+  /**
+   * @brief pixel buffer of a previous upload
+   * @return buffer id, 0 if there is none
+   */
+  static unsigned int recycleBuffer();
+
+  /**
+   * @brief give pixel buffer back once its upload is issued
+   * @details The next upload respecifies the storage by glBufferData, which
+   *          does not disturb a pending transfer to a texture, hence the
+   *          buffer can be reused right away.
+   *
+   * @param bytes storage of the buffer
+   */
+  static void releaseBuffer(unsigned int buffer, size_t bytes);
+
+  /**
+   * @brief delete queued textures, drain the pools and evict down to the budget
+   * @details requires a current context
+   */
+  static void collect(QOpenGLFunctions* gl);
+
+  /**
+   * @brief video memory of all tracked and pooled textures and buffers
+   */
+  static size_t resident();
+};
+
+}; // namespace Utils
+
+#endif // TEXTURE_STORE_H
@@ -0,0 +1,315 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <QDir>
+
+#include <glog/logging.h>
+#include <gflags/gflags.h>
+
+#include "tile_store.h"
+
+DEFINE_int32(out_of_core_threshold, 4096,
+             "images with more MB keep their tiles in a memory-mapped scratch file");
+DEFINE_int32(tile_budget, 8192,
+             "resident size of scratch tiles in MB before they are paged out");
+DEFINE_string(scratch_dir, "",
+              "directory of the scratch file (default: temp directory)");
+DEFINE_int32(tile_pool, 512,
+             "MB of released tile buffers kept for reuse, e.g. when a pyramid is rebuilt");
+
+namespace {
+const size_t PAGE = 4096;
+// the scratch file grows by mapping segments of at least this size
+const size_t SEGMENT = size_t(1) << 30;
+// buffers each thread keeps for itself
+const size_t THREAD_CACHE = 8;
+
+struct block_t {
+  size_t offset;
+  size_t bytes;
+  bool resident;
+  std::list<char*>::iterator lru;
+};
+
+/**
+ * @brief state of the scratch file
+ */
+class Scratch {
+ public:
+  Scratch() : _active(false), _fd(-1), _punch_hole(true), _file_size(0), _segment(nullptr),
+    _segment_offset(0), _cursor(nullptr), _left(0), _resident(0) {}
+
+  // no scratch buffer exists yet, hence nothing to look up
+  bool active() const {
+    return _active;
+  }
+
+  float* allocate(size_t bytes) {
+    bytes = (bytes + PAGE - 1) / PAGE * PAGE;
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    char* ptr = nullptr;
+    auto it = _free.lower_bound(bytes);
+    // reuse a released block unless it is much larger
+    if (it != _free.end() && it->first <= 2 * bytes) {
+      ptr = it->second;
+      _free.erase(it);
+    } else {
+      if (_left < bytes && !grow(bytes))
+        return nullptr;
+      ptr = _cursor;
+      _blocks[ptr] = {_segment_offset + (size_t)(_cursor - _segment), bytes, false, _lru.end()};
+      _cursor += bytes;
+      _left -= bytes;
+    }
+    // the caller fills the buffer right away
+    use(ptr, &_blocks[ptr]);
+    return reinterpret_cast<float*>(ptr);
+  }
+
+  bool release(float* p) {
+    char* ptr = reinterpret_cast<char*>(p);
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto it = _blocks.find(ptr);
+    if (it == _blocks.end())
+      return false;
+    block_t &block = it->second;
+    if (block.resident) {
+      _resident -= block.bytes;
+      _lru.erase(block.lru);
+      block.resident = false;
+    }
+    // drop content from page cache and disk
+    if (_punch_hole &&
+        fallocate(_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, block.offset, block.bytes) != 0) {
+      LOG(WARNING) << "scratch file does not support punching holes, "
+                   << "released tiles are dropped from memory only";
+      _punch_hole = false;
+    }
+    if (!_punch_hole && madvise(ptr, block.bytes, MADV_REMOVE) != 0)
+      madvise(ptr, block.bytes, MADV_DONTNEED);
+    _free.insert({block.bytes, ptr});
+    return true;
+  }
+
+  void touch(const float* p) {
+    char* ptr = reinterpret_cast<char*>(const_cast<float*>(p));
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto it = _blocks.find(ptr);
+    if (it != _blocks.end())
+      use(ptr, &it->second);
+  }
+
+ private:
+  bool grow(size_t bytes) {
+    if (_fd < 0) {
+      std::string dir = FLAGS_scratch_dir.empty() ? QDir::tempPath().toStdString() : FLAGS_scratch_dir;
+      std::string path = dir + "/saccade-scratch-XXXXXX";
+      std::vector<char> tmpl(path.begin(), path.end());
+      tmpl.push_back('\0');
+      _fd = mkstemp(tmpl.data());
+      if (_fd < 0) {
+        LOG(ERROR) << "cannot create scratch file in " << dir;
+        return false;
+      }
+      // the file vanishes with the process
+      unlink(tmpl.data());
+      _active = true;
+      DLOG(INFO) << "scratch file " << tmpl.data();
+    }
+    const size_t size = std::max(SEGMENT, bytes);
+    if (ftruncate(_fd, _file_size + size) != 0) {
+      LOG(ERROR) << "cannot grow scratch file to " << (_file_size + size) << " bytes";
+      return false;
+    }
+    void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, _file_size);
+    if (addr == MAP_FAILED) {
+      LOG(ERROR) << "cannot map scratch file";
+      return false;
+    }
+    // the rest of the previous segment is lost, segments are large compared to tiles
+    _segment = static_cast<char*>(addr);
+    _segment_offset = _file_size;
+    _cursor = _segment;
+    _left = size;
+    _file_size += size;
+    return true;
+  }
+
+  void use(char* ptr, block_t *block) {
+    if (block->resident) {
+      _lru.erase(block->lru);
+    } else {
+      block->resident = true;
+      _resident += block->bytes;
+    }
+    _lru.push_front(ptr);
+    block->lru = _lru.begin();
+
+    const size_t budget = (size_t) FLAGS_tile_budget * 1024 * 1024;
+    while (_resident > budget && _lru.size() > 1) {
+      char* victim = _lru.back();
+      block_t &old = _blocks[victim];
+      _lru.pop_back();
+      old.resident = false;
+      _resident -= old.bytes;
+      // content stays in the file and is paged in again on access
+#ifdef MADV_PAGEOUT
+      madvise(victim, old.bytes, MADV_PAGEOUT);
+#else
+      madvise(victim, old.bytes, MADV_DONTNEED);
+#endif
+    }
+  }
+
+  std::mutex _mutex;
+  std::atomic<bool> _active;
+  int _fd;
+  // the file system supports fallocate(FALLOC_FL_PUNCH_HOLE)
+  bool _punch_hole;
+  size_t _file_size;
+  char* _segment;
+  size_t _segment_offset;
+  char* _cursor;
+  size_t _left;
+  size_t _resident;
+
+  std::map<char*, block_t> _blocks;
+  std::multimap<size_t, char*> _free;
+  // most recently used first
+  std::list<char*> _lru;
+};
+
+Scratch& scratch() {
+  static Scratch s;
+  return s;
+}
+
+/**
+ * @brief released heap buffers by number of floats
+ */
+class Pool {
+ public:
+  Pool() : _bytes(0) {}
+
+  float* take(size_t elements) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto it = _free.find(elements);
+    if (it == _free.end() || it->second.empty())
+      return nullptr;
+    float* ptr = it->second.back();
+    it->second.pop_back();
+    _bytes -= elements * sizeof(float);
+    return ptr;
+  }
+
+  void put(float* ptr, size_t elements) {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      if (_bytes + elements * sizeof(float) <= (size_t) FLAGS_tile_pool * 1024 * 1024) {
+        _free[elements].push_back(ptr);
+        _bytes += elements * sizeof(float);
+        return;
+      }
+    }
+    delete[] ptr;
+  }
+
+ private:
+  std::mutex _mutex;
+  std::unordered_map<size_t, std::vector<float*> > _free;
+  size_t _bytes;
+};
+
+Pool& pool() {
+  static Pool p;
+  return p;
+}
+
+/**
+ * @brief few buffers of a single thread, handed to the pool on exit
+ */
+struct ThreadCache {
+  std::vector<std::pair<size_t, float*> > buffers;
+
+  ~ThreadCache() {
+    for (auto && b : buffers)
+      pool().put(b.second, b.first);
+  }
+
+  float* take(size_t elements) {
+    for (size_t i = 0; i < buffers.size(); ++i) {
+      if (buffers[i].first == elements) {
+        float* ptr = buffers[i].second;
+        buffers[i] = buffers.back();
+        buffers.pop_back();
+        return ptr;
+      }
+    }
+    return pool().take(elements);
+  }
+
+  void put(float* ptr, size_t elements) {
+    if (buffers.size() < THREAD_CACHE) {
+      buffers.push_back({elements, ptr});
+      return;
+    }
+    pool().put(ptr, elements);
+  }
+};
+
+ThreadCache& threadCache() {
+  // constructed before use, hence destroyed before the pool
+  pool();
+  static thread_local ThreadCache cache;
+  return cache;
+}
+}; // anonymous namespace
+
+bool Utils::TileStore::outOfCore(size_t bytes) {
+  return bytes > (size_t) FLAGS_out_of_core_threshold * 1024 * 1024;
+}
+
+float* Utils::TileStore::allocate(size_t elements, bool scratch_memory) {
+  if (scratch_memory) {
+    float* ptr = scratch().allocate(elements * sizeof(float));
+    if (ptr != nullptr)
+      return ptr;
+    LOG(WARNING) << "scratch file exhausted, fall back to heap";
+  }
+  float* ptr = threadCache().take(elements);
+  if (ptr != nullptr)
+    return ptr;
+  return new float[elements];
+}
+
+void Utils::TileStore::release(float* ptr) {
+  if (ptr == nullptr)
+    return;
+  if (!scratch().active() || !scratch().release(ptr))
+    delete[] ptr;
+}
+
+void Utils::TileStore::release(float* ptr, size_t elements) {
+  if (ptr == nullptr)
+    return;
+  if (!scratch().active() || !scratch().release(ptr))
+    threadCache().put(ptr, elements);
+}
+
+void Utils::TileStore::touch(const float* ptr) {
+  if (scratch().active())
+    scratch().touch(ptr);
+}
@@ -0,0 +1,61 @@
+#ifndef TILE_STORE_H
+#define TILE_STORE_H
+
+#include <cstddef>
+
+namespace Utils  {
+
+/**
+ * @brief memory of tiles and image buffers of very large images
+ * @details Buffers of images larger than --out_of_core_threshold are carved
+ *          from an unlinked scratch file which is mapped into memory. The OS
+ *          pages them in and out, such that images exceeding the physical
+ *          memory can be displayed. Recently used scratch buffers are kept
+ *          resident up to --tile_budget, older ones are paged out explicitly.
+ *          All other buffers are heap allocations, which are pooled by size.
+ */
+class TileStore {
+ public:
+  /**
+   * @brief buffers of an image of this size should live in the scratch file
+   */
+  static bool outOfCore(size_t bytes);
+
+  /**
+   * @brief allocate buffer of floats
+   * @details heap buffers are recycled from the pool if one of the same size
+   *          was released before (see release(ptr, elements))
+   *
+   * @param elements number of floats
+   * @param scratch take memory from the scratch file instead of the heap
+   */
+  static float* allocate(size_t elements, bool scratch);
+
+  /**
+   * @brief give buffer back (scratch or heap)
+   * @details heap buffers (also those allocated by the image loaders) are
+   *          deleted, scratch buffers are punched out of the scratch file
+   */
+  static void release(float* ptr);
+
+  /**
+   * @brief give buffer of known size back
+   * @details Heap buffers are kept for the next allocation of the same size
+   *          up to --tile_pool MB, e.g. tiles of a rebuilt pyramid. Each
+   *          thread keeps a few buffers for itself without locking.
+   *
+   * @param elements number of floats the buffer was allocated with
+   */
+  static void release(float* ptr, size_t elements);
+
+  /**
+   * @brief mark buffer as used, e.g. when uploaded to a texture
+   * @details pages out the least recently used scratch buffers when the
+   *          resident size exceeds the budget; ignores heap buffers
+   */
+  static void touch(const float* ptr);
+};
+
+}; // namespace Utils
+
+#endif // TILE_STORE_H
@@ -0,0 +1,123 @@
+#include <algorithm>
+#include <memory>
+#include <glog/logging.h>
+
+#include "volume.h"
+#include "image_data.h"
+#include "mipmap.h"
+#include "gl_manager.h"
+
+Utils::Volume::Volume() : _slices(0) {}
+Utils::Volume::~Volume() {}
+
+void Utils::Volume::clear() {
+  for (auto && level : _levels) {
+    for (auto && slice : level) {
+      slice->clear();
+      delete slice;
+    }
+  }
+  _levels.clear();
+  _slices = 0;
+}
+
+bool Utils::Volume::empty() const {
+  return _levels.empty();
+}
+
+int Utils::Volume::depth() const {
+  return 1 + _levels.size();
+}
+
+int Utils::Volume::slices(int level) const {
+  if (level == 0)
+    return _slices;
+  return _levels[level - 1].size();
+}
+
+float* Utils::Volume::reduce(const float* a, const float* b,
+                             uint height, uint width, uint channels) const {
+  const uint nheight = (height + 1) / 2;
+  const uint nwidth = (width + 1) / 2;
+  float* d = new float[(size_t)nheight * nwidth * channels];
+
+  #pragma omp parallel for
+  for (uint n = 0; n < channels * nheight; ++n) {
+    const uint c = n / nheight;
+    const uint h = n % nheight;
+    const size_t plane = (size_t)height * width;
+    const uint h0 = 2 * h;
+    const uint h1 = std::min(2 * h + 1, height - 1);
+    for (uint w = 0; w < nwidth; ++w) {
+      const uint w0 = 2 * w;
+      const uint w1 = std::min(2 * w + 1, width - 1);
+      float sum = 0;
+      for (const float* s : {a, b}) {
+        const float* p = s + c * plane;
+        sum += p[(size_t)h0 * width + w0] + p[(size_t)h0 * width + w1]
+               + p[(size_t)h1 * width + w0] + p[(size_t)h1 * width + w1];
+      }
+      d[(size_t)c * nheight * nwidth + (size_t)h * nwidth + w] = sum / 8.f;
+    }
+  }
+  return d;
+}
+
+void Utils::Volume::setData(const std::vector<const float*> &slices,
+                            uint height, uint width, uint channels) {
+  DLOG(INFO) << "Utils::Volume::setData " << slices.size() << " slices";
+  _slices = slices.size();
+
+  std::vector<const float*> current = slices;
+  uint cur_height = height;
+  uint cur_width = width;
+
+  // stop as soon as there is a single slice or a single pixel left
+  while (current.size() > 1 && cur_height > 1 && cur_width > 1) {
+    std::vector<float*> next;
+    for (size_t z = 0; z < current.size(); z += 2) {
+      const float* a = current[z];
+      const float* b = (z + 1 < current.size()) ? current[z + 1] : a;
+      next.push_back(reduce(a, b, cur_height, cur_width, channels));
+    }
+    cur_height = (cur_height + 1) / 2;
+    cur_width = (cur_width + 1) / 2;
+
+    // tiles are materialized from the slice when they become visible, the
+    // slice lives as long as its mipmap
+    std::vector<Mipmap*> level;
+    for (auto && slice : next) {
+      std::shared_ptr<const ImageData> img(new ImageData(slice, cur_height, cur_width, channels),
+                                           [slice](const ImageData* i) {
+                                             delete i;
+                                             delete[] slice;
+                                           });
+      Mipmap *m = new Mipmap();
+      m->setData(img);
+      level.push_back(m);
+    }
+    _levels.push_back(level);
+    DLOG(INFO) << "create z-level " << _levels.size()
+               << " " << next.size() << " x " << cur_height << " x " << cur_width;
+
+    current.assign(next.begin(), next.end());
+  }
+}
+
+void Utils::Volume::draw(Utils::GlManager *gl, int level, int z,
+                         int top, int left, int bottom, int right,
+                         double zoom) {
+  CHECK_GT(level, 0);
+  CHECK_LT(level, depth());
+  const int scale = 1 << level;
+  const int id = std::min(z / scale, slices(level) - 1);
+
+  // slices of z-level k are smaller by 2^k in x and y
+  glPushMatrix();
+  glScaled(scale, scale, 1.0);
+  _levels[level - 1][id]->draw(gl,
+                               top / scale, left / scale,
+                               bottom / scale, right / scale,
+                               zoom * scale);
+  glPopMatrix();
+}
@@ -0,0 +1,74 @@
+#ifndef VOLUME_H
+#define VOLUME_H
+
+#include <vector>
+#include "misc.h"
+
+namespace Utils  {
+
+class Mipmap;
+class GlManager;
+
+/**
+ * @brief z-aware pyramid for a stack of equally sized slices
+ * @details z-level k holds ceil(n / 2^k) slices, each downsampled by 2^k in
+ *          x, y and z (2x2x2 box filter of the previous z-level). Every slice
+ *          carries its own 2D mipmap whose tiles are materialized when they
+ *          become visible, the downsampled slice is kept as its source.
+ *          z-level 0 are the slices themselves and is not stored here.
+ */
+class Volume {
+ public:
+  Volume();
+  ~Volume();
+
+  /**
+   * @brief downsample all coarse z-levels
+   * @details the 2D pyramids of the slices are built lazily (see Mipmap)
+   *
+   * @param slices planar [C,H,W] buffers ordered by z
+   */
+  void setData(const std::vector<const float*> &slices,
+               uint height, uint width, uint channels);
+
+  /**
+   * @brief number of z-levels including level 0
+   */
+  int depth() const;
+  /**
+   * @brief number of slices in z-level
+   */
+  int slices(int level) const;
+
+  /**
+   * @brief Draw the slice covering z (in level-0 numbering) from given z-level
+   * @details coordinates are given in level-0 image space
+   *
+   * @param gl wrapper for OpenGL
+   * @param level z-level (> 0)
+   * @param z slice id at z-level 0
+   * @param zoom pixel size
+   */
+  void draw(Utils::GlManager *gl, int level, int z,
+            int top, int left, int bottom, int right,
+            double zoom);
+
+  void clear();
+  bool empty() const;
+
+ private:
+  /**
+   * @brief 2x2x2 box filter of two planar slices
+   * @details dimensions are rounded up, the border is replicated
+   */
+  float* reduce(const float* a, const float* b,
+                uint height, uint width, uint channels) const;
+
+  // _levels[k - 1] are the slices of z-level k
+  std::vector<std::vector<Mipmap*> > _levels;
+  int _slices;
+};
+
+}; // namespace Utils
+
+#endif // VOLUME_H
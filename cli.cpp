@@ -0,0 +1,438 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <glog/logging.h>
+#include <gflags/gflags.h>
+
+#include "Utils/image_data.h"
+#include "Utils/image_writer.h"
+#include "Utils/histogram_data.h"
+#include "Utils/mipmap.h"
+#include "Utils/mipmap_level.h"
+#include "Utils/Ops/histogram_op.h"
+
+DEFINE_string(mode, "stats", "stats, crop, thumbnail, convert, bench_view or bench_pyramid");
+DEFINE_string(output_format, "json", "format of the results: json or csv");
+DEFINE_string(output, "", "file for the results (default: stdout)");
+DEFINE_string(out_dir, ".", "directory of written images");
+DEFINE_string(ext, "png", "format of written images: png, qoi, tif, exr or pfm");
+DEFINE_string(crop, "", "crop rectangle \"top,left,bottom,right\" (mode crop)");
+DEFINE_int32(thumbnail_size, 256, "longest side of thumbnails (mode thumbnail)");
+DEFINE_string(range, "", "values \"min,max\" mapped to [0, 1] for 8/16-bit output (default: 0,max of file)");
+DEFINE_bool(histogram, false, "include 256-bin histograms in the json stats");
+
+/*
+Headless batch processing with the loaders, histogram and writer of the viewer.
+Neither widgets nor an OpenGL context are created, files are processed in
+parallel.
+
+  saccade-cli --mode stats --output_format csv *.png > stats.csv
+  saccade-cli --mode crop --crop 100,200,356,456 --out_dir crops --ext tif *.exr
+  saccade-cli --mode thumbnail --thumbnail_size 128 --out_dir thumbs *.jpg
+  saccade-cli --mode convert --out_dir flow_png *.flo
+
+The mode bench_view needs no files, it measures the time per frame spent on
+finding the visible tiles of a 1920x1080 view for growing image sizes.
+
+  saccade-cli --mode bench_view --output_format csv
+
+The mode bench_pyramid builds all levels of a 50 megapixel image with each
+reduction, the prefilters should take less than twice the time of the mean.
+
+  saccade-cli --mode bench_pyramid --output_format csv
+*/
+
+namespace {
+
+struct channel_stats_t {
+  float min, max;
+  double mean;
+  std::vector<double> counts;
+};
+
+struct result_t {
+  std::string file;
+  bool ok;
+  std::string error;
+  int height, width, channels;
+  float max_value;
+  std::vector<channel_stats_t> stats;
+  std::string written;
+};
+
+template<typename T>
+bool parse(std::string s, std::vector<T> *values, size_t n) {
+  std::replace(s.begin(), s.end(), ',', ' ');
+  std::istringstream in(s);
+  T v;
+  while (in >> v)
+    values->push_back(v);
+  return values->size() == n;
+}
+
+std::string baseName(std::string fn) {
+  const size_t slash = fn.find_last_of('/');
+  if (slash != std::string::npos)
+    fn = fn.substr(slash + 1);
+  const size_t dot = fn.find_last_of('.');
+  return (dot == std::string::npos) ? fn : fn.substr(0, dot);
+}
+
+std::string jsonString(std::string s) {
+  std::string out = "\"";
+  for (char c : s) {
+    if (c == '"' || c == '\\')
+      out += '\\';
+    out += c;
+  }
+  return out + "\"";
+}
+
+// json has no NaN and Inf
+std::string jsonNumber(double v) {
+  if (!std::isfinite(v))
+    return "null";
+  std::ostringstream out;
+  out.precision(std::numeric_limits<float>::max_digits10);
+  out << v;
+  return out.str();
+}
+
+std::string csvString(std::string s) {
+  if (s.find_first_of(",\"\n") == std::string::npos)
+    return s;
+  std::string out = "\"";
+  for (char c : s) {
+    if (c == '"')
+      out += '"';
+    out += c;
+  }
+  return out + "\"";
+}
+
+/**
+ * @brief box filter such that the longest side has at most size pixels
+ */
+float* thumbnail(const float* src, int height, int width, int channels,
+                 int size, int *out_height, int *out_width) {
+  const double factor = std::max(1.0, std::max(height, width) / (double) size);
+  *out_height = std::max(1, (int) std::ceil(height / factor));
+  *out_width = std::max(1, (int) std::ceil(width / factor));
+  const size_t area = (size_t)height * width;
+  const size_t out_area = (size_t)(*out_height) * (*out_width);
+
+  float* dst = new float[out_area * channels];
+  for (int c = 0; c < channels; ++c) {
+    for (int y = 0; y < *out_height; ++y) {
+      const int h0 = y * factor;
+      const int h1 = std::max(h0 + 1, std::min(height, (int)((y + 1) * factor)));
+      for (int x = 0; x < *out_width; ++x) {
+        const int w0 = x * factor;
+        const int w1 = std::max(w0 + 1, std::min(width, (int)((x + 1) * factor)));
+        double sum = 0;
+        for (int h = h0; h < h1; ++h)
+          for (int w = w0; w < w1; ++w)
+            sum += src[c * area + (size_t)h * width + w];
+        dst[c * out_area + (size_t)y * (*out_width) + x] = sum / ((h1 - h0) * (w1 - w0));
+      }
+    }
+  }
+  return dst;
+}
+
+void stats(const Utils::ImageData &img, result_t *r) {
+  Utils::HistogramData hist;
+  if (FLAGS_histogram)
+    hist.setImage(&img, img.max());
+
+  for (int c = 0; c < img.channels(); ++c) {
+    channel_stats_t s;
+    s.min = std::numeric_limits<float>::max();
+    s.max = std::numeric_limits<float>::lowest();
+    double sum = 0;
+    for (size_t t = 0; t < img.area(); ++t) {
+      const float v = img.value(t, c);
+      s.min = std::min(s.min, v);
+      s.max = std::max(s.max, v);
+      sum += v;
+    }
+    s.mean = sum / img.area();
+    if (FLAGS_histogram)
+      s.counts = hist.counts()[c];
+    r->stats.push_back(s);
+  }
+}
+
+/**
+ * @brief write buffer like the viewer does
+ * @details float formats keep the values, all others are mapped by the
+ *          HistogramOp of the viewer from [min, max] to [0, 1]
+ */
+bool write(std::string fn, float* buf, int height, int width, int channels,
+           float max_value) {
+  if (!Utils::ImageWriter::lossless(Utils::ImageWriter::format(fn))) {
+    std::vector<float> range;
+    Utils::Ops::HistogramOp op;
+    op._scaling.scale = max_value;
+    op._scaling.min = 0;
+    op._scaling.max = max_value;
+    if (!FLAGS_range.empty() && parse(FLAGS_range, &range, 2)) {
+      op._scaling.min = range[0];
+      op._scaling.max = range[1];
+    }
+    op.apply_cpu(buf, buf, height, width, channels);
+  }
+  return Utils::ImageWriter::write(fn, buf, height, width, channels);
+}
+
+void process(std::string fn, result_t *r) {
+  r->file = fn;
+  r->ok = false;
+  if (!Utils::ImageData::knownImageFormat(fn)) {
+    r->error = "unknown format";
+    return;
+  }
+  Utils::ImageData img(fn);
+  if (img.data() == nullptr || img.area() == 0) {
+    r->error = "cannot load";
+    return;
+  }
+  r->height = img.height();
+  r->width = img.width();
+  r->channels = img.channels();
+  r->max_value = img.max();
+
+  if (FLAGS_mode == "stats") {
+    stats(img, r);
+    r->ok = true;
+    img.clear();
+    return;
+  }
+
+  int height = img.height(), width = img.width();
+  float *buf = nullptr;
+  std::string suffix;
+  if (FLAGS_mode == "crop") {
+    std::vector<int> c;
+    parse(FLAGS_crop, &c, 4);
+    buf = Utils::ImageWriter::crop(img.data(), img.height(), img.width(), img.channels(),
+                                   c[0], c[1], c[2], c[3], &height, &width);
+    suffix = "-crop-t" + std::to_string(c[0]) + "-l" + std::to_string(c[1])
+             + "-b" + std::to_string(c[2]) + "-r" + std::to_string(c[3]);
+  } else if (FLAGS_mode == "thumbnail") {
+    buf = thumbnail(img.data(), img.height(), img.width(), img.channels(),
+                    FLAGS_thumbnail_size, &height, &width);
+    suffix = "-thumb";
+  } else {
+    buf = Utils::ImageWriter::crop(img.data(), img.height(), img.width(), img.channels(),
+                                   0, 0, img.height(), img.width(), &height, &width);
+  }
+
+  r->height = height;
+  r->width = width;
+  r->written = FLAGS_out_dir + "/" + baseName(fn) + suffix + "." + FLAGS_ext;
+  r->ok = write(r->written, buf, height, width, img.channels(), img.max());
+  if (!r->ok)
+    r->error = "cannot write " + r->written;
+  delete[] buf;
+  img.clear();
+}
+
+void printJson(std::ostream &out, const std::vector<result_t> &results) {
+  out << "[\n";
+  for (size_t i = 0; i < results.size(); ++i) {
+    const result_t &r = results[i];
+    out << "  {\"file\": " << jsonString(r.file) << ", \"ok\": " << (r.ok ? "true" : "false");
+    if (!r.ok) {
+      out << ", \"error\": " << jsonString(r.error);
+    } else {
+      out << ", \"height\": " << r.height << ", \"width\": " << r.width
+          << ", \"channels\": " << r.channels << ", \"max_value\": " << jsonNumber(r.max_value);
+      if (!r.written.empty())
+        out << ", \"output\": " << jsonString(r.written);
+      if (!r.stats.empty()) {
+        out << ", \"stats\": [";
+        for (size_t c = 0; c < r.stats.size(); ++c) {
+          const channel_stats_t &s = r.stats[c];
+          out << (c ? ", " : "") << "{\"min\": " << jsonNumber(s.min)
+              << ", \"max\": " << jsonNumber(s.max)
+              << ", \"mean\": " << jsonNumber(s.mean);
+          if (!s.counts.empty()) {
+            out << ", \"histogram\": [";
+            for (size_t b = 0; b < s.counts.size(); ++b)
+              out << (b ? ", " : "") << s.counts[b];
+            out << "]";
+          }
+          out << "}";
+        }
+        out << "]";
+      }
+    }
+    out << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+  }
+  out << "]\n";
+}
+
+void printCsv(std::ostream &out, const std::vector<result_t> &results) {
+  if (FLAGS_mode == "stats") {
+    out << "file,ok,height,width,channel,min,max,mean\n";
+    for (auto && r : results) {
+      if (!r.ok) {
+        out << csvString(r.file) << ",false,,,,,,\n";
+        continue;
+      }
+      for (size_t c = 0; c < r.stats.size(); ++c)
+        out << csvString(r.file) << ",true," << r.height << "," << r.width << "," << c << ","
+            << r.stats[c].min << "," << r.stats[c].max << "," << r.stats[c].mean << "\n";
+    }
+  } else {
+    out << "file,ok,output,height,width,channels\n";
+    for (auto && r : results) {
+      out << csvString(r.file) << "," << (r.ok ? "true" : "false") << ","
+          << csvString(r.ok ? r.written : r.error) << ",";
+      if (r.ok)
+        out << r.height << "," << r.width << "," << r.channels;
+      else
+        out << ",,";
+      out << "\n";
+    }
+  }
+}
+
+// per-frame cost of the visible tile lookup, should not depend on the image size
+void benchView(std::ostream &out) {
+  const int viewH = 1080, viewW = 1920, frames = 10000;
+  const bool csv = FLAGS_output_format == "csv";
+  out << (csv ? "height,width,tiles,visible,us_per_frame\n" : "[\n");
+  for (uint side = 1024; side <= (1u << 18); side *= 2) {
+    Utils::MipmapLevel level;
+    level.initGrid(side, side, 3, 512);
+
+    size_t visible = 0;
+    const auto start = std::chrono::steady_clock::now();
+    for (int f = 0; f < frames; ++f) {
+      // pan diagonally across the image
+      const int top = (int)(((size_t)f * 7919) % side) - viewH / 2;
+      const int left = (int)(((size_t)f * 6271) % side) - viewW / 2;
+      const Utils::TileRange range = level.visibleRange(top, left, top + viewH, left + viewW, 1.0);
+      range.forEach([&](uint, uint) {visible++;});
+    }
+    const double us = std::chrono::duration<double, std::micro>(
+                        std::chrono::steady_clock::now() - start).count() / frames;
+
+    const size_t tiles = (size_t)level.gridHeight() * level.gridWidth();
+    if (csv)
+      out << side << "," << side << "," << tiles << "," << visible / frames << "," << us << "\n";
+    else
+      out << "  {\"height\": " << side << ", \"width\": " << side << ", \"tiles\": " << tiles
+          << ", \"visible\": " << visible / frames << ", \"us_per_frame\": " << us << "}"
+          << (side < (1u << 18) ? "," : "") << "\n";
+  }
+  if (!csv)
+    out << "]\n";
+}
+
+// time to build all levels of a synthetic image per reduction and channel count
+void benchPyramid(std::ostream &out) {
+  const uint height = 6144, width = 8192;
+  const bool csv = FLAGS_output_format == "csv";
+  const std::vector<std::pair<PyramidReduction, std::string> > reductions = {
+    {PyramidReduction::MEAN, "mean"}, {PyramidReduction::MAX, "max"},
+    {PyramidReduction::LANCZOS, "lanczos"}, {PyramidReduction::GAUSSIAN, "gaussian"}
+  };
+  out << (csv ? "channels,reduction,ms,relative\n" : "[\n");
+  for (uint channels : {1u, 3u}) {
+    // texture with detail at all scales
+    std::vector<float> img((size_t)height * width * channels);
+    for (size_t n = 0; n < img.size(); ++n)
+      img[n] = 0.5f + 0.5f * std::sin(0.001f * (float)((n * n) % 1000003));
+
+    double mean_ms = 0;
+    for (const auto &r : reductions) {
+      Utils::Mipmap mipmap;
+      mipmap.setReduction(r.first);
+      mipmap.setData(img.data(), height, width, channels);
+      const auto start = std::chrono::steady_clock::now();
+      mipmap.buildLevels(mipmap.depth() - 1);
+      const double ms = std::chrono::duration<double, std::milli>(
+                          std::chrono::steady_clock::now() - start).count();
+      if (r.first == PyramidReduction::MEAN)
+        mean_ms = ms;
+
+      if (csv)
+        out << channels << "," << r.second << "," << ms << "," << ms / mean_ms << "\n";
+      else
+        out << "  {\"channels\": " << channels << ", \"reduction\": \"" << r.second
+            << "\", \"ms\": " << ms << ", \"relative\": " << ms / mean_ms << "}"
+            << ((channels == 3 && &r == &reductions.back()) ? "" : ",") << "\n";
+    }
+  }
+  if (!csv)
+    out << "]\n";
+}
+
+}; // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  google::InitGoogleLogging(argv[0]);
+  google::SetUsageMessage("saccade-cli [flags] files...");
+  google::ParseCommandLineFlags(&argc, &argv, true);
+
+  std::ofstream file;
+  if (!FLAGS_output.empty())
+    file.open(FLAGS_output);
+  std::ostream &out = FLAGS_output.empty() ? std::cout : file;
+
+  if (FLAGS_mode == "bench_view") {
+    benchView(out);
+    return 0;
+  }
+  if (FLAGS_mode == "bench_pyramid") {
+    benchPyramid(out);
+    return 0;
+  }
+
+  std::vector<std::string> files(argv + 1, argv + argc);
+  if (files.empty()) {
+    std::cerr << google::ProgramUsage() << std::endl;
+    return 1;
+  }
+  const std::vector<std::string> modes = {"stats", "crop", "thumbnail", "convert"};
+  if (std::find(modes.begin(), modes.end(), FLAGS_mode) == modes.end()) {
+    std::cerr << "unknown --mode " << FLAGS_mode << std::endl;
+    return 1;
+  }
+  std::vector<int> crop;
+  if (FLAGS_mode == "crop" && !parse(FLAGS_crop, &crop, 4)) {
+    std::cerr << "--crop needs top,left,bottom,right" << std::endl;
+    return 1;
+  }
+
+  std::vector<result_t> results(files.size());
+  #pragma omp parallel for schedule(dynamic)
+  for (size_t i = 0; i < files.size(); ++i)
+    process(files[i], &results[i]);
+
+  out.precision(std::numeric_limits<float>::max_digits10);
+
+  if (FLAGS_output_format == "csv")
+    printCsv(out, results);
+  else
+    printJson(out, results);
+
+  int failed = 0;
+  for (auto && r : results) {
+    LOG_IF(WARNING, !r.ok) << r.file << ": " << r.error;
+    failed += !r.ok;
+  }
+  return failed > 0 ? 2 : 0;
+}
@@ -0,0 +1,60 @@
+# Sets:
+#   OPENEXR_FOUND: TRUE if OpenEXR is found.
+#   OPENEXR_INCLUDE_DIRS: Include directories for OpenEXR.
+#   OPENEXR_LIBRARIES: Libraries required to link OpenEXR.
+#
+# The following variables control the behavior of this module:
+#
+# OPENEXR_INCLUDE_DIR_HINTS: List of additional directories in which to
+#                            search for OpenEXR includes.
+# OPENEXR_LIBRARY_DIR_HINTS: List of additional directories in which to
+#                            search for OpenEXR libraries.
+
+list(APPEND OPENEXR_CHECK_INCLUDE_DIRS
+    ${OPENEXR_INCLUDE_DIR_HINTS}
+    /usr/include
+    /usr/local/include
+    /opt/include
+    /opt/local/include
+)
+
+list(APPEND OPENEXR_CHECK_LIBRARY_DIRS
+    ${OPENEXR_LIBRARY_DIR_HINTS}
+    /usr/lib
+    /usr/local/lib
+    /opt/lib
+    /opt/local/lib
+)
+
+find_path(OPENEXR_INCLUDE_DIR
+    NAMES
+    OpenEXR/ImfInputFile.h
+    PATHS
+    ${OPENEXR_CHECK_INCLUDE_DIRS})
+
+foreach(OPENEXR_LIB IlmImf Half Iex IlmThread Imath)
+    find_library(OPENEXR_${OPENEXR_LIB}_LIBRARY
+        NAMES
+        ${OPENEXR_LIB}
+        PATHS
+        ${OPENEXR_CHECK_LIBRARY_DIRS})
+    if(OPENEXR_${OPENEXR_LIB}_LIBRARY)
+        list(APPEND OPENEXR_LIBRARIES ${OPENEXR_${OPENEXR_LIB}_LIBRARY})
+    endif()
+endforeach()
+
+if(OPENEXR_INCLUDE_DIR AND OPENEXR_IlmImf_LIBRARY AND OPENEXR_Half_LIBRARY)
+    set(OPENEXR_FOUND TRUE)
+    # headers include each other without the "OpenEXR/" prefix
+    set(OPENEXR_INCLUDE_DIRS ${OPENEXR_INCLUDE_DIR} ${OPENEXR_INCLUDE_DIR}/OpenEXR)
+endif()
+
+if(OPENEXR_FOUND)
+    message(STATUS "Found OpenEXR")
+    message(STATUS "  Includes : ${OPENEXR_INCLUDE_DIRS}")
+    message(STATUS "  Libraries : ${OPENEXR_LIBRARIES}")
+else()
+    if(OpenEXR_FIND_REQUIRED)
+        message(FATAL_ERROR "Could not find OpenEXR")
+    endif()
+endif()
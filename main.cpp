@@ -10,6 +10,7 @@
 #include "GUI/window.h"
 #include "Utils/version.h"
 #include "Utils/misc.h"
+#include "Utils/phase_timer.h"
 
 void set_style(QPalette *p) {
 
@@ -34,15 +35,21 @@ void set_style(QPalette *p) {
 
 // call by ./saccade --logtostderr=1
 int main(int argc, char *argv[]) {
+  // starts the clock
+  Utils::PhaseTimer &timer = Utils::PhaseTimer::startup();
 
   // FLAGS_alsologtostderr = 1;
   google::InitGoogleLogging(argv[0]);
   google::ParseCommandLineFlags(&argc, &argv, true);
+  timer.mark("parse flags");
 
   DLOG(INFO) << Utils::versionInfo();
   DLOG(INFO) << Utils::buildInfo();
   DLOG(INFO) << "omp_get_max_threads() " << omp_get_max_threads();
+  // canvases share their tile textures and a single video memory budget
+  QCoreApplication::setAttribute(Qt::AA_ShareOpenGLContexts);
   QApplication app(argc, argv);
+  timer.mark("create application");
 
   DLOG(INFO) << "override style";
   QPalette p;
@@ -50,6 +57,7 @@ int main(int argc, char *argv[]) {
   app.setStyle("Fusion");
   app.setPalette(p);
   app.setQuitOnLastWindowClosed(false);
+  timer.mark("set style");
 
   // Load the embedded font.
   QString fontPath = ":Ubuntu-R.ttf";
@@ -58,10 +66,12 @@ int main(int argc, char *argv[]) {
     QFont font("Ubuntu-R");
     app.setFont(font);
   }
+  timer.mark("load font");
 
   GUI::Window window(&app);
   window.setWindowIcon(QIcon(":Icon/256x256/saccade.png"));
   window.setWindowTitle("Saccade");
+  timer.mark("create window");
 
   return app.exec();
 }